@@ -15,12 +15,22 @@ vs_env.mk:
 
 include vs_env.mk
 
+# IR file format (e.g. make ir IR_FORMAT=bc): ll for textual IR, bc for
+# bitcode, which is several times smaller and faster to read and write. With
+# bc every stage exchanges .bc files (final.bc, final-obf.bc); IR_DUMP=1 also
+# disassembles the final files to .ll for debugging
+IR_FORMAT ?= ll
+IR_DUMP ?=
+ifeq ($(filter ll bc,$(IR_FORMAT)),)
+  $(error IR_FORMAT must be ll or bc)
+endif
+
 IR_SRC_DIR = src
 IR_BIN_DIR = ir_bin
 IR_SRC_C_FILES := $(wildcard $(IR_SRC_DIR)/*.cpp)
 IR_SRC_FILES := $(IR_SRC_C_FILES)
-IR_LL_FILES := $(patsubst $(IR_SRC_DIR)/%.cpp,$(IR_BIN_DIR)/%.ll,$(IR_SRC_C_FILES))
-IR_OBF_FILES := $(patsubst $(IR_BIN_DIR)/%.ll,$(IR_BIN_DIR)/%-obf.ll,$(IR_LL_FILES))
+IR_LL_FILES := $(patsubst $(IR_SRC_DIR)/%.cpp,$(IR_BIN_DIR)/%.$(IR_FORMAT),$(IR_SRC_C_FILES))
+IR_OBF_FILES := $(patsubst $(IR_BIN_DIR)/%.$(IR_FORMAT),$(IR_BIN_DIR)/%-obf.$(IR_FORMAT),$(IR_LL_FILES))
 
 # Parsing special chars for obfuscation
 comma := ,
@@ -39,6 +49,7 @@ LLVM_DIR      := $(IRVANA_ROOT)\LLVM-18.1.5
 LLVM_CLANG    := $(LLVM_DIR)\bin\clang++.exe
 LLVM_OPT      := $(LLVM_DIR)\bin\opt.exe
 LLVM_LINK     := $(LLVM_DIR)\bin\llvm-link.exe
+LLVM_DIS      := $(LLVM_DIR)\bin\llvm-dis.exe
 # OLLVM Plugin path
 OLLVM_PLUGIN ?= $(IRVANA_ROOT)\OLLVM\vs_build\obfuscation\Release\LLVMObfuscationx.dll
 # === Debug Info ===
@@ -49,6 +60,7 @@ OLLVM_PLUGIN ?= $(IRVANA_ROOT)\OLLVM\vs_build\obfuscation\Release\LLVMObfuscatio
 ##$(info [Debug] LLVM_CLANG     = $(LLVM_CLANG))
 ##$(info [Debug] LLVM_OPT       = $(LLVM_OPT))
 ##$(info [Debug] LLVM_LINK      = $(LLVM_LINK))
+##$(info [Debug] LLVM_DIS       = $(LLVM_DIS))
 ##$(info [Debug] OLLVM_PLUGIN   = $(OLLVM_PLUGIN))
 
 # Path to Internal library includes
@@ -87,9 +99,26 @@ COMMON_INCLUDES := \
   -I "$(vctoolsdir)/include" \
   -I "$(vctoolsdir)/lib"
 
+# Optimization before obfuscation (e.g. make ir IR_OPT=O2): O0, O1, O2 or Oz.
+# Smaller IR is obfuscated faster and the obfuscated code runs faster.
+# IR_INLINE=0 keeps the optimizer from inlining, so every function keeps its
+# own body and obfuscation
+IR_OPT ?= O2
+IR_INLINE ?= 1
+ifeq ($(filter O0 O1 O2 Oz,$(IR_OPT)),)
+  $(error IR_OPT must be O0, O1, O2 or Oz)
+endif
+# clang -O0 marks every function optnone and recover skips optnone functions,
+# like any pipeline does: with recover selected they are left unmarked. make
+# ir makes the IR obf_final obfuscates, so give it the same OBF_PASSES, or
+# RECOVER=1, e.g. make ir RECOVER=1 && make obf_final OBF_PASSES=cff,recover
+RECOVER ?=
+IR_OPTNONE_FLAGS := $(if $(and $(filter O0,$(IR_OPT)),$(or $(strip $(RECOVER)),$(filter recover,$(subst $(comma), ,$(OBF_PASSES))))),-Xclang -disable-O0-optnone)
+IR_OPT_FLAGS := -$(IR_OPT) $(if $(filter 0,$(IR_INLINE)),-fno-inline) $(IR_OPTNONE_FLAGS)
+
 # Common C++ IR generation flags (converted to Clang-style)
 COMMON_CFLAGS := \
-  -c -O2 -std=c++17 -S -emit-llvm \
+  -c $(IR_OPT_FLAGS) -std=c++17 $(if $(filter ll,$(IR_FORMAT)),-S) -emit-llvm \
   -Wall -Wno-unused-command-line-argument \
   -nostdlib -Llib -lc++ -lc++abi -lmsvcrt  \
   $(COMMON_INCLUDES)
@@ -103,41 +132,155 @@ else
   OBF_PASS_OPT := --passes="irobf($(subst $(space),$(comma),$(strip $(OBF_PASS_EXPANDED))))"
 endif
 
+# Obfuscate while compiling instead of in a separate opt run (e.g.
+# make obf_ir OBF_PASSES=cff,cse OBF_EP=last): the plugin adds the passes at
+# the given extension point of clang's own -$(IR_OPT) pipeline
+OBF_EP ?=
+OBF_EP_FLAGS := -Xclang -load -Xclang "$(OLLVM_PLUGIN)" -fpass-plugin="$(OLLVM_PLUGIN)"
+OBF_EP_FLAGS += -mllvm -irobf-ep=$(OBF_EP) $(foreach pass,$(subst $(comma), ,$(OBF_PASSES)),-mllvm -irobf-$(pass))
+
+# Obfuscate every file in one irvana-obf process (built with the plugin, in
+# OLLVM\vs_build\irvana-obf\Release) instead of one opt run per file, e.g.
+# make obf_ir OBF_PASSES=cff,cse OBF_TOOL=..\..\OLLVM\vs_build\irvana-obf\Release\irvana-obf.exe
+OBF_TOOL ?=
+OBF_TOOL_FLAGS := -o $(IR_BIN_DIR) -format=$(IR_FORMAT) $(foreach pass,$(subst $(comma), ,$(OBF_PASSES)),-irobf-$(pass))
+
+# With OBF_TOOL, obf_final can split final.ll into OBF_SHARDS partitions that
+# are obfuscated by parallel processes and linked back, each process limited
+# to OBF_SHARD_MEMORY MB if set, e.g.
+# make obf_final OBF_PASSES=cff,cse OBF_TOOL=... OBF_SHARDS=8 OBF_SHARD_MEMORY=2048
+OBF_SHARDS ?=
+OBF_SHARD_MEMORY ?=
+
+# After linking separately obfuscated files: merge identical encrypted strings
+# and the per-file string tables, drop tables of discarded inline functions
+OBF_MERGE_OPT := --passes="irobf(irobf-merge)"
+
+# Dead-code stripping after linking (e.g. make ir IR_STRIP=1): everything but
+# the IR_ENTRY symbols (comma-separated) and dllexport symbols is made
+# internal, then unreachable functions and globals and unused arguments are
+# removed, so that obf_final only obfuscates code the entry points reach
+IR_STRIP ?=
+IR_ENTRY ?= main
+IR_STRIP_OPT := --passes="internalize,globaldce,deadargelim,globaldce" -internalize-public-api-list=$(IR_ENTRY)
+
+# Link with irvana-link (built with the plugin, in
+# OLLVM\vs_build\irvana-link\Release) instead of llvm-link: the files are
+# parsed and linked on all cores. LINK_ONLY_NEEDED=1 links only the files
+# the IR_ENTRY symbols reach, like members of a static library, e.g.
+# make ir LINK_TOOL=..\..\OLLVM\vs_build\irvana-link\Release\irvana-link.exe
+LINK_TOOL ?=
+LINK_ONLY_NEEDED ?=
+LINK_TOOL_FLAGS := $(if $(strip $(LINK_ONLY_NEEDED)),-only-needed -entry=$(IR_ENTRY)) $(if $(filter ll,$(IR_FORMAT)),-S)
+IR_LINK := $(if $(strip $(LINK_TOOL)),"$(LINK_TOOL)" $(LINK_TOOL_FLAGS),$(LLVM_LINK))
+
+# Generate IR for an existing project from its compilation database instead
+# of src\*.cpp (e.g. make ir COMPILE_DB=..\..\myproj\build\compile_commands.json,
+# written by cmake -DCMAKE_EXPORT_COMPILE_COMMANDS=ON): irvana-cc (built with
+# the plugin) compiles every entry with its own flags, IR_JOBS at once
+# (default: all cores), and skips the files that are up to date
+COMPILE_DB ?=
+CC_TOOL ?= $(IRVANA_ROOT)\OLLVM\vs_build\irvana-cc\Release\irvana-cc.exe
+IR_JOBS ?=
+CC_TOOL_FLAGS := -p "$(COMPILE_DB)" -o $(IR_BIN_DIR) -clang="$(LLVM_CLANG)" -format=$(IR_FORMAT) -opt=$(IR_OPT)
+CC_TOOL_FLAGS += $(if $(filter 0,$(IR_INLINE)),-no-inline) $(if $(strip $(IR_JOBS)),-j $(IR_JOBS))
+CC_TOOL_FLAGS += $(foreach arg,$(IR_OPTNONE_FLAGS),-extra-arg=$(arg))
+ifneq ($(and $(strip $(COMPILE_DB)),$(filter-out delete,$(MAKECMDGOALS))),)
+ifneq ($(strip $(OBF_EP)),)
+  $(error OBF_EP compiles the files in src and does not work with COMPILE_DB)
+endif
+# The database is compiled while make reads this file and make starts over,
+# so the obfuscation and link rules see the new IR files. compile_db.mk lists
+# them as IR_DB_NAMES
+ifeq ($(MAKE_RESTARTS),)
+$(IR_BIN_DIR)/compile_db.mk: FORCE
+	if not exist $(IR_BIN_DIR) mkdir $(IR_BIN_DIR)
+	"$(CC_TOOL)" $(CC_TOOL_FLAGS) -list=$@
+endif
+include $(IR_BIN_DIR)/compile_db.mk
+IR_LL_FILES := $(foreach name,$(IR_DB_NAMES),$(IR_BIN_DIR)/$(name).$(IR_FORMAT))
+IR_OBF_FILES := $(patsubst $(IR_BIN_DIR)/%.$(IR_FORMAT),$(IR_BIN_DIR)/%-obf.$(IR_FORMAT),$(IR_LL_FILES))
+endif
+
 # ========== Targets ==========
 
-.PHONY: ir obf_ir link_ir link_obf_ir setup clean
+.PHONY: ir obf_ir link_ir link_obf_ir setup clean FORCE
 
 ir_setup:
 	if not exist $(IR_BIN_DIR) mkdir $(IR_BIN_DIR)
 
 ir: ir_setup $(IR_LL_FILES) link_ir
 # Compile .cpp -> .ll
-$(IR_BIN_DIR)/%.ll: $(IR_SRC_DIR)/%.cpp
+$(IR_BIN_DIR)/%.$(IR_FORMAT): $(IR_SRC_DIR)/%.cpp
 	$(LLVM_CLANG) $(IR_WINSDK) $(IR_VCTOOL) $(INTERNAL_LIBS) $(COMMON_CFLAGS) -o $@ $<
 
 ir_nolink: ir_setup $(IR_LL_FILES)
 # Compile .cpp -> .ll
-$(IR_BIN_DIR)/%.ll: $(IR_SRC_DIR)/%.cpp
+$(IR_BIN_DIR)/%.$(IR_FORMAT): $(IR_SRC_DIR)/%.cpp
 	$(LLVM_CLANG) $(IR_WINSDK) $(IR_VCTOOL) $(INTERNAL_LIBS) $(COMMON_CFLAGS) -o $@ $<
+ifeq ($(strip $(OBF_EP)),)
+ifeq ($(strip $(OBF_TOOL)),)
 # Obfuscate each individual .ll file
 obf_ir: ir_nolink $(IR_OBF_FILES) link_obf_ir
-$(IR_BIN_DIR)/%-obf.ll: $(IR_BIN_DIR)/%.ll
+$(IR_BIN_DIR)/%-obf.$(IR_FORMAT): $(IR_BIN_DIR)/%.$(IR_FORMAT)
 	$(LLVM_OPT) -load-pass-plugin="$(OLLVM_PLUGIN)" $(OBF_PASS_OPT) $< -o $@
+else
+# Obfuscate the .ll files that changed in one irvana-obf run
+obf_ir: ir_nolink $(IR_BIN_DIR)/obf.stamp link_obf_ir
+$(IR_BIN_DIR)/obf.stamp: $(IR_LL_FILES)
+	$(file >$(IR_BIN_DIR)/obf_files.rsp,$?)
+	"$(OBF_TOOL)" $(OBF_TOOL_FLAGS) @$(IR_BIN_DIR)/obf_files.rsp
+	type nul > $@
+
+# irvana-obf wrote them, never the opt rule below
+$(IR_OBF_FILES): $(IR_BIN_DIR)/obf.stamp ;
+endif
+else
+# Compile and obfuscate each .cpp in one clang run
+obf_ir: ir_setup $(IR_OBF_FILES) link_obf_ir
+$(IR_BIN_DIR)/%-obf.$(IR_FORMAT): $(IR_SRC_DIR)/%.cpp
+	$(LLVM_CLANG) $(IR_WINSDK) $(IR_VCTOOL) $(INTERNAL_LIBS) $(OBF_EP_FLAGS) $(COMMON_CFLAGS) -o $@ $<
+endif
+
+ifneq ($(strip $(COMPILE_DB)),)
+# Already compiled by irvana-cc, never from a file of the same name in src
+$(IR_LL_FILES): ;
+endif
 
 # Obfuscation pass at final.ll level → final-obf.ll
-obf_final: $(IR_BIN_DIR)/final.ll
-	$(LLVM_OPT) -load-pass-plugin="$(OLLVM_PLUGIN)" $(OBF_PASS_OPT) $< -o $(IR_BIN_DIR)/final-obf.ll
+ifneq ($(and $(strip $(OBF_TOOL)),$(strip $(OBF_SHARDS))),)
+obf_final: $(IR_BIN_DIR)/final.$(IR_FORMAT)
+	"$(OBF_TOOL)" $(OBF_TOOL_FLAGS) -shards=$(OBF_SHARDS) $(if $(strip $(OBF_SHARD_MEMORY)),-shard-memory=$(OBF_SHARD_MEMORY)) $<
+else
+obf_final: $(IR_BIN_DIR)/final.$(IR_FORMAT)
+	$(LLVM_OPT) -load-pass-plugin="$(OLLVM_PLUGIN)" $(OBF_PASS_OPT) $< -o $(IR_BIN_DIR)/final-obf.$(IR_FORMAT)
+endif
+ifneq ($(and $(filter bc,$(IR_FORMAT)),$(strip $(IR_DUMP))),)
+	$(LLVM_DIS) $(IR_BIN_DIR)/final-obf.bc -o $(IR_BIN_DIR)/final-obf.ll
+endif
 
+ifeq ($(strip $(OBF_EP)),)
 # Obfuscate each IR file
-$(IR_BIN_DIR)/%-obf.ll: $(IR_BIN_DIR)/%.ll
+$(IR_BIN_DIR)/%-obf.$(IR_FORMAT): $(IR_BIN_DIR)/%.$(IR_FORMAT)
 	$(LLVM_OPT) -load-pass-plugin="$(OLLVM_PLUGIN)" $(OBF_PASS_OPT) $< -o $@
+endif
 
 link_ir: $(IR_LL_FILES)
-	$(LLVM_LINK) -o $(IR_BIN_DIR)/final.ll $^
+	$(IR_LINK) -o $(IR_BIN_DIR)/final.$(IR_FORMAT) $^
+ifneq ($(strip $(IR_STRIP)),)
+	$(LLVM_OPT) $(IR_STRIP_OPT) $(IR_BIN_DIR)/final.$(IR_FORMAT) -o $(IR_BIN_DIR)/final.$(IR_FORMAT)
+endif
+ifneq ($(and $(filter bc,$(IR_FORMAT)),$(strip $(IR_DUMP))),)
+	$(LLVM_DIS) $(IR_BIN_DIR)/final.bc -o $(IR_BIN_DIR)/final.ll
+endif
 
 # Link obfuscated files -> final-obf.ll
 link_obf_ir: $(IR_OBF_FILES)
-	$(LLVM_LINK) -o $(IR_BIN_DIR)/final-obf.ll $^
+	$(IR_LINK) -o $(IR_BIN_DIR)/final-obf.$(IR_FORMAT) $^
+	$(LLVM_OPT) -load-pass-plugin="$(OLLVM_PLUGIN)" $(OBF_MERGE_OPT) $(IR_BIN_DIR)/final-obf.$(IR_FORMAT) -o $(IR_BIN_DIR)/final-obf.$(IR_FORMAT)
+ifneq ($(and $(filter bc,$(IR_FORMAT)),$(strip $(IR_DUMP))),)
+	$(LLVM_DIS) $(IR_BIN_DIR)/final-obf.bc -o $(IR_BIN_DIR)/final-obf.ll
+endif
 
 delete:
 	if exist vs_env.mk del /f /q vs_env.mk
@@ -18,10 +18,20 @@ include vs_env.mk
 
 # ========== Configuration ==========
 
+# IR file format (e.g. make ir IR_FORMAT=bc): ll for textual IR, bc for
+# bitcode, which is several times smaller and faster to read and write. With
+# bc every stage exchanges .bc files (final.bc, final-obf.bc); IR_DUMP=1 also
+# disassembles the final files to .ll for debugging
+IR_FORMAT ?= ll
+IR_DUMP ?=
+ifeq ($(filter ll bc,$(IR_FORMAT)),)
+  $(error IR_FORMAT must be ll or bc)
+endif
+
 IR_SRC_DIR = nim_src
 IR_BIN_DIR = ir_bin
 NIM_SRC_DIR = src
-IR_LL_FILES = $(wildcard $(IR_BIN_DIR)\*.ll)
+IR_LL_FILES = $(wildcard $(IR_BIN_DIR)\*.$(IR_FORMAT))
 
 # Parsing special chars for obfuscation
 comma := ,
@@ -49,6 +59,7 @@ LLVM_CLANG    := $(LLVM_DIR)\bin\clang.exe
 ## clang-cl doset work - compiles but dosent run
 LLVM_OPT      := $(LLVM_DIR)\bin\opt.exe
 LLVM_LINK     := $(LLVM_DIR)\bin\llvm-link.exe
+LLVM_DIS      := $(LLVM_DIR)\bin\llvm-dis.exe
 # OLLVM Plugin path
 OLLVM_PLUGIN ?= $(IRVANA_ROOT)\OLLVM\vs_build\obfuscation\Release\LLVMObfuscationx.dll
 # === Debug Info ===
@@ -59,6 +70,7 @@ OLLVM_PLUGIN ?= $(IRVANA_ROOT)\OLLVM\vs_build\obfuscation\Release\LLVMObfuscatio
 ##$(info [Debug] LLVM_CLANG     = $(LLVM_CLANG))
 ##$(info [Debug] LLVM_OPT       = $(LLVM_OPT))
 ##$(info [Debug] LLVM_LINK      = $(LLVM_LINK))
+##$(info [Debug] LLVM_DIS       = $(LLVM_DIS))
 ##$(info [Debug] OLLVM_PLUGIN   = $(OLLVM_PLUGIN))
 NIM_COMPILER = $(IRVANA_ROOT)\nim-1.6.6\bin\nim.exe
 
@@ -89,9 +101,26 @@ IR_WINSDK:= -I "$(winsdkdir)"
 IR_VCTOOL:= -I "$(vctoolsdir)"
 sdkver:= $(sdkver)
 
+# Optimization before obfuscation (e.g. make ir IR_OPT=O2): O0, O1, O2 or Oz.
+# Smaller IR is obfuscated faster and the obfuscated code runs faster.
+# IR_INLINE=0 keeps the optimizer from inlining, so every function keeps its
+# own body and obfuscation
+IR_OPT ?= O0
+IR_INLINE ?= 1
+ifeq ($(filter O0 O1 O2 Oz,$(IR_OPT)),)
+  $(error IR_OPT must be O0, O1, O2 or Oz)
+endif
+# clang -O0 marks every function optnone and recover skips optnone functions,
+# like any pipeline does: with recover selected they are left unmarked. make
+# ir makes the IR obf_final obfuscates, so give it the same OBF_PASSES, or
+# RECOVER=1, e.g. make ir RECOVER=1 && make obf_final OBF_PASSES=cff,recover
+RECOVER ?=
+IR_OPTNONE_FLAGS := $(if $(and $(filter O0,$(IR_OPT)),$(or $(strip $(RECOVER)),$(filter recover,$(subst $(comma), ,$(OBF_PASSES))))),-Xclang -disable-O0-optnone)
+IR_OPT_FLAGS := -$(IR_OPT) $(if $(filter 0,$(IR_INLINE)),-fno-inline) $(IR_OPTNONE_FLAGS)
+
 # Common LLVM IR Generation Flags
 #COMMON_CFLAGS:=-mllvm -fla -mllvm -sub -mllvm -bcf
-COMMON_CFLAGS:=-S -emit-llvm -fcommon -fno-stack-protector
+COMMON_CFLAGS:=$(if $(filter ll,$(IR_FORMAT)),-S,-c) -emit-llvm -fcommon -fno-stack-protector $(IR_OPT_FLAGS)
 COMMON_CFLAGS+=-I "$(winsdkdir)\\Include\\$(sdkver)\\ucrt"
 COMMON_CFLAGS+=-I "$(winsdkdir)\\Include\\$(sdkver)\\um"
 COMMON_CFLAGS+=-I "$(winsdkdir)\\Include\\$(sdkver)\\shared"
@@ -107,12 +136,70 @@ else
   OBF_PASS_OPT := --passes="irobf($(subst $(space),$(comma),$(strip $(OBF_PASS_EXPANDED))))"
 endif
 
+# Obfuscate while compiling instead of in a separate opt run (e.g.
+# make obf_ir OBF_PASSES=cff,cse OBF_EP=last): the plugin adds the passes at
+# the given extension point of clang's own pipeline
+OBF_EP ?=
+OBF_EP_FLAGS := -Xclang -load -Xclang "$(OLLVM_PLUGIN)" -fpass-plugin="$(OLLVM_PLUGIN)"
+OBF_EP_FLAGS += -mllvm -irobf-ep=$(OBF_EP) $(foreach pass,$(subst $(comma), ,$(OBF_PASSES)),-mllvm -irobf-$(pass))
+
+# Obfuscate every file in one irvana-obf process (built with the plugin, in
+# OLLVM\vs_build\irvana-obf\Release) instead of one opt run per file, e.g.
+# make obf_ir OBF_PASSES=cff,cse OBF_TOOL=..\..\OLLVM\vs_build\irvana-obf\Release\irvana-obf.exe
+OBF_TOOL ?=
+
+# With OBF_TOOL, obf_final can split final.ll into OBF_SHARDS partitions that
+# are obfuscated by parallel processes and linked back, each process limited
+# to OBF_SHARD_MEMORY MB if set, e.g.
+# make obf_final OBF_PASSES=cff,cse OBF_TOOL=... OBF_SHARDS=8 OBF_SHARD_MEMORY=2048
+OBF_SHARDS ?=
+OBF_SHARD_MEMORY ?=
+
+# After linking separately obfuscated files: merge identical encrypted strings
+# and the per-file string tables, drop tables of discarded inline functions
+OBF_MERGE_OPT := --passes="irobf(irobf-merge)"
+
+# Dead-code stripping after linking (e.g. make ir IR_STRIP=1): everything but
+# the IR_ENTRY symbols (comma-separated) and dllexport symbols is made
+# internal, then unreachable functions and globals and unused arguments are
+# removed, so that obf_final only obfuscates code the entry points reach
+IR_STRIP ?=
+IR_ENTRY ?= main
+IR_STRIP_OPT := --passes="internalize,globaldce,deadargelim,globaldce" -internalize-public-api-list=$(IR_ENTRY)
+
+# Link with irvana-link (built with the plugin, in
+# OLLVM\vs_build\irvana-link\Release) instead of llvm-link: the files are
+# parsed and linked on all cores. LINK_ONLY_NEEDED=1 links only the files
+# the IR_ENTRY symbols reach, like members of a static library, e.g.
+# make ir LINK_TOOL=..\..\OLLVM\vs_build\irvana-link\Release\irvana-link.exe
+LINK_TOOL ?=
+LINK_ONLY_NEEDED ?=
+LINK_TOOL_FLAGS := $(if $(strip $(LINK_ONLY_NEEDED)),-only-needed -entry=$(IR_ENTRY)) $(if $(filter ll,$(IR_FORMAT)),-S)
+IR_LINK := $(if $(strip $(LINK_TOOL)),"$(LINK_TOOL)" $(LINK_TOOL_FLAGS),$(LLVM_LINK))
+
+# The generated .c files are compiled and obfuscated IR_JOBS at once (default:
+# all cores) by a second make, which runs after nim and finds them. The IR of
+# a .c file is made from the SHA-256 of its content (hash_src.ps1 writes
+# ir_bin\<name>.sha when it changed), so the runtime files, which are the
+# same from one build to the next, are not compiled and obfuscated again. Run
+# make delete after changing IR_OPT or the obfuscation passes
+IR_JOBS ?=
+NIM_JOBS := $(if $(strip $(IR_JOBS)),$(IR_JOBS),$(NUMBER_OF_PROCESSORS))
+HASH_SRC := powershell -NoProfile -ExecutionPolicy Bypass -File hash_src.ps1 -Src $(IR_SRC_DIR) -Out $(IR_BIN_DIR)
+NIM_NAMES := $(patsubst $(IR_SRC_DIR)/%.c,%,$(wildcard $(IR_SRC_DIR)/*.c))
+NIM_IR_FILES := $(foreach name,$(NIM_NAMES),$(IR_BIN_DIR)/$(name).$(IR_FORMAT))
+NIM_OBF_FILES := $(foreach name,$(NIM_NAMES),$(IR_BIN_DIR)/$(name)-obf.$(IR_FORMAT))
+
+OBF_TOOL_FLAGS := -o $(IR_BIN_DIR) -format=$(IR_FORMAT) $(if $(strip $(IR_JOBS)),-j $(IR_JOBS))
+OBF_TOOL_FLAGS += $(foreach pass,$(subst $(comma), ,$(OBF_PASSES)),-irobf-$(pass))
+
 # ========== Targets ==========
 
-.PHONY: ir obf_ir link_ir link_obf_ir setup clean nim_to_c
+.PHONY: ir obf_ir link_ir link_obf_ir ir_link ir_obf_link setup clean nim_to_c hash_src
 
 ir_setup: 
-	mkdir $(IR_SRC_DIR) $(IR_BIN_DIR)
+	if not exist $(IR_SRC_DIR) mkdir $(IR_SRC_DIR)
+	if not exist $(IR_BIN_DIR) mkdir $(IR_BIN_DIR)
 
 nim_to_c:
 	@echo Generating .c files from Nim sources...
@@ -124,81 +211,88 @@ nim_to_c:
 		) \
 	)
 
-gen_ir: 
-	@echo Discovering .c files in $(IR_SRC_DIR)...
-	@cmd /V:ON /C "( \
-		setlocal EnableDelayedExpansion && \
-		for %%f in ($(IR_SRC_DIR)\*.c) do ( \
-			set src=%%~nxf && \
-			set dst=$(IR_BIN_DIR)\%%~nf.ll && \
-			echo Compiling !src! to !dst!... && \
-			$(LLVM_CLANG) $(IR_WINSDK) $(IR_VCTOOL) $(COMMON_CFLAGS) $(INTERNAL_LIBS) -o!dst! $(IR_SRC_DIR)\!src! \
-		) \
-	)"
-
-gen_obf_ir:
-	@echo Discovering .c files in $(IR_SRC_DIR)...
-	@cmd /V:ON /C "( \
-		setlocal EnableDelayedExpansion && \
-		for %%f in ($(IR_SRC_DIR)\*.c) do ( \
-			set src=%%~nxf && \
-			set base=%%~nxf && \
-			set name=%%~nf && \
-			set dst=$(IR_BIN_DIR)\!base:.c=.ll! && \
-			set obf=$(IR_BIN_DIR)\!base:.c=-obf.ll! && \
-			echo Compiling !src! to !dst!... && \
-			$(LLVM_CLANG) $(IR_WINSDK) $(IR_VCTOOL) $(COMMON_CFLAGS) $(INTERNAL_LIBS) -o!dst! $(IR_SRC_DIR)\!src! && \
-			echo Obfuscating !dst! to !obf!... && \
-			$(LLVM_OPT) -load-pass-plugin="$(OLLVM_PLUGIN)" $(OBF_PASS_OPT) !dst! -o !obf! \
-		) \
-	)"
-
-
-ir_link:
-	@echo Linking all IR files in $(IR_BIN_DIR)...
-	@cmd /V:ON /C "( \
-		setlocal EnableDelayedExpansion && \
-		set FILES= && \
-		for %%f in ($(IR_BIN_DIR)\*.ll) do ( \
-			if /I not %%~nxf==final.ll ( \
-				echo Found: %%f && \
-				set FILES=!FILES! %%f \
-			) \
-		) && \
-		echo Running llvm-link on: !FILES! && \
-		$(LLVM_LINK) -o $(IR_BIN_DIR)\final.ll !FILES! \
-	)"
-
-
-ir_obf_link:
-	@echo Linking all *-obf.ll IR files in $(IR_BIN_DIR)...
-	@cmd /V:ON /C "( \
-		setlocal EnableDelayedExpansion && \
-		set FILES= && \
-		for %%f in ($(IR_BIN_DIR)\*-obf.ll) do ( \
-			if /I not %%~nxf==final-obf.ll ( \
-				echo Found: %%f && \
-				set FILES=!FILES! %%f \
-			) \
-		) && \
-		echo Running llvm-link on: !FILES! && \
-		$(LLVM_LINK) -o $(IR_BIN_DIR)\final-obf.ll !FILES! \
-	)"
-
-ir: ir_setup nim_to_c gen_ir ir_link
-
-obf_ir: ir_setup nim_to_c gen_obf_ir ir_obf_link
-
-$(info Obfuscating: $(IR_OBF_FILES))
+hash_src:
+	@$(HASH_SRC)
+
+# Compile .c -> .ll when its content changed
+$(IR_BIN_DIR)/%.$(IR_FORMAT): $(IR_BIN_DIR)/%.sha
+	@echo Compiling $*.c to $@...
+	@$(LLVM_CLANG) $(IR_WINSDK) $(IR_VCTOOL) $(COMMON_CFLAGS) $(INTERNAL_LIBS) -o $@ $(IR_SRC_DIR)/$*.c
+
+ifeq ($(strip $(OBF_EP)),)
+ifneq ($(strip $(OBF_TOOL)),)
+# Obfuscate the .ll files that changed in one irvana-obf run
+$(IR_BIN_DIR)/obf.stamp: $(NIM_IR_FILES)
+	@echo Obfuscating $(words $?) IR files in $(IR_BIN_DIR)...
+	$(file >$(IR_BIN_DIR)/obf_files.rsp,$?)
+	"$(OBF_TOOL)" $(OBF_TOOL_FLAGS) @$(IR_BIN_DIR)/obf_files.rsp
+	type nul > $@
+
+NIM_OBF_DEPS := $(IR_BIN_DIR)/obf.stamp
+else
 # Obfuscate each IR file
-$(IR_BIN_DIR)/%-obf.ll: $(IR_BIN_DIR)/%.ll
-	$(LLVM_OPT) -load-pass-plugin="$(OLLVM_PLUGIN)" $(OBF_PASS_OPT) $< -o $@
+$(IR_BIN_DIR)/%-obf.$(IR_FORMAT): $(IR_BIN_DIR)/%.$(IR_FORMAT)
+	@echo Obfuscating $< to $@...
+	@$(LLVM_OPT) -load-pass-plugin="$(OLLVM_PLUGIN)" $(OBF_PASS_OPT) $< -o $@
+
+NIM_OBF_DEPS := $(NIM_OBF_FILES)
+endif
+else
+# Compile and obfuscate each .c in one clang run
+$(IR_BIN_DIR)/%-obf.$(IR_FORMAT): $(IR_BIN_DIR)/%.sha
+	@echo Compiling and obfuscating $*.c to $@...
+	@$(LLVM_CLANG) $(IR_WINSDK) $(IR_VCTOOL) $(OBF_EP_FLAGS) $(COMMON_CFLAGS) $(INTERNAL_LIBS) -o $@ $(IR_SRC_DIR)/$*.c
 
+NIM_OBF_DEPS := $(NIM_OBF_FILES)
+endif
+
+# Only the files of the .c files nim generated this time, linked from a
+# response file
+ir_link: $(NIM_IR_FILES)
+	$(if $^,,$(error No .c files in $(IR_SRC_DIR), run make ir))
+	@echo Linking $(words $^) IR files in $(IR_BIN_DIR)...
+	$(file >$(IR_BIN_DIR)/ir_files.rsp,$^)
+	$(IR_LINK) -o $(IR_BIN_DIR)\final.$(IR_FORMAT) @$(IR_BIN_DIR)/ir_files.rsp
+ifneq ($(strip $(IR_STRIP)),)
+	$(LLVM_OPT) $(IR_STRIP_OPT) $(IR_BIN_DIR)\final.$(IR_FORMAT) -o $(IR_BIN_DIR)\final.$(IR_FORMAT)
+endif
+ifneq ($(and $(filter bc,$(IR_FORMAT)),$(strip $(IR_DUMP))),)
+	$(LLVM_DIS) $(IR_BIN_DIR)\final.bc -o $(IR_BIN_DIR)\final.ll
+endif
+
+ir_obf_link: $(NIM_OBF_DEPS)
+	$(if $(NIM_OBF_FILES),,$(error No .c files in $(IR_SRC_DIR), run make obf_ir))
+	@echo Linking $(words $(NIM_OBF_FILES)) obfuscated IR files in $(IR_BIN_DIR)...
+	$(file >$(IR_BIN_DIR)/ir_files.rsp,$(NIM_OBF_FILES))
+	$(IR_LINK) -o $(IR_BIN_DIR)\final-obf.$(IR_FORMAT) @$(IR_BIN_DIR)/ir_files.rsp
+	$(LLVM_OPT) -load-pass-plugin="$(OLLVM_PLUGIN)" $(OBF_MERGE_OPT) $(IR_BIN_DIR)\final-obf.$(IR_FORMAT) -o $(IR_BIN_DIR)\final-obf.$(IR_FORMAT)
+ifneq ($(and $(filter bc,$(IR_FORMAT)),$(strip $(IR_DUMP))),)
+	$(LLVM_DIS) $(IR_BIN_DIR)\final-obf.bc -o $(IR_BIN_DIR)\final-obf.ll
+endif
+
+ir: ir_setup nim_to_c hash_src
+	@$(MAKE) --no-print-directory -f Makefile.ir.mk -j $(NIM_JOBS) ir_link
+
+obf_ir: ir_setup nim_to_c hash_src
+	@$(MAKE) --no-print-directory -f Makefile.ir.mk -j $(NIM_JOBS) ir_obf_link
+
+ifneq ($(and $(strip $(OBF_TOOL)),$(strip $(OBF_SHARDS))),)
+obf_final:
+	"$(OBF_TOOL)" $(OBF_TOOL_FLAGS) -shards=$(OBF_SHARDS) $(if $(strip $(OBF_SHARD_MEMORY)),-shard-memory=$(OBF_SHARD_MEMORY)) $(IR_BIN_DIR)/final.$(IR_FORMAT)
+else
 obf_final:
-	$(LLVM_OPT) -load-pass-plugin="$(OLLVM_PLUGIN)" $(OBF_PASS_OPT) $(IR_BIN_DIR)/final.ll -o $(IR_BIN_DIR)/final-obf.ll
+	$(LLVM_OPT) -load-pass-plugin="$(OLLVM_PLUGIN)" $(OBF_PASS_OPT) $(IR_BIN_DIR)/final.$(IR_FORMAT) -o $(IR_BIN_DIR)/final-obf.$(IR_FORMAT)
+endif
+ifneq ($(and $(filter bc,$(IR_FORMAT)),$(strip $(IR_DUMP))),)
+	$(LLVM_DIS) $(IR_BIN_DIR)/final-obf.bc -o $(IR_BIN_DIR)/final-obf.ll
+endif
 
 link_obf_ir: $(IR_OBF_FILES)
-	$(LLVM_LINK) -o $(IR_BIN_DIR)/final-obf.ll $^
+	$(IR_LINK) -o $(IR_BIN_DIR)/final-obf.$(IR_FORMAT) $^
+	$(LLVM_OPT) -load-pass-plugin="$(OLLVM_PLUGIN)" $(OBF_MERGE_OPT) $(IR_BIN_DIR)/final-obf.$(IR_FORMAT) -o $(IR_BIN_DIR)/final-obf.$(IR_FORMAT)
+ifneq ($(and $(filter bc,$(IR_FORMAT)),$(strip $(IR_DUMP))),)
+	$(LLVM_DIS) $(IR_BIN_DIR)/final-obf.bc -o $(IR_BIN_DIR)/final-obf.ll
+endif
 
 delete:	
 	if exist vs_env.mk del /f /q vs_env.mk
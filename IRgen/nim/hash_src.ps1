@@ -0,0 +1,21 @@
+# Write the SHA-256 of every generated .c file to <name>.sha in the IR
+# directory, only when it changed, for Makefile.ir.mk
+#
+# The IR of a .c file is made from its .sha, so a runtime file that nim
+# wrote again with the same content is neither compiled nor obfuscated again
+param(
+    [Parameter(Mandatory = $true)][string]$Src,  # nim_src
+    [Parameter(Mandatory = $true)][string]$Out   # ir_bin
+)
+$ErrorActionPreference = "Stop"
+
+$changed = 0
+$files = Get-ChildItem -Path $Src -Filter "*.c" | Where-Object { $_.Extension -eq ".c" }
+foreach ($c in $files) {
+    $hash = (Get-FileHash -Algorithm SHA256 $c.FullName).Hash
+    $stamp = Join-Path $Out "$($c.BaseName).sha"
+    if ((Test-Path $stamp) -and (Get-Content $stamp -TotalCount 1) -eq $hash) { continue }
+    Set-Content -Path $stamp -Value $hash -Encoding ASCII
+    $changed++
+}
+Write-Host "$changed of $($files.Count) .c files in $Src changed"
@@ -17,13 +17,19 @@ include vs_env.mk
 
 # ========== Configuration ==========
 
+# IR file format (e.g. make ir IR_FORMAT=bc): ll for textual IR, bc for
+# bitcode, which is several times smaller and faster to read and write. With
+# bc every stage exchanges .bc files (final.bc, final-obf.bc); IR_DUMP=1 also
+# disassembles the final files to .ll for debugging
+IR_FORMAT ?= ll
+IR_DUMP ?=
+ifeq ($(filter ll bc,$(IR_FORMAT)),)
+  $(error IR_FORMAT must be ll or bc)
+endif
+
 IR_BIN_DIR = ir_bin
-IR_LL_FILES = $(wildcard $(IR_BIN_DIR)\*.ll)
 RUST_SRC_FILE = src\main.rs
 #RUST_SRC_DIR = src
-RUST_BASENAME = $(basename $(notdir $(RUST_SRC_FILE)))
-RUST_LL_FILE = $(IR_BIN_DIR)\$(RUST_BASENAME).ll
-RUST_OBF_LL_FILE = $(IR_BIN_DIR)\$(RUST_BASENAME)-obf.ll
 
 # Parsing special chars for obfuscation
 comma := ,
@@ -42,9 +48,10 @@ IRVANA_ROOT := $(MAKEFILE_DIR_W)..\..
 LLVM_DIR      := $(IRVANA_ROOT)\LLVM-18.1.5
 LLVM_OPT      := $(LLVM_DIR)\bin\opt.exe
 LLVM_LINK      := $(LLVM_DIR)\bin\llvm-link.exe
+LLVM_DIS       := $(LLVM_DIR)\bin\llvm-dis.exe
 # OLLVM Plugin path
 OLLVM_PLUGIN ?= $(IRVANA_ROOT)\OLLVM\vs_build\obfuscation\Release\LLVMObfuscationx.dll
-CARGO = cargo +nightly-2024-06-26 rustc
+CARGO = cargo +nightly-2024-06-26
 
 # Location of your VC and SDK lib paths (adjust if different)
 VC_LIB_PATH = "$(vctoolsdir)\\include\\lib\\x64"
@@ -60,93 +67,158 @@ else
   OBF_PASS_OPT := --passes="irobf($(subst $(space),$(comma),$(strip $(OBF_PASS_EXPANDED))))"
 endif
 
-# Common LLVM IR Generation Flags
-COMMON_CFLAGS:=--release -- --emit=llvm-ir
+# Obfuscate while compiling instead of in a separate opt run (e.g.
+# make obf_ir OBF_PASSES=cff,cse OBF_EP=last): rustc loads the plugin and it
+# adds the passes at the given extension point of rustc's own pipeline
+OBF_EP ?=
+OBF_EP_FLAGS := -Zllvm-plugins=$(OLLVM_PLUGIN) -Cllvm-args=-irobf-ep=$(OBF_EP)
+OBF_EP_FLAGS += $(foreach pass,$(subst $(comma), ,$(OBF_PASSES)),-Cllvm-args=-irobf-$(pass))
+
+# Obfuscate every crate IR file in one irvana-obf process (built with the
+# plugin, in OLLVM\vs_build\irvana-obf\Release) instead of one opt run per
+# file, e.g.
+# make obf_ir OBF_PASSES=cff,cse OBF_TOOL=..\..\OLLVM\vs_build\irvana-obf\Release\irvana-obf.exe
+OBF_TOOL ?=
+
+# After linking separately obfuscated files: merge identical encrypted strings
+# and the per-file string tables, drop tables of discarded inline functions
+OBF_MERGE_OPT := --passes="irobf(irobf-merge)"
+
+# Dead-code stripping after linking (e.g. make ir IR_STRIP=1): everything but
+# the IR_ENTRY symbols (comma-separated) and dllexport symbols is made
+# internal, then unreachable functions and globals and unused arguments are
+# removed, so that obf_final only obfuscates code the entry points reach
+IR_STRIP ?=
+IR_ENTRY ?= main
+IR_STRIP_OPT := --passes="internalize,globaldce,deadargelim,globaldce" -internalize-public-api-list=$(IR_ENTRY)
+
+# Link with irvana-link (built with the plugin, in
+# OLLVM\vs_build\irvana-link\Release) instead of llvm-link: the files are
+# parsed and linked on all cores. LINK_ONLY_NEEDED=1 links only the files
+# the IR_ENTRY symbols reach, like members of a static library, e.g.
+# make ir LINK_TOOL=..\..\OLLVM\vs_build\irvana-link\Release\irvana-link.exe
+LINK_TOOL ?=
+LINK_ONLY_NEEDED ?=
+LINK_TOOL_FLAGS := $(if $(strip $(LINK_ONLY_NEEDED)),-only-needed -entry=$(IR_ENTRY)) $(if $(filter ll,$(IR_FORMAT)),-S)
+IR_LINK := $(if $(strip $(LINK_TOOL)),"$(LINK_TOOL)" $(LINK_TOOL_FLAGS),$(LLVM_LINK))
+
+# Optimization before obfuscation (e.g. make ir IR_OPT=O2): O0, O1, O2 or Oz,
+# empty for the opt-level of the release profile (3). Smaller IR is
+# obfuscated faster and the obfuscated code runs faster. IR_INLINE=0 keeps
+# the MIR and LLVM inliners from inlining (#[inline(always)] still is)
+IR_OPT ?=
+IR_INLINE ?= 1
+ifeq ($(filter O0 O1 O2 Oz,$(IR_OPT))$(if $(strip $(IR_OPT)),,default),)
+  $(error IR_OPT must be O0, O1, O2, Oz or empty)
+endif
+IR_OPT_FLAGS := $(if $(strip $(IR_OPT)),-Copt-level=$(patsubst O%,%,$(IR_OPT)))
+IR_OPT_FLAGS += $(if $(filter 0,$(IR_INLINE)),-Zinline-mir=no -Cllvm-args=-inline-threshold=-10000)
+
+RUST_EMIT := $(if $(filter bc,$(IR_FORMAT)),llvm-bc,llvm-ir)
+
+# IR of every crate: the flags are given to all crates of RUST_TARGET (not to
+# build scripts and proc macros, which run on the host) through cargo's
+# build.rustflags, and collect_ir.ps1 copies the IR of each crate and codegen
+# unit to $(IR_BIN_DIR). A crate that did not change is not compiled again and
+# its IR files are not obfuscated again. The files are obfuscated IR_JOBS at
+# once (default: all cores) and linked from a response file
+RUST_TARGET ?= x86_64-pc-windows-msvc
+RUST_DEPS_DIR := target\$(RUST_TARGET)\release\deps
+IR_JOBS ?=
+RUST_JOBS := $(if $(strip $(IR_JOBS)),$(IR_JOBS),$(NUMBER_OF_PROCESSORS))
+RUST_FLAGS := --emit=$(RUST_EMIT) $(IR_OPT_FLAGS)
+RUST_OBF_FLAGS := $(RUST_FLAGS) $(OBF_EP_FLAGS)
+# TOML literal strings, so the paths keep their backslashes
+toml_array = [$(foreach flag,$(1),'$(flag)',)]
+CARGO_FLAGS := --release --target $(RUST_TARGET) --message-format=json-render-diagnostics
+CARGO_FLAGS += $(if $(strip $(IR_JOBS)),-j $(IR_JOBS))
+COLLECT_IR := powershell -NoProfile -ExecutionPolicy Bypass -File collect_ir.ps1
+COLLECT_IR += -Messages $(IR_BIN_DIR)\cargo.json -Deps $(RUST_DEPS_DIR) -Out $(IR_BIN_DIR) -Ext $(IR_FORMAT)
+
+OBF_TOOL_FLAGS := -o $(IR_BIN_DIR) -format=$(IR_FORMAT) $(if $(strip $(IR_JOBS)),-j $(IR_JOBS))
+OBF_TOOL_FLAGS += $(foreach pass,$(subst $(comma), ,$(OBF_PASSES)),-irobf-$(pass))
+
+# Written by collect_ir.ps1, read by the link steps, which run in a second
+# make after cargo
+-include $(IR_BIN_DIR)/crates.mk
+RUST_IR_FILES := $(foreach name,$(RUST_IR_NAMES),$(IR_BIN_DIR)/$(name).$(IR_FORMAT))
+RUST_OBF_FILES := $(foreach name,$(RUST_IR_NAMES),$(IR_BIN_DIR)/$(name)-obf.$(IR_FORMAT))
 
 # ========== Targets ==========
 
-.PHONY: ir obf_ir ir_setup rust_to_ir clean delete
+.PHONY: ir obf_ir ir_setup rust_to_ir rust_to_obf_ir ir_link ir_obf_link clean delete
 
 ir_setup:
-	mkdir $(IR_BIN_DIR)
+	if not exist $(IR_BIN_DIR) mkdir $(IR_BIN_DIR)
 
 rust_to_ir:
 	@echo Generating LLVM IR from Rust using Cargo...
 	@"C:\Program Files\Microsoft Visual Studio\2022\Community\VC\Auxiliary\Build\vcvarsall.bat" x64 && \
-	cargo +nightly-2024-06-26 rustc --release -- --emit=llvm-ir
-	@echo Copying messagebox LLVM IR to ir_bin...
-	@cmd /V:ON /C "( \
-		setlocal EnableDelayedExpansion && \
-		for %%f in (target\release\deps\*.ll) do ( \
-			echo Found IR file: %%f && \
-			copy /Y %%f $(RUST_LL_FILE) >nul && \
-			exit /b \
-		) \
-	)"
+	$(CARGO) build $(CARGO_FLAGS) --config "build.rustflags=$(call toml_array,$(RUST_FLAGS))" > $(IR_BIN_DIR)\cargo.json && \
+	$(COLLECT_IR)
 
+ifeq ($(strip $(OBF_EP)),)
+rust_to_obf_ir: rust_to_ir
+else
 rust_to_obf_ir:
-	@echo Generating LLVM IR from Rust using Cargo...
+	@echo Generating obfuscated LLVM IR from Rust using Cargo...
 	@"C:\Program Files\Microsoft Visual Studio\2022\Community\VC\Auxiliary\Build\vcvarsall.bat" x64 && \
-	cargo +nightly-2024-06-26 rustc --release -- --emit=llvm-ir
-	@echo Obfuscating and writing to $(RUST_OBF_LL_FILE)...
-	@cmd /V:ON /C "( \
-		setlocal EnableDelayedExpansion && \
-		for %%f in (target\release\deps\*.ll) do ( \
-			echo Found IR file: %%f && \
-			echo Running obfuscation... && \
-			opt -load-pass-plugin=$(OLLVM_PLUGIN) $(OBF_PASS_OPT) %%f -o $(RUST_OBF_LL_FILE) && \
-			echo Done: Obfuscated IR written to $(RUST_OBF_LL_FILE) && \
-			exit /b \
-		) \
-	)"
-
-
-$(IR_BIN_DIR)/%-obf.ll: $(IR_BIN_DIR)/%.ll
+	$(CARGO) build $(CARGO_FLAGS) --config "build.rustflags=$(call toml_array,$(RUST_OBF_FLAGS))" > $(IR_BIN_DIR)\cargo.json && \
+	$(COLLECT_IR) -Suffix -obf
+
+# rustc already wrote them
+$(RUST_OBF_FILES): ;
+endif
+
+# Obfuscate each crate IR file
+$(IR_BIN_DIR)/%-obf.$(IR_FORMAT): $(IR_BIN_DIR)/%.$(IR_FORMAT)
 	$(LLVM_OPT) -load-pass-plugin="$(OLLVM_PLUGIN)" $(OBF_PASS_OPT) $< -o $@
 
-ir_link:
-	@echo Linking all IR files in $(IR_BIN_DIR)...
-	@cmd /V:ON /C "( \
-		setlocal EnableDelayedExpansion && \
-		set FILES= && \
-		for %%f in ($(IR_BIN_DIR)\*.ll) do ( \
-			if /I not %%~nxf==final.ll ( \
-				echo Found: %%f && \
-				set FILES=!FILES! %%f \
-			) \
-		) && \
-		echo Running llvm-link on: !FILES! && \
-		$(LLVM_LINK) -o $(IR_BIN_DIR)\final.ll !FILES! \
-	)"
-
-
-
-ir_obf_link:
-	@echo Linking all *-obf.ll IR files in $(IR_BIN_DIR)...
-	@cmd /V:ON /C "( \
-		setlocal EnableDelayedExpansion && \
-		set FILES= && \
-		for %%f in ($(IR_BIN_DIR)\*-obf.ll) do ( \
-			if /I not %%~nxf==final-obf.ll ( \
-				echo Found: %%f && \
-				set FILES=!FILES! %%f \
-			) \
-		) && \
-		echo Running llvm-link on: !FILES! && \
-		$(LLVM_LINK) -o $(IR_BIN_DIR)\final-obf.ll !FILES! \
-	)"
-
-ir: ir_setup rust_to_ir ir_link
-
-# Obfuscate rust_example.ll -> rust_example-obf.ll
-obf_ir: ir_setup rust_to_obf_ir ir_obf_link
-
-$(IR_OBF_FILE): $(RUST_LL_FILE)
-	$(LLVM_OPT) -load-pass-plugin=$(OLLVM_PLUGIN) $(OBF_PASS_OPT) $< -o $@
-
-# Optional: obfuscate final.ll (if you link other IRs later)
+# Or the ones that changed in one irvana-obf run
+$(IR_BIN_DIR)/obf.stamp: $(RUST_IR_FILES)
+	$(file >$(IR_BIN_DIR)/obf_files.rsp,$?)
+	"$(OBF_TOOL)" $(OBF_TOOL_FLAGS) @$(IR_BIN_DIR)/obf_files.rsp
+	type nul > $@
+
+RUST_OBF_DEPS := $(if $(and $(strip $(OBF_TOOL)),$(if $(strip $(OBF_EP)),,1)),$(IR_BIN_DIR)/obf.stamp,$(RUST_OBF_FILES))
+
+ir_link: $(RUST_IR_FILES)
+	$(if $^,,$(error No crate IR listed in $(IR_BIN_DIR)/crates.mk, run make ir))
+	@echo Linking $(words $^) IR files in $(IR_BIN_DIR)...
+	$(file >$(IR_BIN_DIR)/ir_files.rsp,$^)
+	$(IR_LINK) -o $(IR_BIN_DIR)\final.$(IR_FORMAT) @$(IR_BIN_DIR)/ir_files.rsp
+ifneq ($(strip $(IR_STRIP)),)
+	$(LLVM_OPT) $(IR_STRIP_OPT) $(IR_BIN_DIR)\final.$(IR_FORMAT) -o $(IR_BIN_DIR)\final.$(IR_FORMAT)
+endif
+ifneq ($(and $(filter bc,$(IR_FORMAT)),$(strip $(IR_DUMP))),)
+	$(LLVM_DIS) $(IR_BIN_DIR)\final.bc -o $(IR_BIN_DIR)\final.ll
+endif
+
+ir_obf_link: $(RUST_OBF_DEPS)
+	$(if $(RUST_OBF_FILES),,$(error No crate IR listed in $(IR_BIN_DIR)/crates.mk, run make obf_ir))
+	@echo Linking $(words $(RUST_OBF_FILES)) obfuscated IR files in $(IR_BIN_DIR)...
+	$(file >$(IR_BIN_DIR)/ir_files.rsp,$(RUST_OBF_FILES))
+	$(IR_LINK) -o $(IR_BIN_DIR)\final-obf.$(IR_FORMAT) @$(IR_BIN_DIR)/ir_files.rsp
+	$(LLVM_OPT) -load-pass-plugin=$(OLLVM_PLUGIN) $(OBF_MERGE_OPT) $(IR_BIN_DIR)\final-obf.$(IR_FORMAT) -o $(IR_BIN_DIR)\final-obf.$(IR_FORMAT)
+ifneq ($(and $(filter bc,$(IR_FORMAT)),$(strip $(IR_DUMP))),)
+	$(LLVM_DIS) $(IR_BIN_DIR)\final-obf.bc -o $(IR_BIN_DIR)\final-obf.ll
+endif
+
+# The link steps run in a second make, which reads the crates.mk cargo just
+# wrote, IR_JOBS files obfuscated at once
+ir: ir_setup rust_to_ir
+	@$(MAKE) --no-print-directory -f Makefile.ir.mk ir_link
+
+obf_ir: ir_setup rust_to_obf_ir
+	@$(MAKE) --no-print-directory -f Makefile.ir.mk -j $(RUST_JOBS) ir_obf_link
+
+# Optional: obfuscate final.ll (if you link other IRs later), the crates
+# linked (and with IR_STRIP stripped) by make ir
 obf_final:
-	$(LLVM_OPT) -load-pass-plugin=$(OLLVM_PLUGIN) $(OBF_PASS_OPT) $(RUST_LL_FILE) -o $(IR_BIN_DIR)\final-obf.ll
+	$(LLVM_OPT) -load-pass-plugin=$(OLLVM_PLUGIN) $(OBF_PASS_OPT) $(IR_BIN_DIR)\final.$(IR_FORMAT) -o $(IR_BIN_DIR)\final-obf.$(IR_FORMAT)
+ifneq ($(and $(filter bc,$(IR_FORMAT)),$(strip $(IR_DUMP))),)
+	$(LLVM_DIS) $(IR_BIN_DIR)\final-obf.bc -o $(IR_BIN_DIR)\final-obf.ll
+endif
 
 delete:
 	if exist vs_env.mk del /f /q vs_env.mk
@@ -0,0 +1,78 @@
+# Copy the IR rustc emitted for every crate of the last cargo build to the IR
+# directory and list it in crates.mk (RUST_IR_NAMES := ...) for Makefile.ir.mk
+#
+# Each crate's files in deps are named after its crate hash
+# (<crate>-<hash>.<crate>.<cgu>-cgu.<n>.rcgu.ll, one per codegen unit), so a
+# crate that did not change keeps its files, its copies and their times and
+# make does not obfuscate it again
+param(
+    [Parameter(Mandatory = $true)][string]$Messages,  # cargo --message-format=json output
+    [Parameter(Mandatory = $true)][string]$Deps,      # target\<triple>\release\deps
+    [Parameter(Mandatory = $true)][string]$Out,       # ir_bin
+    [string]$Ext = "ll",
+    [string]$Suffix = ""                               # -obf when rustc obfuscated the IR
+)
+$ErrorActionPreference = "Stop"
+
+$names = @()
+foreach ($line in Get-Content $Messages) {
+    if (-not $line.StartsWith('{"reason":"compiler-artifact"')) { continue }
+    $msg = $line | ConvertFrom-Json
+
+    # Proc macros and build scripts only run while building
+    if ($msg.target.kind -contains "proc-macro" -or $msg.target.kind -contains "custom-build") { continue }
+
+    # lib<crate>-<hash>.rlib gives the hash; bins have none in the message,
+    # their files are the newest <crate>-<hash>.d
+    $crate = [regex]::Escape(($msg.target.name -replace "-", "_"))
+    $stem = $null
+    foreach ($file in $msg.filenames) {
+        if ((Split-Path $file -Leaf) -match "^(lib)?($crate-[0-9a-f]{16})\.") {
+            $stem = $Matches[2]
+            break
+        }
+    }
+    if (-not $stem) {
+        $dep = Get-ChildItem -Path $Deps -Filter "*.d" |
+            Where-Object { $_.BaseName -match "^$crate-[0-9a-f]{16}$" } |
+            Sort-Object LastWriteTime | Select-Object -Last 1
+        if (-not $dep) { continue }
+        $stem = $dep.BaseName
+    }
+
+    # Host crates (dependencies of proc macros) are built in another directory
+    $depFile = Join-Path $Deps "$stem.d"
+    if (-not (Test-Path $depFile)) { continue }
+
+    # rustc writes the .d first; older IR files are left over from an earlier
+    # build with more codegen units
+    $since = (Get-Item $depFile).LastWriteTime
+    $files = Get-ChildItem -Path $Deps -Filter "$stem.*$Ext" |
+        Where-Object { $_.Extension -eq ".$Ext" -and $_.LastWriteTime -ge $since }
+
+    foreach ($ir in $files) {
+        $name = $ir.BaseName
+        $dest = Join-Path $Out "$name$Suffix.$Ext"
+        # A recompiled crate often has codegen units that did not change
+        if ((Test-Path $dest) -and
+            ((Get-Item $dest).LastWriteTime -ge $ir.LastWriteTime -or
+             (Get-FileHash $dest).Hash -eq (Get-FileHash $ir.FullName).Hash)) {
+            $names += $name
+            continue
+        }
+        Copy-Item $ir.FullName $dest -Force
+        (Get-Item $dest).LastWriteTime = $ir.LastWriteTime
+        $names += $name
+    }
+}
+
+if ($names.Count -eq 0) {
+    Write-Error "collect_ir: no .$Ext files for the crates in $Messages"
+    exit 1
+}
+
+$list = @("# Generated by collect_ir.ps1", "RUST_IR_NAMES := \")
+$list += $names | ForEach-Object { "  $_ \" }
+$list += ""
+Set-Content -Path (Join-Path $Out "crates.mk") -Value $list -Encoding ASCII
+Write-Host "Collected $($names.Count) IR files of the crates in $Out"
@@ -88,13 +88,35 @@ bool runCommand(const std::wstring& command, const std::wstring& workingDir) {
 }
 
 // Main logic for build orchestration
-bool runMake(const std::string& language, bool cleanBuild, bool obfuscate, const std::string& obfMode, const std::string& obfPasses) {
+bool runMake(const std::string& language, bool cleanBuild, bool obfuscate, const std::string& obfMode, const std::string& obfPasses, bool stripDeadCode, const std::string& optPreset, bool inlining, const std::string& irFormat, bool dumpIR, const std::string& compileDb) {
     std::filesystem::path baseDir = getProjectRoot();
     if (baseDir.empty()) return false;
 
     std::filesystem::path makeDir = baseDir / "IRgen" / language;
     std::wstring workingDir = makeDir.wstring();
     std::wstring makefile = L"-f Makefile.ir.mk";
+    // Internalize all but main and drop what it never reaches after linking
+    if (stripDeadCode) {
+        makefile += L" IR_STRIP=1";
+    }
+    // Empty preset keeps the language's default optimization level
+    if (!optPreset.empty()) {
+        makefile += L" IR_OPT=" + strToWstr(optPreset);
+    }
+    if (!inlining) {
+        makefile += L" IR_INLINE=0";
+    }
+    // Bitcode between all stages, .ll only as a disassembled copy on request
+    if (irFormat == "bc") {
+        makefile += L" IR_FORMAT=bc";
+        if (dumpIR) {
+            makefile += L" IR_DUMP=1";
+        }
+    }
+    // Sources and flags of an existing C/C++ project instead of src/
+    if (!compileDb.empty()) {
+        makefile += L" COMPILE_DB=\"" + strToWstr(compileDb) + L"\"";
+    }
 
     std::wstring fullCommand;
 
@@ -106,14 +128,16 @@ bool runMake(const std::string& language, bool cleanBuild, bool obfuscate, const
         fullCommand += L"make ir " + makefile;
     }
     else {
+        std::wstring passes;
+        if (!obfPasses.empty()) {
+            passes = L" OBF_PASSES=" + strToWstr(obfPasses);
+        }
         if (obfMode == "final") {
-            fullCommand += L"make ir " + makefile + L" && make obf_final " + makefile;
+            // make ir needs the passes too: recover changes how the IR is compiled
+            fullCommand += L"make ir " + makefile + passes + L" && make obf_final " + makefile + passes;
         }
         else {
-            fullCommand += L"make obf_ir " + makefile;
-        }
-        if (!obfPasses.empty()) {
-            fullCommand += L" OBF_PASSES=" + strToWstr(obfPasses);
+            fullCommand += L"make obf_ir " + makefile + passes;
         }
     }
 
@@ -123,12 +147,37 @@ bool runMake(const std::string& language, bool cleanBuild, bool obfuscate, const
 }
 
 // Entry point
-int main() {
+int main(int argc, char* argv[]) {
+    std::string irFormat = "ll";
+    bool dumpIR = false;
+    std::string compileDb;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--format=ll" || arg == "--format=bc") {
+            irFormat = arg.substr(9);
+        }
+        else if (arg == "--dump-ll") {
+            dumpIR = true;
+        }
+        else if (arg.rfind("--compile-db=", 0) == 0) {
+            // make runs in IRgen/<language>, so the path must not be relative
+            compileDb = std::filesystem::absolute(arg.substr(13)).string();
+        }
+        else {
+            std::cerr << "[Error] Unknown option: " << arg << "\n";
+            std::cerr << "Usage: IRvana.exe [--format=ll|bc] [--dump-ll] [--compile-db=compile_commands.json]\n";
+            return 1;
+        }
+    }
+
     std::string language;
     bool cleanBuild = false;
     bool applyObfuscation = false;
     std::string obfMode;
     std::string obfPasses;
+    bool stripDeadCode = false;
+    std::string optPreset;
+    bool inlining = true;
 
     // Display Header
     std::cout << R"(
@@ -164,6 +213,10 @@ Supported languages:
         std::cerr << "\n[Error] Unsupported language: " << language << "\n";
         return 1;
     }
+    if (!compileDb.empty() && language != "c" && language != "cxx") {
+        std::cerr << "\n[Error] --compile-db is only supported for c and cxx\n";
+        return 1;
+    }
 
     // Instructions
     std::filesystem::path projectRoot = getProjectRoot();
@@ -171,33 +224,42 @@ Supported languages:
 
     std::cout << "\n------------------------------------------------------------\n";
     std::cout << "[Info] Language selected: " << language << "\n";
-    std::cout << "[Note] Make sure your source file(s) are placed in:\n";
-    std::wcout << L"        " << srcDir.wstring() << L"\n";
+    if (!compileDb.empty()) {
+        std::cout << "[Note] Every C/C++ file of the compilation database is compiled with its own flags:\n";
+        std::cout << "        " << compileDb << "\n";
+    }
+    else {
+        std::cout << "[Note] Make sure your source file(s) are placed in:\n";
+        std::wcout << L"        " << srcDir.wstring() << L"\n";
 
-    std::cout << "[Tip] If your project includes headers or extra src dirs,\n";
-    std::cout << "      edit the Makefile (Makefile.ir.mk) to add them (e.g., `include` folder).\n";
+        std::cout << "[Tip] If your project includes headers or extra src dirs,\n";
+        std::cout << "      edit the Makefile (Makefile.ir.mk) to add them (e.g., `include` folder).\n";
+        if (language == "c" || language == "cxx") {
+            std::cout << "      For a CMake project, run IRvana.exe --compile-db=<build dir>\\compile_commands.json instead.\n";
+        }
 
-    if (language == "rust") {
-        std::cout << "\n[Note for Rust]:\n";
-        std::cout << " - Ensure your project's Cargo.toml is integrated with the one in:\n";
-        std::wcout << L"   " << (srcDir / "Cargo.toml").wstring() << L"\n";
-        std::cout << " - This allows dynamic dependency fetching during IR generation.\n";
-    }
+        if (language == "rust") {
+            std::cout << "\n[Note for Rust]:\n";
+            std::cout << " - Ensure your project's Cargo.toml is integrated with the one in:\n";
+            std::wcout << L"   " << (srcDir / "Cargo.toml").wstring() << L"\n";
+            std::cout << " - This allows dynamic dependency fetching during IR generation.\n";
+        }
 
-    // Check if any source files exist in src/
-    bool foundSrc = false;
-    if (std::filesystem::exists(srcDir)) {
-        for (const auto& entry : std::filesystem::directory_iterator(srcDir)) {
-            if (entry.is_regular_file()) {
-                foundSrc = true;
-                break;
+        // Check if any source files exist in src/
+        bool foundSrc = false;
+        if (std::filesystem::exists(srcDir)) {
+            for (const auto& entry : std::filesystem::directory_iterator(srcDir)) {
+                if (entry.is_regular_file()) {
+                    foundSrc = true;
+                    break;
+                }
             }
         }
-    }
 
-    if (!foundSrc) {
-        std::cerr << "[!] Warning: No source files found in " << srcDir << "\n";
-        std::cerr << "    Make sure to place your source file(s) before continuing.\n";
+        if (!foundSrc) {
+            std::cerr << "[!] Warning: No source files found in " << srcDir << "\n";
+            std::cerr << "    Make sure to place your source file(s) before continuing.\n";
+        }
     }
     std::cout << "------------------------------------------------------------\n\n";
 
@@ -212,7 +274,7 @@ Supported languages:
 
     if (applyObfuscation) {
         std::cout << "\n>> Select obfuscation mode:\n";
-        std::cout << "   [1] Obfuscate after linking final.ll (obf_final)\n";
+        std::cout << "   [1] Obfuscate after linking final." << irFormat << " (obf_final)\n";
         std::cout << "   [2] Obfuscate individual IR files before linking (obf_ir)\n";
         std::cout << ">> Choice: ";
 
@@ -279,19 +341,45 @@ Supported languages:
         }
     }
 
+    std::cout << "\n-- Optimization Preset --\n";
+    std::cout << "   [0] Language default (C/Nim: O0, C++: O2, Rust: release)\n";
+    std::cout << "   [1] O0  [2] O1  [3] O2  [4] Oz\n";
+    std::cout << ">> Optimize the IR before obfuscation: ";
+    int optChoice = 0;
+    std::cin >> optChoice;
+    const char* presets[] = { "", "O0", "O1", "O2", "Oz" };
+    optPreset = (optChoice > 0 && optChoice < 5) ? presets[optChoice] : "";
+    if (optPreset != "O0") {
+        std::cout << ">> Allow inlining before obfuscation? [1 = Yes, 0 = No]: ";
+        std::cin >> inlining;
+    }
+
+    // Stripping runs on the linked final IR, so it cannot precede obf_ir
+    if (!applyObfuscation || obfMode == "final") {
+        std::cout << "\n-- Dead Code Stripping --\n";
+        std::cout << ">> Strip code unreachable from main before obfuscation? [1 = Yes, 0 = No]: ";
+        std::cin >> stripDeadCode;
+    }
+
     std::cout << "\n============================================================\n";
     std::cout << " Build Configuration\n";
     std::cout << "------------------------------------------------------------\n";
     std::cout << "Language      : " << language << "\n";
     std::cout << "Clean Build   : " << (cleanBuild ? "Yes" : "No") << "\n";
     std::cout << "Obfuscation   : " << (applyObfuscation ? "Yes" : "No") << "\n";
+    std::cout << "Optimization  : " << (optPreset.empty() ? "Default" : optPreset) << (inlining ? "" : " (no inlining)") << "\n";
+    std::cout << "Strip Dead    : " << (stripDeadCode ? "Yes" : "No") << "\n";
+    if (!compileDb.empty()) {
+        std::cout << "Compile DB    : " << compileDb << "\n";
+    }
+    std::cout << "IR Format     : " << irFormat << (irFormat == "bc" && dumpIR ? " (with .ll dump)" : "") << "\n";
     if (applyObfuscation) {
-        std::cout << "Obf. Mode     : " << (obfMode == "final" ? "final.ll (after linking)" : "IR files (before linking)") << "\n";
+        std::cout << "Obf. Mode     : " << (obfMode == "final" ? "final." + irFormat + " (after linking)" : "IR files (before linking)") << "\n";
         std::cout << "Obf. Passes   : " << obfPasses << "\n";
     }
     std::cout << "============================================================\n\n";
 
-    bool result = runMake(language, cleanBuild, applyObfuscation, obfMode, obfPasses);
+    bool result = runMake(language, cleanBuild, applyObfuscation, obfMode, obfPasses, stripDeadCode, optPreset, inlining, irFormat, dumpIR, compileDb);
 
     if (!result) {
         std::cerr << "[x] Build failed.\n";
@@ -299,7 +387,7 @@ Supported languages:
     }
 
     std::filesystem::path baseDir = getProjectRoot();
-    std::filesystem::path irOutputPath = baseDir / "IRgen" / language / "ir_bin" / ("final" + std::string(applyObfuscation ? "-obf.ll" : ".ll"));
+    std::filesystem::path irOutputPath = baseDir / "IRgen" / language / "ir_bin" / ("final" + std::string(applyObfuscation ? "-obf." : ".") + irFormat);
     std::wstring fullWinPath = irOutputPath.wstring();
 
     // Construct path to lli.exe inside LLVM-18.1.5
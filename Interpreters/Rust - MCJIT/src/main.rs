@@ -10,7 +10,7 @@ use inkwell::OptimizationLevel;
 use std::env;
 use std::error::Error;
 use std::ffi::{CString}; // CStr removed (only needed on Unix)
-use std::fs;
+use std::path::Path;
 use std::os::raw::{c_char, c_int};
 
 #[cfg(unix)]
@@ -44,7 +44,7 @@ fn main() -> Result<(), Box<dyn Error>> {
             args[0]
         );
         eprintln!("Options:");
-        eprintln!("  <LLVM IR file>         Path to LLVM IR file (.ll) to execute");
+        eprintln!("  <LLVM IR file>         Path to LLVM IR file (.ll or .bc) to execute");
         eprintln!("  [main-args...]         Arguments passed to main(int argc, char** argv)");
         eprintln!("  --load=shared-lib      Load shared library before execution\n");
         return Ok(());
@@ -61,9 +61,10 @@ fn main() -> Result<(), Box<dyn Error>> {
         }
     }
 
+    // Maps the file instead of copying it; textual IR and bitcode are both
+    // accepted, bitcode being much faster to load
     let context = Context::create();
-    let ir_bytes = fs::read(ir_file)?;
-    let memory_buffer = MemoryBuffer::create_from_memory_range(&ir_bytes, ir_file);
+    let memory_buffer = MemoryBuffer::create_from_file(Path::new(ir_file))?;
     let module = context.create_module_from_ir(memory_buffer)?;
     let execution_engine: ExecutionEngine =
         module.create_jit_execution_engine(OptimizationLevel::Default)?;
@@ -83,10 +84,16 @@ fn main() -> Result<(), Box<dyn Error>> {
         .collect();
     let c_main_ptrs: Vec<*const c_char> = c_main_args.iter().map(|arg| arg.as_ptr()).collect();
 
+    // Runs llvm.global_ctors, e.g. the eager string decryption of the
+    // obfuscator (EagerDecrypt in goron.yaml)
+    execution_engine.run_static_constructors();
+
     unsafe {
         let ret = main.call(c_main_ptrs.len() as c_int, c_main_ptrs.as_ptr());
         println!("Program exited with: {}", ret);
     }
 
+    execution_engine.run_static_destructors();
+
     Ok(())
 }
@@ -32,7 +32,7 @@ int main(int argc, char **argv) {
         errs() << "Usage:\n";
         errs() << "  " << argv[0] << " <LLVM IR file> [main-args...] [--load=shared-lib]\n\n";
         errs() << "Options:\n";
-        errs() << "  <LLVM IR file>         Path to LLVM IR file (.ll) to execute\n";
+        errs() << "  <LLVM IR file>         Path to LLVM IR file (.ll or .bc) to execute\n";
         errs() << "  [main-args...]         (Optional) Arguments passed to main(argc, argv)\n";
         errs() << "  --load=shared-lib      (Optional) Load shared library for symbols\n";
         return 1;
@@ -117,8 +117,14 @@ int main(int argc, char **argv) {
         args.push_back(gv_argv);
     }
 
+    // Runs llvm.global_ctors, e.g. the eager string decryption of the
+    // obfuscator (EagerDecrypt in goron.yaml)
+    engine->runStaticConstructorsDestructors(false);
+
     GenericValue result = engine->runFunction(func, args);
     outs() << "Result: " << result.IntVal << "\n";
 
+    engine->runStaticConstructorsDestructors(true);
+
     return 0;
 }
@@ -30,6 +30,7 @@ int main(int argc, char **argv) {
     if (argc < 2) {
         errs() << "Usage:\n";
         errs() << "  " << argv[0] << " <LLVM IR file> [main-args...] [--load=shared-lib]\n\n";
+        errs() << "  <LLVM IR file> may be textual IR (.ll) or bitcode (.bc)\n";
         return 1;
     }
 
@@ -55,15 +56,17 @@ int main(int argc, char **argv) {
         }
     }
 
-    LLVMContext ctx;
+    // parseIRFile reads bitcode as well as textual IR. The module must be
+    // created in the context the ThreadSafeModule owns
+    auto ctx = std::make_unique<LLVMContext>();
     SMDiagnostic err;
-    auto mod = parseIRFile(inputFile, err, ctx);
+    auto mod = parseIRFile(inputFile, err, *ctx);
     if (!mod) {
         err.print(argv[0], errs());
         return 1;
     }
 
-    auto tsm = ThreadSafeModule(std::move(mod), std::make_unique<LLVMContext>());
+    auto tsm = ThreadSafeModule(std::move(mod), std::move(ctx));
 
     auto jitOrErr = LLJITBuilder().create();
     if (!jitOrErr) {
@@ -79,6 +82,13 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    // Runs llvm.global_ctors, e.g. the eager string decryption of the
+    // obfuscator (EagerDecrypt in goron.yaml)
+    if (auto err = jit->initialize(jit->getMainJITDylib())) {
+        logAllUnhandledErrors(std::move(err), errs(), "Initialize Error: ");
+        return 1;
+    }
+
     auto mainSym = jit->lookup("main");
     if (!mainSym) {
         logAllUnhandledErrors(mainSym.takeError(), errs(), "Lookup Error: ");
@@ -95,5 +105,10 @@ int main(int argc, char **argv) {
     int result = mainFn(static_cast<int>(argvPtrs.size()), const_cast<char**>(argvPtrs.data()));
     outs() << "Result: " << result << "\n";
 
+    if (auto err = jit->deinitialize(jit->getMainJITDylib())) {
+        logAllUnhandledErrors(std::move(err), errs(), "Deinitialize Error: ");
+        return 1;
+    }
+
     return 0;
 }
@@ -0,0 +1,588 @@
+//===- irvana-cc.cpp - Compilation database IR generator ------------------===//
+//
+// Generates IR for every C and C++ file of a compilation database
+// (compile_commands.json, e.g. from cmake -DCMAKE_EXPORT_COMPILE_COMMANDS=ON),
+// each with the flags of its own entry:
+//
+//   irvana-cc -p build/compile_commands.json -clang=clang-cl.exe -o ir_bin
+//
+// writes ir_bin/<source name>.ll for each entry. The compiler of the entry
+// is replaced by -clang in the same driver mode (cl or gcc), and its output,
+// dependency and precompiled header options by the ones that emit IR. The
+// commands run -j at once, each in the directory of its entry.
+//
+// A file is compiled again only when its IR is missing, was built by another
+// command, or is older than the source or one of the headers listed in the
+// dependency file clang wrote next to it. The command of each output is
+// recorded in irvana-cc.state in the output directory.
+//
+// Sources sharing a name (or named final, or ending in -obf, which the
+// Makefiles use for their own outputs) get a hash of their path appended.
+// -list writes the output names as a make fragment for Makefile.ir.mk.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include <atomic>
+#include <mutex>
+#include <optional>
+
+using namespace llvm;
+
+static cl::opt<std::string>
+    DatabasePath("p", cl::Required,
+                 cl::desc("compile_commands.json, or the directory "
+                          "containing it"),
+                 cl::value_desc("path"));
+
+static cl::opt<std::string> OutputDirectory("o", cl::Required,
+                                            cl::desc("Output directory"),
+                                            cl::value_desc("directory"));
+
+static cl::opt<std::string>
+    ClangPath("clang", cl::Required,
+              cl::desc("clang or clang-cl that compiles the entries"),
+              cl::value_desc("path"));
+
+enum class OutputFormat { Text, Bitcode };
+static cl::opt<OutputFormat> Format(
+    "format", cl::init(OutputFormat::Text), cl::desc("Output format"),
+    cl::values(clEnumValN(OutputFormat::Text, "ll", "Textual IR"),
+               clEnumValN(OutputFormat::Bitcode, "bc", "Bitcode")));
+
+static cl::opt<std::string>
+    OptLevel("opt", cl::value_desc("O0|O1|O2|Oz"),
+             cl::desc("Optimization level, instead of the one of each entry"));
+
+static cl::opt<bool> NoInline("no-inline",
+                              cl::desc("Keep the optimizer from inlining"));
+
+static cl::list<std::string>
+    ExtraArgs("extra-arg", cl::value_desc("argument"),
+              cl::desc("Added to every command, in the syntax of its driver"));
+
+static cl::opt<unsigned>
+    Jobs("j", cl::init(0),
+         cl::desc("Number of files compiled at once (default: all cores)"));
+
+static cl::opt<std::string>
+    ListFilename("list", cl::value_desc("filename"),
+                 cl::desc("Write the output names as a make fragment "
+                          "(IR_DB_NAMES := ...)"));
+
+static cl::opt<bool> ListOnly("list-only",
+                              cl::desc("Only write -list, compile nothing"));
+
+static cl::opt<bool> Verbose("v", cl::desc("Print each command"));
+
+static std::mutex DiagLock;
+
+static bool fail(StringRef Input, const Twine &Message) {
+  std::lock_guard<std::mutex> Lock(DiagLock);
+  errs() << "irvana-cc: " << Input << ": " << Message << "\n";
+  return false;
+}
+
+namespace {
+
+// One translation unit of the database.
+struct Entry {
+  std::string Directory;
+  std::string File;
+  std::vector<std::string> Arguments;
+  std::string Name;
+  bool ClDriver = false;
+};
+
+} // namespace
+
+static cl::TokenizerCallback commandTokenizer() {
+  return sys::path::is_style_windows(sys::path::Style::native)
+             ? cl::TokenizeWindowsCommandLine
+             : cl::TokenizeGNUCommandLine;
+}
+
+static std::string absolutePath(StringRef Directory, StringRef Path) {
+  SmallString<256> Result(Path);
+  sys::fs::make_absolute(Directory, Result);
+  sys::path::remove_dots(Result, true);
+  return std::string(Result);
+}
+
+static bool isSourceFile(StringRef File) {
+  StringRef Ext = sys::path::extension(File);
+  for (StringRef Known : {".c", ".cc", ".cp", ".cpp", ".cxx", ".c++"}) {
+    if (Ext.equals_insensitive(Known)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Drops compiler wrappers such as ccache, then tells whether the compiler
+// takes cl-style options.
+static bool isClDriver(std::vector<std::string> &Arguments) {
+  while (Arguments.size() > 1) {
+    StringRef Stem = sys::path::stem(Arguments.front());
+    if (!Stem.equals_insensitive("ccache") &&
+        !Stem.equals_insensitive("sccache")) {
+      break;
+    }
+    Arguments.erase(Arguments.begin());
+  }
+  for (StringRef Arg : Arguments) {
+    if (Arg.consume_front("--driver-mode=")) {
+      return Arg == "cl";
+    }
+  }
+  StringRef Stem = sys::path::stem(Arguments.front());
+  return Stem.equals_insensitive("cl") ||
+         Stem.ends_with_insensitive("clang-cl");
+}
+
+static bool readEntry(const json::Value &Value, StringSaver &Saver,
+                      Entry &E) {
+  const json::Object *Object = Value.getAsObject();
+  if (!Object) {
+    return false;
+  }
+  std::optional<StringRef> Directory = Object->getString("directory");
+  std::optional<StringRef> File = Object->getString("file");
+  if (!Directory || !File) {
+    return false;
+  }
+
+  SmallVector<const char *, 64> Argv;
+  if (const json::Array *Arguments = Object->getArray("arguments")) {
+    for (const json::Value &Arg : *Arguments) {
+      if (std::optional<StringRef> S = Arg.getAsString()) {
+        Argv.push_back(Saver.save(*S).data());
+      }
+    }
+  } else if (std::optional<StringRef> Command = Object->getString("command")) {
+    commandTokenizer()(*Command, Saver, Argv, false);
+  }
+  if (Argv.empty()) {
+    return false;
+  }
+  // Response files are relative to the directory of the entry too.
+  cl::ExpansionContext Expander(Saver.getAllocator(), commandTokenizer());
+  Expander.setCurrentDir(*Directory);
+  if (Error Err = Expander.expandResponseFiles(Argv)) {
+    fail(*File, toString(std::move(Err)));
+    return false;
+  }
+
+  E.Directory = std::string(*Directory);
+  E.File = absolutePath(*Directory, *File);
+  E.Arguments.assign(Argv.begin(), Argv.end());
+  E.ClDriver = isClDriver(E.Arguments);
+  return true;
+}
+
+static bool readDatabase(std::vector<Entry> &Entries) {
+  SmallString<256> Path(DatabasePath);
+  if (sys::fs::is_directory(Path)) {
+    sys::path::append(Path, "compile_commands.json");
+  }
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Buf = MemoryBuffer::getFile(Path);
+  if (!Buf) {
+    return fail(Path, Buf.getError().message());
+  }
+  Expected<json::Value> Root = json::parse((*Buf)->getBuffer());
+  if (!Root) {
+    return fail(Path, toString(Root.takeError()));
+  }
+  const json::Array *Commands = Root->getAsArray();
+  if (!Commands) {
+    return fail(Path, "expected an array of compile commands");
+  }
+
+  BumpPtrAllocator Alloc;
+  StringSaver Saver(Alloc);
+  StringMap<bool> Seen;
+  unsigned Skipped = 0;
+  for (unsigned I = 0; I != Commands->size(); ++I) {
+    Entry E;
+    if (!readEntry((*Commands)[I], Saver, E)) {
+      return fail(Path, "entry " + Twine(I) +
+                            " has no directory, file and command");
+    }
+    if (!isSourceFile(E.File)) {
+      ++Skipped;
+      continue;
+    }
+    // A file built in several configurations keeps its first entry.
+    if (Seen.insert({E.File, true}).second) {
+      Entries.push_back(std::move(E));
+    }
+  }
+  if (Skipped) {
+    fail(Path, "skipped " + Twine(Skipped) + " entries that are not C or C++");
+  }
+  return true;
+}
+
+// Names each output after its source, with a hash of the source path when
+// the name is taken.
+static void assignNames(std::vector<Entry> &Entries) {
+  StringMap<unsigned> Count;
+  for (Entry &E : Entries) {
+    std::string Name = sys::path::stem(E.File).str();
+    for (char &C : Name) {
+      if (!isAlnum(C) && C != '-' && C != '_' && C != '.') {
+        C = '_';
+      }
+    }
+    E.Name = Name;
+    ++Count[StringRef(Name).lower()];
+  }
+  for (Entry &E : Entries) {
+    StringRef Name(E.Name);
+    if (Count[Name.lower()] > 1 || Name.equals_insensitive("final") ||
+        Name.ends_with_insensitive("-obf")) {
+      E.Name += "-" + utohexstr(xxh3_64bits(E.File) & 0xffffffff, true, 8);
+    }
+  }
+}
+
+static bool writeList(ArrayRef<Entry> Entries) {
+  std::error_code EC;
+  raw_fd_ostream OS(ListFilename, EC, sys::fs::OF_Text);
+  if (EC) {
+    return fail(ListFilename, EC.message());
+  }
+  OS << "# Generated by irvana-cc from " << DatabasePath << "\n";
+  OS << "IR_DB_NAMES :=";
+  for (const Entry &E : Entries) {
+    OS << " \\\n  " << E.Name;
+  }
+  OS << "\n";
+  return true;
+}
+
+// The command that writes Output and its dependency file DepFile.
+static std::vector<std::string> buildCommand(const Entry &E,
+                                             StringRef Output,
+                                             StringRef DepFile) {
+  std::vector<std::string> Command = {
+      ClangPath, E.ClDriver ? "--driver-mode=cl" : "--driver-mode=gcc"};
+  // Options of the entry, without the source, output, dependency file and
+  // precompiled header options.
+  for (unsigned I = 1; I < E.Arguments.size(); ++I) {
+    StringRef Arg = E.Arguments[I];
+    if (Arg.starts_with("--driver-mode=")) {
+      continue;
+    }
+    bool IsOption = Arg.starts_with("-") || (E.ClDriver && Arg.starts_with("/"));
+    if (!IsOption) {
+      if (absolutePath(E.Directory, Arg) != E.File) {
+        Command.push_back(Arg.str());
+      }
+      continue;
+    }
+    if (E.ClDriver) {
+      StringRef Name = Arg.drop_front();
+      if (Name == "c" || Name.starts_with("showIncludes") ||
+          Name.starts_with("Fo") || Name.starts_with("Fd") ||
+          Name.starts_with("Fa") || Name.starts_with("Fe") ||
+          Name.starts_with("Fi") || Name.starts_with("Fp") ||
+          Name.starts_with("FR") || Name.starts_with("Fr") ||
+          Name.starts_with("Yc") || Name.starts_with("Yu")) {
+        continue;
+      }
+    } else {
+      if (Arg == "-c" || Arg == "-S" || Arg == "-E" || Arg == "-emit-llvm" ||
+          Arg == "-M" || Arg == "-MM" || Arg == "-MD" || Arg == "-MMD" ||
+          Arg == "-MP" || Arg == "-MG" || Arg.starts_with("-Wp,-M")) {
+        continue;
+      }
+      if (Arg == "-o" || Arg == "-MF" || Arg == "-MT" || Arg == "-MQ" ||
+          Arg == "-MJ") {
+        ++I;
+        continue;
+      }
+      if ((Arg.starts_with("-o") && !Arg.starts_with("-obj")) ||
+          Arg.starts_with("-MF") || Arg.starts_with("-MT") ||
+          Arg.starts_with("-MQ") || Arg.starts_with("-MJ")) {
+        continue;
+      }
+    }
+    Command.push_back(Arg.str());
+  }
+  Command.insert(Command.end(), ExtraArgs.begin(), ExtraArgs.end());
+
+  // clang-cl takes the gcc-style options after /clang:.
+  std::vector<std::string> IROptions = {"-emit-llvm"};
+  if (Format == OutputFormat::Text) {
+    IROptions.push_back("-S");
+  }
+  if (!OptLevel.empty()) {
+    IROptions.push_back("-" + OptLevel);
+  }
+  if (NoInline) {
+    IROptions.push_back("-fno-inline");
+  }
+  for (StringRef Option : {StringRef("-o"), Output, StringRef("-MD"),
+                           StringRef("-MF"), DepFile,
+                           StringRef("-working-directory"),
+                           StringRef(E.Directory)}) {
+    IROptions.push_back(Option.str());
+  }
+  Command.push_back(E.ClDriver ? "/c" : "-c");
+  for (const std::string &Option : IROptions) {
+    Command.push_back(E.ClDriver ? "/clang:" + Option : Option);
+  }
+  Command.push_back("--");
+  Command.push_back(E.File);
+  return Command;
+}
+
+static uint64_t commandHash(ArrayRef<std::string> Command) {
+  std::string Joined;
+  for (const std::string &Arg : Command) {
+    Joined += Arg;
+    Joined += '\0';
+  }
+  return xxh3_64bits(Joined);
+}
+
+// Reads the prerequisites of the rule clang -MD writes: everything after
+// the first colon that ends the target, separated by whitespace, with
+// escaped spaces and line continuations.
+static bool readDepFile(StringRef DepFile, std::vector<std::string> &Deps) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Buf = MemoryBuffer::getFile(DepFile);
+  if (!Buf) {
+    return false;
+  }
+  StringRef Text = (*Buf)->getBuffer();
+  size_t Start = 0;
+  do {
+    Start = Text.find(':', Start) + 1;
+  } while (Start != 0 && Start < Text.size() && !isSpace(Text[Start]));
+  if (Start == 0) {
+    return false;
+  }
+
+  std::string Dep;
+  for (size_t I = Start; I <= Text.size(); ++I) {
+    char C = I < Text.size() ? Text[I] : '\n';
+    char Next = I + 1 < Text.size() ? Text[I + 1] : '\0';
+    if (C == '\\' && (Next == ' ' || Next == '#')) {
+      Dep += Next;
+      ++I;
+    } else if (C == '$' && Next == '$') {
+      Dep += '$';
+      ++I;
+    } else if (C == '\\' && (Next == '\n' || Next == '\r')) {
+      ++I;
+    } else if (isSpace(C)) {
+      if (!Dep.empty()) {
+        Deps.push_back(std::move(Dep));
+        Dep.clear();
+      }
+    } else {
+      Dep += C;
+    }
+  }
+  return !Deps.empty();
+}
+
+static bool isUpToDate(const Entry &E, StringRef Output, StringRef DepFile) {
+  sys::fs::file_status OutputStatus;
+  std::vector<std::string> Deps;
+  if (sys::fs::status(Output, OutputStatus) || !readDepFile(DepFile, Deps)) {
+    return false;
+  }
+  for (const std::string &Dep : Deps) {
+    sys::fs::file_status DepStatus;
+    if (sys::fs::status(absolutePath(E.Directory, Dep), DepStatus) ||
+        DepStatus.getLastModificationTime() >
+            OutputStatus.getLastModificationTime()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Runs the command with its diagnostics captured, so that the output of
+// parallel commands is not interleaved.
+static bool compile(const Entry &E, ArrayRef<std::string> Command) {
+  if (Verbose) {
+    std::string Line;
+    raw_string_ostream OS(Line);
+    for (const std::string &Arg : Command) {
+      sys::printArg(OS, Arg, true);
+      OS << ' ';
+    }
+    std::lock_guard<std::mutex> Lock(DiagLock);
+    errs() << OS.str() << "\n";
+  }
+
+  SmallString<128> Log;
+  if (std::error_code EC = sys::fs::createTemporaryFile("irvana-cc", "log",
+                                                       Log)) {
+    return fail(E.File, EC.message());
+  }
+  SmallVector<StringRef, 64> Args(Command.begin(), Command.end());
+  std::optional<StringRef> Redirects[] = {std::nullopt, std::nullopt,
+                                          StringRef(Log)};
+  std::string ErrMsg;
+  int Result = sys::ExecuteAndWait(Command.front(), Args, std::nullopt,
+                                   Redirects, 0, 0, &ErrMsg);
+  if (ErrorOr<std::unique_ptr<MemoryBuffer>> Buf = MemoryBuffer::getFile(Log)) {
+    if ((*Buf)->getBufferSize()) {
+      std::lock_guard<std::mutex> Lock(DiagLock);
+      errs() << (*Buf)->getBuffer();
+    }
+  }
+  sys::fs::remove(Log);
+
+  if (Result != 0) {
+    return fail(E.File, ErrMsg.empty()
+                            ? "clang exited with " + Twine(Result)
+                            : Twine(ErrMsg));
+  }
+  return true;
+}
+
+// Hashes of the command that built each output, by output name.
+static void readState(StringRef Path, StringMap<uint64_t> &State) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Buf = MemoryBuffer::getFile(Path);
+  if (!Buf) {
+    return;
+  }
+  SmallVector<StringRef, 0> Lines;
+  (*Buf)->getBuffer().split(Lines, '\n', -1, false);
+  for (StringRef Line : Lines) {
+    auto [Hash, Name] = Line.trim().split(' ');
+    uint64_t Value;
+    if (!Name.empty() && !Hash.getAsInteger(16, Value)) {
+      State[Name] = Value;
+    }
+  }
+}
+
+static bool writeState(StringRef Path, const StringMap<uint64_t> &State) {
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::OF_Text);
+  if (EC) {
+    return fail(Path, EC.message());
+  }
+  for (const auto &Item : State) {
+    OS << format_hex_no_prefix(Item.second, 16) << ' ' << Item.first()
+       << "\n";
+  }
+  return true;
+}
+
+static bool compileAll(ArrayRef<Entry> Entries) {
+  SmallString<256> Directory(OutputDirectory);
+  sys::fs::make_absolute(Directory);
+  SmallString<256> StatePath(Directory);
+  sys::path::append(StatePath, "irvana-cc.state");
+  StringMap<uint64_t> State;
+  readState(StatePath, State);
+
+  struct Job {
+    const Entry *E;
+    std::vector<std::string> Command;
+    uint64_t Hash;
+  };
+  std::vector<Job> Stale;
+  for (const Entry &E : Entries) {
+    SmallString<256> Output(Directory);
+    sys::path::append(Output, E.Name + (Format == OutputFormat::Bitcode
+                                            ? ".bc"
+                                            : ".ll"));
+    std::string DepFile = (Output + ".d").str();
+    std::vector<std::string> Command = buildCommand(E, Output, DepFile);
+    uint64_t Hash = commandHash(Command);
+    auto Recorded = State.find(E.Name);
+    if (Recorded == State.end() || Recorded->second != Hash ||
+        !isUpToDate(E, Output, DepFile)) {
+      State.erase(E.Name);
+      Stale.push_back({&E, std::move(Command), Hash});
+    }
+  }
+
+  double Start = TimeRecord::getCurrentTime().getWallTime();
+  std::atomic<unsigned> Started(0), Failed(0);
+  std::mutex StateLock;
+  ThreadPool Pool(hardware_concurrency(Jobs));
+  for (unsigned I = 0; I != Stale.size(); ++I) {
+    Pool.async([&, I] {
+      const Job &J = Stale[I];
+      unsigned N = ++Started;
+      {
+        std::lock_guard<std::mutex> Lock(DiagLock);
+        errs() << "[" << N << "/" << Stale.size() << "] " << J.E->File
+               << "\n";
+      }
+      if (!compile(*J.E, J.Command)) {
+        ++Failed;
+        return;
+      }
+      std::lock_guard<std::mutex> Lock(StateLock);
+      State[J.E->Name] = J.Hash;
+    });
+  }
+  Pool.wait();
+
+  bool Written = writeState(StatePath, State);
+  errs() << "irvana-cc: compiled " << Stale.size() - Failed << " of "
+         << Entries.size() << " files, " << Entries.size() - Stale.size()
+         << " up to date";
+  if (Failed) {
+    errs() << ", " << Failed << " failed";
+  }
+  errs() << format(", %.2f s\n",
+                   TimeRecord::getCurrentTime().getWallTime() - Start);
+  return Written && !Failed;
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(
+      argc, argv,
+      "IRvana compilation database IR generator\n\n"
+      "  Compiles every C and C++ entry of compile_commands.json to IR, with\n"
+      "  its own flags, several files at once.\n");
+
+  std::vector<Entry> Entries;
+  if (!readDatabase(Entries)) {
+    return 1;
+  }
+  if (Entries.empty()) {
+    fail(DatabasePath, "no C or C++ entries");
+    return 1;
+  }
+  assignNames(Entries);
+
+  if (!ListFilename.empty() && !writeList(Entries)) {
+    return 1;
+  }
+  if (ListOnly) {
+    return 0;
+  }
+  if (std::error_code EC = sys::fs::create_directories(OutputDirectory)) {
+    fail(OutputDirectory, EC.message());
+    return 1;
+  }
+  return compileAll(Entries) ? 0 : 1;
+}
@@ -0,0 +1,421 @@
+//===- irvana-link.cpp - Parallel IR linker -------------------------------===//
+//
+// Links many IR files into one bitcode module, like llvm-link, but parses
+// and links on a thread pool:
+//
+//   irvana-link -j 8 -o ir_bin/final.ll ir_bin/a.ll ir_bin/b.ll ...
+//
+// The inputs are split into contiguous groups of about the same size, one
+// per thread. Each group is parsed and linked in its own LLVMContext and
+// kept as bitcode, then the groups are linked into the output. The groups
+// keep the order of the inputs, so the result is the same as llvm-link's.
+// Smaller groups are also faster to build: the cost of linking one more
+// file grows with the module it is linked into.
+//
+// With -only-needed, every input is first parsed on its own and only the
+// inputs reachable from the -entry symbols are linked, the way a linker
+// pulls members out of a static library. Inputs with dllexport definitions,
+// or with constructors, destructors or llvm.used entries that are not local,
+// are always linked. Local ones, such as the string decryption constructor
+// and the tables llvm.compiler.used keeps in every obfuscated module, do not
+// make their input needed.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+#include <atomic>
+#include <mutex>
+
+using namespace llvm;
+
+static cl::list<std::string> InputFilenames(cl::Positional, cl::OneOrMore,
+                                            cl::desc("<input .ll/.bc files>"));
+
+static cl::opt<std::string> OutputFilename("o", cl::Required,
+                                           cl::desc("Output file"),
+                                           cl::value_desc("filename"));
+
+static cl::opt<bool> OutputAssembly("S",
+                                    cl::desc("Write textual IR instead of "
+                                             "bitcode"));
+
+static cl::opt<unsigned>
+    Jobs("j", cl::init(0),
+         cl::desc("Number of files parsed at once (default: all cores)"));
+
+static cl::opt<bool>
+    OnlyNeeded("only-needed",
+               cl::desc("Link only the inputs reachable from -entry"));
+
+static cl::list<std::string>
+    Entries("entry", cl::CommaSeparated, cl::value_desc("symbols"),
+            cl::desc("Entry points of -only-needed (default: main)"));
+
+static cl::opt<bool>
+    Stats("link-stats", cl::desc("Print the time of each linking stage"));
+
+static std::mutex DiagLock;
+
+static bool fail(StringRef Input, const Twine &Message) {
+  std::lock_guard<std::mutex> Lock(DiagLock);
+  errs() << "irvana-link: " << Input << ": " << Message << "\n";
+  return false;
+}
+
+static bool parseFailed(const SMDiagnostic &Err) {
+  std::string Message;
+  raw_string_ostream OS(Message);
+  Err.print("irvana-link", OS);
+  std::lock_guard<std::mutex> Lock(DiagLock);
+  errs() << OS.str();
+  return false;
+}
+
+namespace {
+
+// An input file, or a module already linked and kept as bitcode in memory.
+struct Source {
+  std::string Name;
+  SmallVector<char, 0> Bitcode;
+  uint64_t Size = 0;
+
+  std::unique_ptr<Module> load(LLVMContext &Ctx) const {
+    SMDiagnostic Err;
+    std::unique_ptr<Module> M =
+        Bitcode.empty()
+            ? parseIRFile(Name, Err, Ctx)
+            : parseIR(MemoryBufferRef(StringRef(Bitcode.data(), Bitcode.size()),
+                                      Name),
+                      Err, Ctx);
+    if (!M) {
+      parseFailed(Err);
+    }
+    return M;
+  }
+
+  void store(Module &M) {
+    Bitcode.clear();
+    raw_svector_ostream OS(Bitcode);
+    WriteBitcodeToFile(M, OS);
+    Size = Bitcode.size();
+  }
+};
+
+// Symbols an input defines and references, for -only-needed.
+struct Symbols {
+  // Defined symbols, and whether the definition is strong.
+  std::vector<std::pair<std::string, bool>> Defined;
+  std::vector<std::string> Referenced;
+  bool Root = false;
+};
+
+}
+
+// Links Group, in order, into one module of Ctx. Inputs are linked into an
+// empty module, as llvm-link does, so that the result does not depend on
+// how they are grouped.
+static std::unique_ptr<Module> linkGroup(ArrayRef<const Source *> Group,
+                                         bool Inputs, LLVMContext &Ctx) {
+  std::unique_ptr<Module> Linked;
+  size_t Next = 0;
+  if (Inputs) {
+    Linked = std::make_unique<Module>("llvm-link", Ctx);
+  } else if (!(Linked = Group[Next++]->load(Ctx))) {
+    return nullptr;
+  }
+  // One Linker for the group: each Linker scans the whole destination.
+  Linker L(*Linked);
+  for (const Source *S : Group.drop_front(Next)) {
+    std::unique_ptr<Module> M = S->load(Ctx);
+    if (!M) {
+      return nullptr;
+    }
+    if (L.linkInModule(std::move(M))) {
+      fail(S->Name, "cannot link the file");
+      return nullptr;
+    }
+  }
+  return Linked;
+}
+
+// Whether an element of llvm.used, llvm.global_ctors or llvm.global_dtors
+// names a definition another module could refer to.
+static bool isExternalEntry(const Constant *Entry) {
+  if (const ConstantStruct *CS = dyn_cast<ConstantStruct>(Entry)) {
+    Entry = CS->getOperand(1);
+  }
+  const GlobalValue *GV =
+      dyn_cast<GlobalValue>(Entry->stripPointerCasts());
+  return GV && !GV->hasLocalLinkage() && !GV->isDeclarationForLinker();
+}
+
+static void collectSymbols(Module &M, Symbols &Syms) {
+  for (GlobalValue &GV : M.global_values()) {
+    if (GV.hasLocalLinkage() || GV.getName().empty() ||
+        GV.getName().starts_with("llvm.")) {
+      continue;
+    }
+    if (GV.isDeclarationForLinker()) {
+      Syms.Referenced.push_back(std::string(GV.getName()));
+      continue;
+    }
+    Syms.Defined.emplace_back(std::string(GV.getName()),
+                              !GV.isWeakForLinker());
+    if (GV.hasDLLExportStorageClass()) {
+      Syms.Root = true;
+    }
+  }
+  for (StringRef Name : {"llvm.global_ctors", "llvm.global_dtors",
+                         "llvm.used"}) {
+    GlobalVariable *GV = M.getGlobalVariable(Name);
+    if (!GV || !GV->hasInitializer()) {
+      continue;
+    }
+    if (const ConstantArray *CA = dyn_cast<ConstantArray>(GV->getInitializer())) {
+      for (const Use &Op : CA->operands()) {
+        if (isExternalEntry(cast<Constant>(Op.get()))) {
+          Syms.Root = true;
+        }
+      }
+    }
+  }
+}
+
+// Parses every input on its own into bitcode and returns the ones reachable
+// from the entry points.
+static bool selectNeeded(std::vector<Source> &Sources,
+                         std::vector<const Source *> &Needed) {
+  std::vector<Symbols> Syms(Sources.size());
+  std::atomic<bool> Failed(false);
+  ThreadPool Pool(hardware_concurrency(Jobs));
+  for (unsigned I = 0; I != Sources.size(); ++I) {
+    Pool.async([&, I] {
+      LLVMContext Ctx;
+      std::unique_ptr<Module> M = Sources[I].load(Ctx);
+      if (!M) {
+        Failed = true;
+        return;
+      }
+      collectSymbols(*M, Syms[I]);
+      Sources[I].store(*M);
+    });
+  }
+  Pool.wait();
+  if (Failed) {
+    return false;
+  }
+
+  // A strong definition wins over weak ones; among equals, the first input.
+  StringMap<std::pair<unsigned, bool>> Provider;
+  for (unsigned I = 0; I != Sources.size(); ++I) {
+    for (const auto &[Name, Strong] : Syms[I].Defined) {
+      auto [It, Inserted] = Provider.try_emplace(Name, I, Strong);
+      if (!Inserted && Strong && !It->second.second) {
+        It->second = {I, true};
+      }
+    }
+  }
+
+  std::vector<bool> Linked(Sources.size());
+  std::vector<unsigned> Worklist;
+  auto pull = [&](unsigned I) {
+    if (!Linked[I]) {
+      Linked[I] = true;
+      Worklist.push_back(I);
+    }
+  };
+  bool HasEntry = false;
+  for (const std::string &Entry : Entries) {
+    auto It = Provider.find(Entry);
+    if (It != Provider.end()) {
+      pull(It->second.first);
+      HasEntry = true;
+    }
+  }
+  if (!HasEntry) {
+    return fail(OutputFilename, "no input defines the entry points");
+  }
+  for (unsigned I = 0; I != Sources.size(); ++I) {
+    if (Syms[I].Root) {
+      pull(I);
+    }
+  }
+  while (!Worklist.empty()) {
+    unsigned I = Worklist.back();
+    Worklist.pop_back();
+    // A weak definition can be replaced by a strong one of another input.
+    for (const auto &Def : Syms[I].Defined) {
+      pull(Provider[Def.first].first);
+    }
+    for (const std::string &Name : Syms[I].Referenced) {
+      auto It = Provider.find(Name);
+      if (It != Provider.end()) {
+        pull(It->second.first);
+      }
+    }
+  }
+
+  for (unsigned I = 0; I != Sources.size(); ++I) {
+    if (Linked[I]) {
+      Needed.push_back(&Sources[I]);
+    }
+  }
+  return true;
+}
+
+// Splits Inputs into at most N contiguous groups of about the same size.
+static std::vector<ArrayRef<const Source *>>
+splitGroups(ArrayRef<const Source *> Inputs, unsigned N) {
+  uint64_t Total = 0;
+  for (const Source *S : Inputs) {
+    Total += S->Size;
+  }
+  std::vector<ArrayRef<const Source *>> Groups;
+  size_t Begin = 0;
+  uint64_t Done = 0;
+  for (size_t I = 0; I != Inputs.size(); ++I) {
+    Done += Inputs[I]->Size;
+    bool Full = Groups.size() + 1 < N &&
+                Done * N >= Total * (Groups.size() + 1);
+    if (Full || I + 1 == Inputs.size()) {
+      Groups.push_back(Inputs.slice(Begin, I + 1 - Begin));
+      Begin = I + 1;
+    }
+  }
+  return Groups;
+}
+
+static bool writeOutput(Module &M) {
+  std::string Message;
+  raw_string_ostream OS(Message);
+  if (verifyModule(M, &OS)) {
+    return fail(OutputFilename, "linked module is broken:\n" + OS.str());
+  }
+  std::error_code EC;
+  ToolOutputFile Out(OutputFilename, EC,
+                     OutputAssembly ? sys::fs::OF_TextWithCRLF
+                                    : sys::fs::OF_None);
+  if (EC) {
+    return fail(OutputFilename, EC.message());
+  }
+  if (OutputAssembly) {
+    M.print(Out.os(), nullptr);
+  } else {
+    WriteBitcodeToFile(M, Out.os());
+  }
+  Out.keep();
+  return true;
+}
+
+static double now() { return TimeRecord::getCurrentTime().getWallTime(); }
+
+static void printStage(const Twine &Stage, double Start) {
+  if (Stats) {
+    errs() << "irvana-link: " << Stage
+           << format(" in %.2f s\n", now() - Start);
+  }
+}
+
+// Links each group into bitcode on the pool, then the groups into the
+// output. Linking the groups pairwise instead would read and write the
+// whole program once per level, which costs more than the level saves.
+static bool linkAll(ArrayRef<const Source *> Inputs, unsigned Threads) {
+  std::vector<ArrayRef<const Source *>> Groups = splitGroups(Inputs, Threads);
+  double Start = now();
+  if (Groups.size() == 1) {
+    LLVMContext Ctx;
+    std::unique_ptr<Module> M = linkGroup(Groups.front(), true, Ctx);
+    printStage("linked " + Twine(Inputs.size()) + " inputs", Start);
+    return M && writeOutput(*M);
+  }
+
+  std::vector<Source> Linked(Groups.size());
+  std::atomic<bool> Failed(false);
+  ThreadPool Pool(hardware_concurrency(Jobs));
+  for (unsigned I = 0; I != Groups.size(); ++I) {
+    Pool.async([&, I] {
+      LLVMContext Ctx;
+      std::unique_ptr<Module> M = linkGroup(Groups[I], true, Ctx);
+      if (!M) {
+        Failed = true;
+        return;
+      }
+      Linked[I].Name = Groups[I].front()->Name;
+      Linked[I].store(*M);
+    });
+  }
+  Pool.wait();
+  printStage("linked " + Twine(Inputs.size()) + " inputs into " +
+                 Twine(Groups.size()) + " groups",
+             Start);
+  if (Failed) {
+    return false;
+  }
+
+  Start = now();
+  std::vector<const Source *> Parts;
+  for (const Source &S : Linked) {
+    Parts.push_back(&S);
+  }
+  LLVMContext Ctx;
+  std::unique_ptr<Module> M = linkGroup(Parts, false, Ctx);
+  printStage("linked the groups", Start);
+  return M && writeOutput(*M);
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(
+      argc, argv,
+      "IRvana parallel linker\n\n"
+      "  Links the inputs into one module, several files at once.\n");
+  if (Entries.empty()) {
+    Entries.push_back("main");
+  }
+
+  std::vector<Source> Sources(InputFilenames.size());
+  for (unsigned I = 0; I != Sources.size(); ++I) {
+    Sources[I].Name = InputFilenames[I];
+    if (std::error_code EC =
+            sys::fs::file_size(Sources[I].Name, Sources[I].Size)) {
+      fail(Sources[I].Name, EC.message());
+      return 1;
+    }
+  }
+
+  std::vector<const Source *> Inputs;
+  if (OnlyNeeded) {
+    double Start = now();
+    if (!selectNeeded(Sources, Inputs)) {
+      return 1;
+    }
+    printStage("selected " + Twine(Inputs.size()) + " of " +
+                   Twine(Sources.size()) + " inputs",
+               Start);
+  } else {
+    for (const Source &S : Sources) {
+      Inputs.push_back(&S);
+    }
+  }
+
+  unsigned Threads = hardware_concurrency(Jobs).compute_thread_count();
+  return linkAll(Inputs, Threads) ? 0 : 1;
+}
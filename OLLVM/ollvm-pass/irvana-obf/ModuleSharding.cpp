@@ -0,0 +1,379 @@
+#include "ModuleSharding.h"
+#include "llvm/ADT/EquivalenceClasses.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <algorithm>
+
+using namespace llvm;
+
+static bool isAppending(const GlobalValue &GV) {
+  return GV.hasAppendingLinkage();
+}
+
+// Calls InstFn and GlobalFn with every instruction and global that refers to
+// V, looking through constant expressions and aggregates.
+static void forEachUser(const Value *V,
+                        function_ref<void(const Instruction *)> InstFn,
+                        function_ref<void(const GlobalValue *)> GlobalFn) {
+  SmallVector<const Value *, 8> Worklist(1, V);
+  SmallPtrSet<const Value *, 8> Seen;
+  while (!Worklist.empty()) {
+    const Value *Cur = Worklist.pop_back_val();
+    for (const User *U : Cur->users()) {
+      if (const Instruction *I = dyn_cast<Instruction>(U)) {
+        InstFn(I);
+      } else if (const GlobalValue *GV = dyn_cast<GlobalValue>(U)) {
+        GlobalFn(GV);
+      } else if (isa<Constant>(U) && Seen.insert(U).second) {
+        Worklist.push_back(U);
+      }
+    }
+  }
+}
+
+// Globals a constant refers to, in operand order.
+static void collectGlobals(const Constant *C,
+                           SmallVectorImpl<const GlobalValue *> &Globals) {
+  SmallVector<const Constant *, 8> Worklist(1, C);
+  SmallPtrSet<const Constant *, 8> Seen;
+  while (!Worklist.empty()) {
+    const Constant *Cur = Worklist.pop_back_val();
+    if (const GlobalValue *GV = dyn_cast<GlobalValue>(Cur)) {
+      Globals.push_back(GV);
+      continue;
+    }
+    // Reverse so that the operands come out of the stack in order.
+    for (const Use &Op : reverse(Cur->operands())) {
+      const Constant *OpC = dyn_cast<Constant>(Op.get());
+      if (OpC && Seen.insert(OpC).second) {
+        Worklist.push_back(OpC);
+      }
+    }
+  }
+}
+
+static void collectBlockAddresses(const Constant *C,
+                                  SmallVectorImpl<const Function *> &Targets) {
+  SmallVector<const Constant *, 8> Worklist(1, C);
+  SmallPtrSet<const Constant *, 8> Seen;
+  while (!Worklist.empty()) {
+    const Constant *Cur = Worklist.pop_back_val();
+    if (const BlockAddress *BA = dyn_cast<BlockAddress>(Cur)) {
+      Targets.push_back(BA->getFunction());
+      continue;
+    }
+    if (isa<GlobalValue>(Cur)) {
+      continue;
+    }
+    for (const Use &Op : Cur->operands()) {
+      const Constant *OpC = dyn_cast<Constant>(Op.get());
+      if (OpC && Seen.insert(OpC).second) {
+        Worklist.push_back(OpC);
+      }
+    }
+  }
+}
+
+// Name of the globals that had none, until the partitions are linked.
+static const char UnnamedPrefix[] = "__irvana_shard_unnamed";
+
+// A local constant that only code refers to can be copied into every
+// partition: the copies are not shared, and cse encrypts each of them. Its
+// address must not matter, each partition compares its own copy.
+static bool isCopyable(const GlobalVariable &GV) {
+  if (GV.isDeclaration() || !GV.hasLocalLinkage() || !GV.isConstant() ||
+      !GV.hasAtLeastLocalUnnamedAddr() || GV.hasComdat()) {
+    return false;
+  }
+  bool Copyable = true;
+  forEachUser(
+      &GV, [](const Instruction *) {},
+      [&](const GlobalValue *User) { Copyable &= isAppending(*User); });
+  return Copyable;
+}
+
+ModuleSharding::ModuleSharding(Module &M, unsigned N) : M(M) {
+  for (GlobalValue &GV : M.global_values()) {
+    if (!GV.hasName()) {
+      GV.setName(UnnamedPrefix);
+    }
+  }
+
+  // Definitions that have to stay in one partition.
+  EquivalenceClasses<const GlobalValue *> Clusters;
+  DenseMap<const Comdat *, const GlobalValue *> ComdatLeaders;
+  SmallPtrSet<const GlobalVariable *, 16> Copyable;
+  for (GlobalValue &GV : M.global_values()) {
+    if (GV.isDeclaration() || isAppending(GV)) {
+      continue;
+    }
+    GlobalVariable *Var = dyn_cast<GlobalVariable>(&GV);
+    if (Var && isCopyable(*Var)) {
+      Copyable.insert(Var);
+      continue;
+    }
+    Clusters.insert(&GV);
+    if (const Comdat *C = GV.getComdat()) {
+      auto It = ComdatLeaders.try_emplace(C, &GV).first;
+      Clusters.unionSets(It->second, &GV);
+    }
+    if (GlobalAlias *GA = dyn_cast<GlobalAlias>(&GV)) {
+      if (const GlobalObject *Aliasee = GA->getAliaseeObject()) {
+        Clusters.unionSets(&GV, Aliasee);
+      }
+    }
+    // Block addresses only resolve within the module of their function.
+    SmallVector<const Function *, 2> Targets;
+    if (Var && Var->hasInitializer()) {
+      collectBlockAddresses(Var->getInitializer(), Targets);
+    } else if (Function *F = dyn_cast<Function>(&GV)) {
+      for (Instruction &I : instructions(*F)) {
+        for (Value *Op : I.operands()) {
+          if (BlockAddress *BA = dyn_cast<BlockAddress>(Op)) {
+            Targets.push_back(BA->getFunction());
+          }
+        }
+      }
+    }
+    for (const Function *Target : Targets) {
+      Clusters.unionSets(&GV, Target);
+    }
+  }
+
+  // Balance the clusters of functions by instruction count, largest first.
+  MapVector<const GlobalValue *, uint64_t> Weights;
+  for (Function &F : M) {
+    if (F.isDeclaration()) {
+      continue;
+    }
+    uint64_t Size = 1;
+    for (BasicBlock &BB : F) {
+      Size += BB.size();
+    }
+    Weights[Clusters.getLeaderValue(&F)] += Size;
+  }
+  std::vector<std::pair<const GlobalValue *, uint64_t>> Order(
+      Weights.begin(), Weights.end());
+  std::stable_sort(Order.begin(), Order.end(),
+                   [](const std::pair<const GlobalValue *, uint64_t> &A,
+                      const std::pair<const GlobalValue *, uint64_t> &B) {
+                     return A.second > B.second;
+                   });
+  Loads.assign(std::max<size_t>(1, std::min<size_t>(N, Order.size())), 0);
+  DenseMap<const GlobalValue *, unsigned> LeaderHome;
+  for (const auto &Cluster : Order) {
+    unsigned Lightest =
+        std::min_element(Loads.begin(), Loads.end()) - Loads.begin();
+    Loads[Lightest] += Cluster.second;
+    LeaderHome[Cluster.first] = Lightest;
+  }
+
+  // Clusters without a function go with the first function that uses them.
+  for (GlobalValue &GV : M.global_values()) {
+    if (Clusters.findValue(&GV) == Clusters.end()) {
+      continue;
+    }
+    const GlobalValue *Leader = Clusters.getLeaderValue(&GV);
+    auto It = LeaderHome.find(Leader);
+    if (It == LeaderHome.end()) {
+      unsigned Part = 0;
+      bool Found = false;
+      for (auto MI = Clusters.member_begin(Clusters.findValue(Leader));
+           MI != Clusters.member_end() && !Found; ++MI) {
+        forEachUser(
+            *MI,
+            [&](const Instruction *I) {
+              if (!Found) {
+                Part = LeaderHome.lookup(
+                    Clusters.getLeaderValue(I->getFunction()));
+                Found = true;
+              }
+            },
+            [](const GlobalValue *) {});
+      }
+      It = LeaderHome.try_emplace(Leader, Part).first;
+    }
+    Home[&GV] = It->second;
+  }
+
+  auto CodeRefs = [&](const GlobalValue *GV) {
+    SmallBitVector Parts(size());
+    forEachUser(
+        GV, [&](const Instruction *I) { Parts.set(Home.lookup(I->getFunction())); },
+        [](const GlobalValue *) {});
+    return Parts;
+  };
+
+  // Each element of an appending array goes with the first definition it
+  // refers to: the annotated function, the constructor, the used global.
+  for (GlobalVariable &GV : M.globals()) {
+    if (!isAppending(GV) || !GV.hasInitializer()) {
+      continue;
+    }
+    const ConstantArray *CA = dyn_cast<ConstantArray>(GV.getInitializer());
+    if (!CA) {
+      continue;
+    }
+    std::vector<SmallBitVector> &Parts = Elements[&GV];
+    for (const Use &Op : CA->operands()) {
+      SmallVector<const GlobalValue *, 4> Referenced;
+      collectGlobals(cast<Constant>(Op.get()), Referenced);
+      auto Owner = find_if(Referenced, [](const GlobalValue *Ref) {
+        return !Ref->isDeclaration();
+      });
+      SmallBitVector ElementParts(size());
+      if (Owner == Referenced.end()) {
+        ElementParts.set(0);
+      } else if (Home.count(*Owner)) {
+        ElementParts.set(Home.lookup(*Owner));
+      } else {
+        ElementParts = CodeRefs(*Owner);
+        if (ElementParts.none()) {
+          ElementParts.set(0);
+        }
+      }
+      for (const GlobalValue *Ref : Referenced) {
+        SmallBitVector &Refs = ElementRefs[Ref];
+        Refs.resize(size());
+        Refs |= ElementParts;
+      }
+      Parts.push_back(ElementParts);
+    }
+  }
+
+  for (const GlobalVariable *GV : Copyable) {
+    SmallBitVector Parts = CodeRefs(GV);
+    auto It = ElementRefs.find(GV);
+    if (It != ElementRefs.end()) {
+      Parts |= It->second;
+    }
+    if (Parts.none()) {
+      Parts.set(0);
+    }
+    Copies[GV] = Parts;
+  }
+
+  // Locals referenced from another partition become external hidden.
+  for (GlobalValue &GV : M.global_values()) {
+    if (!GV.hasLocalLinkage() || !Home.count(&GV)) {
+      continue;
+    }
+    SmallBitVector Parts = referencedIn(&GV);
+    Parts.reset(Home.lookup(&GV));
+    if (Parts.none()) {
+      continue;
+    }
+    Promoted.emplace_back(GV.getName().str(), GV.getLinkage());
+    GV.setLinkage(GlobalValue::ExternalLinkage);
+    GV.setVisibility(GlobalValue::HiddenVisibility);
+  }
+}
+
+SmallBitVector ModuleSharding::referencedIn(const GlobalValue *GV) const {
+  SmallBitVector Parts(size());
+  forEachUser(
+      GV, [&](const Instruction *I) { Parts.set(Home.lookup(I->getFunction())); },
+      [&](const GlobalValue *User) {
+        auto It = Copies.find(User);
+        if (It != Copies.end()) {
+          Parts |= It->second;
+        } else if (Home.count(User)) {
+          Parts.set(Home.lookup(User));
+        }
+      });
+  auto It = ElementRefs.find(GV);
+  if (It != ElementRefs.end()) {
+    Parts |= It->second;
+  }
+  return Parts;
+}
+
+bool ModuleSharding::isDefinedIn(const GlobalValue *GV, unsigned I) const {
+  if (isAppending(*GV)) {
+    // Arrays that are not split are kept whole in the first partition.
+    return Elements.count(cast<GlobalVariable>(GV)) || I == 0;
+  }
+  auto It = Copies.find(GV);
+  if (It != Copies.end()) {
+    return It->second.test(I);
+  }
+  auto HI = Home.find(GV);
+  return HI != Home.end() && HI->second == I;
+}
+
+std::unique_ptr<Module> ModuleSharding::extract(unsigned I) const {
+  ValueToValueMapTy VMap;
+  std::unique_ptr<Module> Part =
+      CloneModule(M, VMap, [&](const GlobalValue *GV) {
+        return isDefinedIn(GV, I);
+      });
+  if (I != 0) {
+    Part->setModuleInlineAsm("");
+  }
+
+  for (GlobalVariable &GV : M.globals()) {
+    auto It = Elements.find(&GV);
+    if (It == Elements.end()) {
+      continue;
+    }
+    GlobalVariable *PartGV = cast<GlobalVariable>(VMap[&GV]);
+    const ConstantArray *CA = cast<ConstantArray>(PartGV->getInitializer());
+    SmallVector<Constant *, 16> Kept;
+    for (unsigned E = 0, End = CA->getNumOperands(); E != End; ++E) {
+      if (It->second[E].test(I)) {
+        Kept.push_back(CA->getOperand(E));
+      }
+    }
+    if (Kept.size() == CA->getNumOperands()) {
+      continue;
+    }
+    if (!Kept.empty()) {
+      ArrayType *Ty = ArrayType::get(CA->getType()->getElementType(),
+                                     Kept.size());
+      GlobalVariable *NewGV = new GlobalVariable(
+          *Part, Ty, PartGV->isConstant(), PartGV->getLinkage(),
+          ConstantArray::get(Ty, Kept), "", PartGV,
+          PartGV->getThreadLocalMode());
+      NewGV->setSection(PartGV->getSection());
+      NewGV->takeName(PartGV);
+    }
+    PartGV->eraseFromParent();
+  }
+
+  // Declarations of what the other partitions define and this one never
+  // refers to.
+  for (Function &F : make_early_inc_range(*Part)) {
+    F.removeDeadConstantUsers();
+    if (F.isDeclaration() && F.use_empty()) {
+      F.eraseFromParent();
+    }
+  }
+  for (GlobalVariable &GV : make_early_inc_range(Part->globals())) {
+    GV.removeDeadConstantUsers();
+    if (GV.isDeclaration() && GV.use_empty()) {
+      GV.eraseFromParent();
+    }
+  }
+  return Part;
+}
+
+void ModuleSharding::restore(Module &Linked, const PromotedList &Promoted) {
+  for (const auto &Entry : Promoted) {
+    GlobalValue *GV = Linked.getNamedValue(Entry.first);
+    if (GV && !GV->isDeclaration()) {
+      GV->setLinkage(Entry.second);
+    }
+  }
+  // The linker renamed the local copies apart, so match the prefix.
+  for (GlobalValue &GV : Linked.global_values()) {
+    if (GV.hasLocalLinkage() && GV.getName().starts_with(UnnamedPrefix)) {
+      GV.setName("");
+    }
+  }
+}
@@ -0,0 +1,68 @@
+#ifndef IRVANA_OBF_MODULESHARDING_H
+#define IRVANA_OBF_MODULESHARDING_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallBitVector.h"
+#include "llvm/IR/GlobalValue.h"
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+
+class GlobalVariable;
+class Module;
+
+// Splits a module into partitions that are obfuscated separately and linked
+// back together:
+//  - every function is defined in exactly one partition; functions that
+//    must stay together (comdats, aliases, block addresses) share one, and
+//    the partitions are balanced by instruction count,
+//  - a global variable is defined in the partition of its first user,
+//    except unnamed_addr local constants used only by code (string
+//    literals), which are copied into every partition that uses them so
+//    that cse still encrypts them,
+//  - the entries of llvm.global.annotations, llvm.used, llvm.global_ctors
+//    and the other appending arrays follow the global they describe,
+//  - locals referenced from another partition are made external hidden;
+//    restore() makes them local again once the partitions are linked, and
+//    unnamed again if they had no name.
+class ModuleSharding {
+public:
+  typedef std::vector<std::pair<std::string, GlobalValue::LinkageTypes>>
+      PromotedList;
+
+  // Assigns the globals of M to at most N partitions. M is modified: unnamed
+  // globals are named and locals referenced across partitions are promoted.
+  ModuleSharding(Module &M, unsigned N);
+
+  unsigned size() const { return Loads.size(); }
+  // Instructions defined in partition I.
+  uint64_t load(unsigned I) const { return Loads[I]; }
+  // Returns a copy of M with the definitions of partition I only.
+  std::unique_ptr<Module> extract(unsigned I) const;
+
+  const PromotedList &promoted() const { return Promoted; }
+  static void restore(Module &Linked, const PromotedList &Promoted);
+
+private:
+  bool isDefinedIn(const GlobalValue *GV, unsigned I) const;
+  SmallBitVector referencedIn(const GlobalValue *GV) const;
+
+  Module &M;
+  std::vector<uint64_t> Loads;
+  // Partition of every definition that is not copied.
+  DenseMap<const GlobalValue *, unsigned> Home;
+  // Partitions holding a copy of a local constant.
+  DenseMap<const GlobalValue *, SmallBitVector> Copies;
+  // Partitions of each element of the appending arrays.
+  DenseMap<const GlobalVariable *, std::vector<SmallBitVector>> Elements;
+  // Partitions that reference a global through an appending array element.
+  DenseMap<const GlobalValue *, SmallBitVector> ElementRefs;
+  PromotedList Promoted;
+};
+
+}
+
+#endif
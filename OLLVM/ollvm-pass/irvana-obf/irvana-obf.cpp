@@ -0,0 +1,383 @@
+//===- irvana-obf.cpp - Batch IR obfuscation driver -----------------------===//
+//
+// Obfuscates many IR files in one process, with the passes and -irobf-*
+// options of the plugin:
+//
+//   irvana-obf -irobf-cff -irobf-cse -j 8 -o ir_bin ir_bin/a.ll ir_bin/b.ll
+//
+// writes ir_bin/a-obf.ll and ir_bin/b-obf.ll. Each file gets its own
+// LLVMContext and runs on a thread pool, which saves starting opt, loading
+// the plugin and reading goron.yaml once per file.
+//
+// Bitcode inputs are loaded lazily. When the configuration selects no
+// function of a module (Filter, Include, Exclude, annotations), its function
+// bodies are never read and the input is copied to the output as is. A
+// module with any selected function is read entirely, since the module passes
+// (string encryption, icall, indgv) rewrite globals shared with the other
+// functions.
+//
+// With -shards=K, each input is split into K function-disjoint partitions
+// instead (see ModuleSharding.h). Every partition is obfuscated by its own
+// irvana-obf process, optionally under a memory limit, and the results are
+// linked back and merged (irobf-merge) into the output:
+//
+//   irvana-obf -irobf-cff -irobf-cse -shards=8 -shard-memory=2048 final.ll
+//
+//===----------------------------------------------------------------------===//
+
+#include "ModuleSharding.h"
+#include "include/LinkConsolidation.h"
+#include "include/ObfuscationPassManager.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+#include <atomic>
+#include <mutex>
+#include <optional>
+
+using namespace llvm;
+
+static cl::list<std::string> InputFilenames(cl::Positional, cl::OneOrMore,
+                                            cl::desc("<input .ll/.bc files>"));
+
+static cl::opt<std::string>
+    OutputDirectory("o", cl::desc("Output directory (default: next to each input)"),
+                    cl::value_desc("directory"));
+
+static cl::opt<std::string>
+    OutputSuffix("suffix", cl::init("-obf"),
+                 cl::desc("Appended to the input name to name the output"));
+
+static cl::opt<unsigned>
+    Jobs("j", cl::init(0),
+         cl::desc("Number of files obfuscated at once (default: all cores)"));
+
+enum class OutputFormat { Input, Text, Bitcode };
+static cl::opt<OutputFormat> Format(
+    "format", cl::init(OutputFormat::Input),
+    cl::desc("Output format"),
+    cl::values(clEnumValN(OutputFormat::Input, "input", "Same as the input"),
+               clEnumValN(OutputFormat::Text, "ll", "Textual IR"),
+               clEnumValN(OutputFormat::Bitcode, "bc", "Bitcode")));
+
+static cl::opt<unsigned>
+    Shards("shards", cl::init(1),
+           cl::desc("Split each input into this many partitions, obfuscated "
+                    "by separate processes (-j at once) and linked back"));
+
+static cl::opt<unsigned>
+    ShardMemory("shard-memory", cl::init(0), cl::value_desc("MB"),
+                cl::desc("Memory limit of each partition process "
+                         "(default: none)"));
+
+static cl::opt<bool>
+    ShardStats("shard-stats",
+               cl::desc("Print the size, time and peak memory of each "
+                        "partition"));
+
+// Given to the partition processes, which ignore the other inputs.
+static cl::opt<std::string> ShardInput("shard-input", cl::Hidden);
+static cl::opt<std::string> ShardOutput("shard-output", cl::Hidden);
+
+static std::mutex DiagLock;
+
+static bool fail(StringRef Input, const Twine &Message) {
+  std::lock_guard<std::mutex> Lock(DiagLock);
+  errs() << "irvana-obf: " << Input << ": " << Message << "\n";
+  return false;
+}
+
+static bool parseFailed(const SMDiagnostic &Err) {
+  std::string Message;
+  raw_string_ostream OS(Message);
+  Err.print("irvana-obf", OS);
+  std::lock_guard<std::mutex> Lock(DiagLock);
+  errs() << OS.str();
+  return false;
+}
+
+static bool isBitcodeBuffer(const MemoryBuffer &Buf) {
+  return isBitcode(
+      reinterpret_cast<const unsigned char *>(Buf.getBufferStart()),
+      reinterpret_cast<const unsigned char *>(Buf.getBufferEnd()));
+}
+
+static SmallString<128> outputPath(StringRef Input, bool Bitcode) {
+  SmallString<128> Output(OutputDirectory.empty()
+                              ? sys::path::parent_path(Input)
+                              : StringRef(OutputDirectory));
+  sys::path::append(Output, Twine(sys::path::stem(Input)) + OutputSuffix +
+                                (Bitcode ? ".bc" : ".ll"));
+  return Output;
+}
+
+static bool writeModule(Module &M, StringRef Output, bool Bitcode) {
+  std::error_code EC;
+  ToolOutputFile Out(Output, EC,
+                     Bitcode ? sys::fs::OF_None : sys::fs::OF_TextWithCRLF);
+  if (EC) {
+    return fail(Output, EC.message());
+  }
+  if (Bitcode) {
+    WriteBitcodeToFile(M, Out.os());
+  } else {
+    M.print(Out.os(), nullptr);
+  }
+  Out.keep();
+  return true;
+}
+
+// Obfuscates Input into PartOutput as bitcode if given, else next to it or
+// into -o.
+static bool obfuscateFile(StringRef Input, StringRef PartOutput = "") {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> BufOrErr =
+      MemoryBuffer::getFile(Input);
+  if (!BufOrErr) {
+    return fail(Input, BufOrErr.getError().message());
+  }
+  bool InputIsBitcode = isBitcodeBuffer(**BufOrErr);
+  bool Bitcode = !PartOutput.empty() || Format == OutputFormat::Bitcode ||
+                 (Format == OutputFormat::Input && InputIsBitcode);
+  SmallString<128> Output(PartOutput);
+  if (Output.empty()) {
+    Output = outputPath(Input, Bitcode);
+  }
+
+  LLVMContext Ctx;
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M =
+      getLazyIRModule(std::move(*BufOrErr), Err, Ctx);
+  if (!M) {
+    return parseFailed(Err);
+  }
+
+  bool Obfuscate = hasObfuscationWork(*M);
+  if (!Obfuscate && Bitcode == InputIsBitcode) {
+    if (Output == Input) {
+      return true;
+    }
+    if (std::error_code EC = sys::fs::copy_file(Input, Output)) {
+      return fail(Output, EC.message());
+    }
+    return true;
+  }
+
+  if (Error E = M->materializeAll()) {
+    return fail(Input, toString(std::move(E)));
+  }
+  if (Obfuscate) {
+    ModuleAnalysisManager MAM;
+    ObfuscationPassManagerPass().run(*M, MAM);
+    std::string Message;
+    raw_string_ostream OS(Message);
+    if (verifyModule(*M, &OS)) {
+      return fail(Input, "obfuscated module is broken:\n" + OS.str());
+    }
+  }
+  return writeModule(*M, Output, Bitcode);
+}
+
+// Writes the partitions of Input to Dir. Runs in its own context so that
+// the module is freed before the partitions are obfuscated.
+static bool splitFile(StringRef Input, StringRef Dir, bool &InputIsBitcode,
+                      std::vector<std::string> &Parts,
+                      std::vector<uint64_t> &Loads,
+                      ModuleSharding::PromotedList &Promoted) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> BufOrErr =
+      MemoryBuffer::getFile(Input);
+  if (!BufOrErr) {
+    return fail(Input, BufOrErr.getError().message());
+  }
+  InputIsBitcode = isBitcodeBuffer(**BufOrErr);
+
+  LLVMContext Ctx;
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseIR(**BufOrErr, Err, Ctx);
+  if (!M) {
+    return parseFailed(Err);
+  }
+  BufOrErr->reset();
+
+  ModuleSharding Sharding(*M, Shards);
+  for (unsigned I = 0; I != Sharding.size(); ++I) {
+    SmallString<128> Path(Dir);
+    sys::path::append(Path, "part" + Twine(I) + ".bc");
+    if (!writeModule(*Sharding.extract(I), Path, true)) {
+      return false;
+    }
+    Parts.push_back(std::string(Path));
+    Loads.push_back(Sharding.load(I));
+  }
+  Promoted = Sharding.promoted();
+  return true;
+}
+
+// Obfuscates each partition in a separate process running Args plus the
+// partition's input and output.
+static bool obfuscateParts(StringRef Input, StringRef Self,
+                           ArrayRef<StringRef> Args,
+                           const std::vector<std::string> &Parts,
+                           const std::vector<uint64_t> &Loads,
+                           std::vector<std::string> &Outputs) {
+  std::vector<std::string> Errors(Parts.size());
+  std::vector<std::optional<sys::ProcessStatistics>> Stats(Parts.size());
+  for (const std::string &Part : Parts) {
+    SmallString<128> Output(Part);
+    sys::path::replace_extension(Output, "obf.bc");
+    Outputs.push_back(std::string(Output));
+  }
+
+  ThreadPool Pool(hardware_concurrency(Jobs));
+  for (unsigned I = 0; I != Parts.size(); ++I) {
+    Pool.async([&, I] {
+      std::string InputArg = "-shard-input=" + Parts[I];
+      std::string OutputArg = "-shard-output=" + Outputs[I];
+      SmallVector<StringRef, 16> PartArgs(Args.begin(), Args.end());
+      PartArgs.push_back(InputArg);
+      PartArgs.push_back(OutputArg);
+      std::string ErrMsg;
+      int Result = sys::ExecuteAndWait(Self, PartArgs, std::nullopt, {}, 0,
+                                       ShardMemory, &ErrMsg, nullptr,
+                                       &Stats[I]);
+      if (Result != 0) {
+        Errors[I] = ErrMsg.empty() ? "exited with " + std::to_string(Result)
+                                   : ErrMsg;
+      }
+    });
+  }
+  Pool.wait();
+
+  bool Failed = false;
+  for (unsigned I = 0; I != Parts.size(); ++I) {
+    if (ShardStats && Stats[I]) {
+      std::lock_guard<std::mutex> Lock(DiagLock);
+      errs() << format("irvana-obf: %s: partition %u: %llu instructions, "
+                       "%.2f s, %llu MB peak\n",
+                       Input.str().c_str(), I,
+                       (unsigned long long)Loads[I],
+                       Stats[I]->TotalTime.count() / 1e6,
+                       (unsigned long long)Stats[I]->PeakMemory / 1024);
+    }
+    if (!Errors[I].empty()) {
+      Failed = true;
+      fail(Input, "partition " + Twine(I) + " failed: " + Errors[I]);
+    }
+  }
+  return !Failed;
+}
+
+static bool linkParts(StringRef Input, const std::vector<std::string> &Parts,
+                      const ModuleSharding::PromotedList &Promoted,
+                      StringRef Output, bool Bitcode) {
+  LLVMContext Ctx;
+  std::unique_ptr<Module> Linked;
+  for (const std::string &Part : Parts) {
+    SMDiagnostic Err;
+    std::unique_ptr<Module> M = parseIRFile(Part, Err, Ctx);
+    if (!M) {
+      return parseFailed(Err);
+    }
+    if (!Linked) {
+      Linked = std::move(M);
+    } else if (Linker::linkModules(*Linked, std::move(M))) {
+      return fail(Part, "cannot link the partition");
+    }
+  }
+  ModuleSharding::restore(*Linked, Promoted);
+  // Fold the string and indirection tables of the partitions.
+  std::unique_ptr<ModulePass> Merge(createLinkConsolidationPass());
+  Merge->runOnModule(*Linked);
+
+  std::string Message;
+  raw_string_ostream OS(Message);
+  if (verifyModule(*Linked, &OS)) {
+    return fail(Input, "linked partitions are broken:\n" + OS.str());
+  }
+  Linked->setModuleIdentifier(Input);
+  return writeModule(*Linked, Output, Bitcode);
+}
+
+static bool shardFile(StringRef Input, StringRef Self,
+                      ArrayRef<StringRef> Args) {
+  SmallString<128> Dir;
+  sys::path::system_temp_directory(true, Dir);
+  sys::path::append(Dir, "irvana-obf");
+  if (std::error_code EC = sys::fs::createUniqueDirectory(Dir, Dir)) {
+    return fail(Dir, EC.message());
+  }
+
+  bool InputIsBitcode = false;
+  std::vector<std::string> Parts, Outputs;
+  std::vector<uint64_t> Loads;
+  ModuleSharding::PromotedList Promoted;
+  bool Done = splitFile(Input, Dir, InputIsBitcode, Parts, Loads, Promoted) &&
+              obfuscateParts(Input, Self, Args, Parts, Loads, Outputs);
+  if (Done) {
+    bool Bitcode = Format == OutputFormat::Bitcode ||
+                   (Format == OutputFormat::Input && InputIsBitcode);
+    Done = linkParts(Input, Outputs, Promoted, outputPath(Input, Bitcode),
+                     Bitcode);
+  }
+  sys::fs::remove_directories(Dir);
+  return Done;
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(
+      argc, argv,
+      "IRvana batch obfuscator\n\n"
+      "  Obfuscates every input with the -irobf-* options and goron.yaml,\n"
+      "  several files at once.\n");
+
+  if (!ShardInput.empty()) {
+    return obfuscateFile(ShardInput, ShardOutput) ? 0 : 1;
+  }
+
+  if (!OutputDirectory.empty()) {
+    if (std::error_code EC = sys::fs::create_directories(OutputDirectory)) {
+      fail(OutputDirectory, EC.message());
+      return 1;
+    }
+  }
+
+  if (Shards > 1) {
+    std::string Self =
+        sys::fs::getMainExecutable(argv[0], (void *)(intptr_t)&main);
+    SmallVector<StringRef, 16> Args(argv, argv + argc);
+    unsigned Failed = 0;
+    for (const std::string &Input : InputFilenames) {
+      Failed += !shardFile(Input, Self, Args);
+    }
+    return Failed ? 1 : 0;
+  }
+
+  std::atomic<unsigned> Failed(0);
+  ThreadPool Pool(hardware_concurrency(Jobs));
+  for (const std::string &Input : InputFilenames) {
+    Pool.async([&Failed, Input] {
+      if (!obfuscateFile(Input)) {
+        ++Failed;
+      }
+    });
+  }
+  Pool.wait();
+  return Failed ? 1 : 0;
+}
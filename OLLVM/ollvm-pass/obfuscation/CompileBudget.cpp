@@ -0,0 +1,171 @@
+#include "include/CompileBudget.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cmath>
+#include <mutex>
+
+#define DEBUG_TYPE "obf-budget"
+
+using namespace llvm;
+
+STATISTIC(NumSkipped, "Functions not obfuscated because of a compile-time limit");
+STATISTIC(NumPartitioned, "Functions flattened with more than one dispatcher");
+STATISTIC(NumIndirectBrSkipped, "Functions kept out of indbr because of their size");
+
+// Rough instructions added per original block: flattening stores the next
+// case, computes it and branches to the dispatcher, and the lowered switch
+// adds a compare and a branch per case; indbr replaces every branch with a
+// table load, the key arithmetic and an indirectbr.
+static const uint64_t FlattenCostPerBlock = 6;
+static const uint64_t IndirectBrCostPerBlock = 6;
+
+CompileBudget::CompileBudget(Module &M,
+                             const ObfuscationOptions::CompileLimits &Limits,
+                             bool Flatten, bool IndirectBr)
+    : Limits(Limits) {
+  for (Function &F : M) {
+    if (F.isDeclaration()) {
+      continue;
+    }
+    Decision &D = Decisions[&F];
+    Order.push_back(&F);
+    for (BasicBlock &BB : F) {
+      ++D.Blocks;
+      D.Instructions += BB.size();
+    }
+
+    if (Limits.MaxBlocks && D.Blocks > Limits.MaxBlocks) {
+      D.SkipAll = true;
+      D.Reason = std::to_string(D.Blocks) + " blocks > MaxBlocks " +
+                 std::to_string(Limits.MaxBlocks);
+      continue;
+    }
+    if (Limits.MaxInstructions && D.Instructions > Limits.MaxInstructions) {
+      D.SkipAll = true;
+      D.Reason = std::to_string(D.Instructions) +
+                 " instructions > MaxInstructions " +
+                 std::to_string(Limits.MaxInstructions);
+      continue;
+    }
+
+    if (Flatten && Limits.MaxFlattenBlocks &&
+        D.Blocks > Limits.MaxFlattenBlocks) {
+      D.Partition = Limits.MaxFlattenBlocks;
+      D.Reason = std::to_string(D.Blocks) + " blocks > MaxFlattenBlocks " +
+                 std::to_string(Limits.MaxFlattenBlocks);
+    }
+
+    uint64_t Base = D.Instructions;
+    if (Flatten) {
+      Base += FlattenCostPerBlock * D.Blocks;
+    }
+    D.Estimate = Base + (IndirectBr ? IndirectBrCostPerBlock * D.Blocks : 0);
+    if (!Limits.MaxEstimatedSize || D.Estimate <= Limits.MaxEstimatedSize) {
+      continue;
+    }
+    if (!D.Reason.empty()) {
+      D.Reason += ", ";
+    }
+    D.Reason += "estimated " + std::to_string(D.Estimate) +
+                " instructions > MaxEstimatedSize " +
+                std::to_string(Limits.MaxEstimatedSize);
+    if (IndirectBr && Base <= Limits.MaxEstimatedSize) {
+      D.SkipIndirectBr = true;
+    } else {
+      D.SkipAll = true;
+    }
+  }
+
+  for (const auto &It : Decisions) {
+    const Decision &D = It.second;
+    if (D.SkipAll) {
+      ++NumSkipped;
+    } else {
+      NumPartitioned += D.Partition != 0;
+      NumIndirectBrSkipped += D.SkipIndirectBr;
+    }
+    LLVM_DEBUG(if (D.isDowngraded()) dbgs()
+               << It.first->getName() << ": " << D.Reason << "\n");
+  }
+}
+
+bool CompileBudget::skip(const Function &F,
+                         ObfuscationOptions::ObfPass Pass) const {
+  auto It = Decisions.find(&F);
+  if (It == Decisions.end()) {
+    return false;
+  }
+  return It->second.SkipAll ||
+         (Pass == ObfuscationOptions::IndirectBr && It->second.SkipIndirectBr);
+}
+
+unsigned CompileBudget::flattenPartition(const Function &F) const {
+  auto It = Decisions.find(&F);
+  return It == Decisions.end() ? 0 : It->second.Partition;
+}
+
+void CompileBudget::charge(const Function &F, StringRef PassName,
+                           double Seconds) {
+  auto It = Decisions.find(&F);
+  if (It == Decisions.end() || It->second.SkipAll) {
+    return;
+  }
+  Decision &D = It->second;
+  D.Seconds += Seconds;
+  if (D.Seconds * 1000 <= Limits.TimeBudgetMs) {
+    return;
+  }
+  D.SkipAll = true;
+  D.StoppedAfter = PassName.str();
+  ++NumSkipped;
+  if (!D.Reason.empty()) {
+    D.Reason += ", ";
+  }
+  D.Reason += std::to_string(static_cast<uint64_t>(std::ceil(D.Seconds * 1000))) +
+              " ms > TimeBudgetMs " + std::to_string(Limits.TimeBudgetMs);
+}
+
+// Modules obfuscated one by one append to the same report, so each line
+// names its module.
+void CompileBudget::writeReport() const {
+  if (Limits.Report.empty() ||
+      none_of(Order, [&](const Function *F) {
+        return Decisions.lookup(F).isDowngraded();
+      })) {
+    return;
+  }
+  // irvana-obf writes the reports of several modules at once.
+  static std::mutex ReportLock;
+  std::lock_guard<std::mutex> Lock(ReportLock);
+  std::error_code EC;
+  raw_fd_ostream OS(Limits.Report, EC, sys::fs::OF_Append | sys::fs::OF_Text);
+  if (EC) {
+    errs() << "goron: cannot write report '" << Limits.Report
+           << "': " << EC.message() << "\n";
+    return;
+  }
+  for (const Function *F : Order) {
+    const Decision &D = Decisions.find(F)->second;
+    if (!D.isDowngraded()) {
+      continue;
+    }
+    OS << F->getParent()->getModuleIdentifier() << "\t" << F->getName()
+       << "\t";
+    if (!D.StoppedAfter.empty()) {
+      OS << "stopped after " << D.StoppedAfter;
+    } else if (D.SkipAll) {
+      OS << "skipped";
+    } else {
+      if (D.Partition) {
+        OS << "flattened in partitions of " << D.Partition << " blocks";
+      }
+      if (D.SkipIndirectBr) {
+        OS << (D.Partition ? ", " : "") << "indbr skipped";
+      }
+    }
+    OS << "\t" << D.Reason << "\n";
+  }
+}
@@ -753,7 +753,7 @@ void CryptoUtils::get_bytes(char *buffer, const int len) {
         // This will trigger a loop exit
         sofar = len;
       }
-    } while (sofar < (len - 1));
+    } while (sofar < len);
   }
 }
 
@@ -12,8 +12,10 @@
 //===----------------------------------------------------------------------===//
 
 #include "llvm/IR/Constants.h"
+#include "include/CompileBudget.h"
 #include "include/Flattening.h"
 #include "include/LegacyLowerSwitch.h"
+#include "include/ObfuscationOptions.h"
 #include "include/Utils.h"
 #include "include/CryptoUtils.h"
 #include "llvm/ADT/Statistic.h"
@@ -55,8 +57,12 @@ struct Flattening : public FunctionPass {
 bool Flattening::runOnFunction(Function &F) {
   Function *tmp = &F;
   bool result = false;
+  if (Options && Options->skipFunction(F, ObfuscationOptions::CFF)) {
+    return false;
+  }
+
   // Do we obfuscate
-  if (toObfuscate(flag, tmp, "fla")) {
+  if (toObfuscate(flag, tmp, "fla", Options ? Options->Annotations : nullptr)) {
     if (flatten(tmp)) {
       ++Flattened;
       result = true;
@@ -73,16 +79,22 @@ bool Flattening::flatten(Function *f) {
   LoadInst *load;
   SwitchInst *switchI;
   AllocaInst *switchVar;
+  unsigned Partition =
+      Options && Options->Budget ? Options->Budget->flattenPartition(*f) : 0;
 
   // SCRAMBLER
   char scrambling_key[16];
-  llvm::cryptoutils->get_bytes(scrambling_key, 16);
+  RandomEngine.get_bytes(scrambling_key, 16);
   // END OF SCRAMBLER
 
   // Lower switch
   FunctionPass *lower = createLegacyLowerSwitchPass();
   lower->runOnFunction(*f);
 
+  // Blocks that are not selected keep their direct branches; they still get
+  // a switch case so the selected blocks can dispatch to them.
+  BlockSelector Selector(*f, Options, ObfuscationOptions::CFF);
+
   // Save all original BB
   for (Function::iterator i = f->begin(); i != f->end(); ++i) {
     BasicBlock *tmp = &*i;
@@ -98,6 +110,10 @@ bool Flattening::flatten(Function *f) {
   if (origBB.size() <= 1) {
     return false;
   }
+  if (std::none_of(origBB.begin() + 1, origBB.end(),
+                   [&](BasicBlock *BB) { return Selector.select(BB); })) {
+    return false;
+  }
 
   LLVMContext &Ctx = f->getContext();
   IntegerType* intType = Type::getInt32Ty(Ctx);
@@ -136,78 +152,86 @@ bool Flattening::flatten(Function *f) {
   // Remove jump
   insert->getTerminator()->eraseFromParent();
 
+  auto caseValue = [&](unsigned Index) {
+    if (pointerSize == 8) {
+      return cast<ConstantInt>(ConstantInt::get(
+          intType, RandomEngine.scramble64(Index, scrambling_key)));
+    }
+    return cast<ConstantInt>(ConstantInt::get(
+        intType, RandomEngine.scramble32(Index, scrambling_key)));
+  };
+
   // Create switch variable and set as it
   switchVar =
       new AllocaInst(intType, 0, "switchVar", insert);
-  if (pointerSize == 8) {
-    new StoreInst(
-      ConstantInt::get(intType,
-        llvm::cryptoutils->scramble64(0, scrambling_key)),
-      switchVar, insert);
-  } else {
-    new StoreInst(
-      ConstantInt::get(intType,
-        llvm::cryptoutils->scramble32(0, scrambling_key)),
-      switchVar, insert);
+  switchVar->setMetadata(DispatchStateMDKind, MDNode::get(Ctx, {}));
+  new StoreInst(caseValue(0), switchVar, insert);
+
+  // Create main loop. Functions over the compile budget get one loop per
+  // Partition blocks: the loops share switchVar and a block jumps straight
+  // to the loop that dispatches its successor, so no switch is larger than
+  // Partition cases.
+  unsigned numLoops = 1;
+  if (Partition && origBB.size() > Partition) {
+    numLoops = (origBB.size() + Partition - 1) / Partition;
   }
+  vector<BasicBlock *> loopEnds;
+  vector<SwitchInst *> switches;
+  for (unsigned n = 0; n < numLoops; ++n) {
+    loopEntry = BasicBlock::Create(f->getContext(), "loopEntry", f);
+    loopEnd = BasicBlock::Create(f->getContext(), "loopEnd", f);
 
-  // Create main loop
-  loopEntry = BasicBlock::Create(f->getContext(), "loopEntry", f, insert);
-  loopEnd = BasicBlock::Create(f->getContext(), "loopEnd", f, insert);
+    load = new LoadInst(intType, switchVar, "switchVar", loopEntry);
 
-  load = new LoadInst(intType, switchVar, "switchVar", loopEntry);
+    // loopEnd jump to loopEntry
+    BranchInst::Create(loopEntry, loopEnd);
 
-  // Move first BB on top
-  insert->moveBefore(loopEntry);
-  BranchInst::Create(loopEntry, insert);
+    BasicBlock *swDefault =
+        BasicBlock::Create(f->getContext(), "switchDefault", f, loopEnd);
+    BranchInst::Create(loopEnd, swDefault);
 
-  // loopEnd jump to loopEntry
-  BranchInst::Create(loopEntry, loopEnd);
+    // Create switch instruction itself and set condition
+    switchI = SwitchInst::Create(load, swDefault, 0, loopEntry);
 
-  BasicBlock *swDefault =
-      BasicBlock::Create(f->getContext(), "switchDefault", f, loopEnd);
-  BranchInst::Create(loopEnd, swDefault);
-
-  // Create switch instruction itself and set condition
-  switchI = SwitchInst::Create(&*f->begin(), swDefault, 0, loopEntry);
-  switchI->setCondition(load);
-
-  // Remove branch jump from 1st BB and make a jump to the while
-  f->begin()->getTerminator()->eraseFromParent();
+    loopEnds.push_back(loopEnd);
+    switches.push_back(switchI);
+  }
 
-  BranchInst::Create(loopEntry, &*f->begin());
+  // Jump from 1st BB to the loop of case 0
+  BranchInst::Create(switches[0]->getParent(), insert);
 
-  // Put all BB in the switch
-  for (vector<BasicBlock *>::iterator b = origBB.begin(); b != origBB.end();
-       ++b) {
-    BasicBlock *i = *b;
-    ConstantInt *numCase = NULL;
+  // Put all BB in the switch of their loop
+  DenseMap<BasicBlock *, pair<ConstantInt *, unsigned>> cases;
+  for (unsigned n = 0; n < origBB.size(); ++n) {
+    BasicBlock *i = origBB[n];
+    unsigned loop = numLoops == 1 ? 0 : n / Partition;
 
     // Move the BB inside the switch (only visual, no code logic)
-    i->moveBefore(loopEnd);
+    i->moveBefore(loopEnds[loop]);
 
     // Add case to switch
-    if (pointerSize == 8) {
-      numCase = cast<ConstantInt>(ConstantInt::get(
-          switchI->getCondition()->getType(),
-          llvm::cryptoutils->scramble64(switchI->getNumCases(), scrambling_key)));
-    } else {
-      numCase = cast<ConstantInt>(ConstantInt::get(
-        switchI->getCondition()->getType(),
-        llvm::cryptoutils->scramble32(switchI->getNumCases(), scrambling_key)));
-    }
-    switchI->addCase(numCase, i);
+    ConstantInt *numCase = caseValue(n);
+    switches[loop]->addCase(numCase, i);
+    cases[i] = {numCase, loop};
   }
 
+  // Next case and loop of a successor; the default is the last case
+  auto findCase = [&](BasicBlock *succ) {
+    auto It = cases.find(succ);
+    if (It == cases.end()) {
+      return cases[origBB.back()];
+    }
+    return It->second;
+  };
+
   ConstantInt *Zero = ConstantInt::get(intType, 0);
   // Recalculate switchVar
   for (vector<BasicBlock *>::iterator b = origBB.begin(); b != origBB.end();
        ++b) {
     BasicBlock *i = *b;
-    ConstantInt *numCase = NULL;
 
     // Ret BB
-    if (i->getTerminator()->getNumSuccessors() == 0) {
+    if (i->getTerminator()->getNumSuccessors() == 0 || !Selector.select(i)) {
       continue;
     }
 
@@ -218,89 +242,52 @@ bool Flattening::flatten(Function *f) {
       i->getTerminator()->eraseFromParent();
 
       // Get next case
-      numCase = switchI->findCaseDest(succ);
-
-      // If next case == default case (switchDefault)
-      if (numCase == NULL) {
-        if (pointerSize == 8) {
-          numCase = cast<ConstantInt>(
-              ConstantInt::get(switchI->getCondition()->getType(),
-                               llvm::cryptoutils->scramble64(
-                                   switchI->getNumCases() - 1, scrambling_key)));
-        } else {
-          numCase = cast<ConstantInt>(
-            ConstantInt::get(switchI->getCondition()->getType(),
-              llvm::cryptoutils->scramble32(
-                switchI->getNumCases() - 1, scrambling_key)));
-        }
-      }
+      pair<ConstantInt *, unsigned> next = findCase(succ);
 
       // numCase = MySecret - (MySecret - numCase)
       // X = MySecret - numCase
-      Constant *X = ConstantExpr::getSub(Zero, numCase);
+      Constant *X = ConstantExpr::getSub(Zero, next.first);
       Value *newNumCase = BinaryOperator::Create(Instruction::Sub, MySecret, X, "", i);
 
       // Update switchVar and jump to the end of loop
-      new StoreInst(newNumCase, load->getPointerOperand(), i);
-      BranchInst::Create(loopEnd, i);
+      new StoreInst(newNumCase, switchVar, i);
+      BranchInst::Create(loopEnds[next.second], i);
       continue;
     }
 
     // If it's a conditional jump
     if (i->getTerminator()->getNumSuccessors() == 2) {
       // Get next cases
-      ConstantInt *numCaseTrue =
-          switchI->findCaseDest(i->getTerminator()->getSuccessor(0));
-      ConstantInt *numCaseFalse =
-          switchI->findCaseDest(i->getTerminator()->getSuccessor(1));
-
-      // Check if next case == default case (switchDefault)
-      if (numCaseTrue == NULL) {
-        if (pointerSize == 8) {
-          numCaseTrue = cast<ConstantInt>(
-              ConstantInt::get(switchI->getCondition()->getType(),
-                               llvm::cryptoutils->scramble64(
-                                   switchI->getNumCases() - 1, scrambling_key)));
-        } else {
-          numCaseTrue = cast<ConstantInt>(
-            ConstantInt::get(switchI->getCondition()->getType(),
-              llvm::cryptoutils->scramble32(
-                switchI->getNumCases() - 1, scrambling_key)));
-        }
-      }
-
-      if (numCaseFalse == NULL) {
-        if (pointerSize == 8) {
-          numCaseFalse = cast<ConstantInt>(
-              ConstantInt::get(switchI->getCondition()->getType(),
-                               llvm::cryptoutils->scramble64(
-                                   switchI->getNumCases() - 1, scrambling_key)));
-        } else {
-          numCaseFalse = cast<ConstantInt>(
-            ConstantInt::get(switchI->getCondition()->getType(),
-              llvm::cryptoutils->scramble32(
-                switchI->getNumCases() - 1, scrambling_key)));
-        }
-      }
+      pair<ConstantInt *, unsigned> nextTrue =
+          findCase(i->getTerminator()->getSuccessor(0));
+      pair<ConstantInt *, unsigned> nextFalse =
+          findCase(i->getTerminator()->getSuccessor(1));
 
       Constant *X, *Y;
-      X = ConstantExpr::getSub(Zero, numCaseTrue);
-      Y = ConstantExpr::getSub(Zero, numCaseFalse);
+      X = ConstantExpr::getSub(Zero, nextTrue.first);
+      Y = ConstantExpr::getSub(Zero, nextFalse.first);
       Value *newNumCaseTrue = BinaryOperator::Create(Instruction::Sub, MySecret, X, "", i->getTerminator());
       Value *newNumCaseFalse = BinaryOperator::Create(Instruction::Sub, MySecret, Y, "", i->getTerminator());
 
       // Create a SelectInst
       BranchInst *br = cast<BranchInst>(i->getTerminator());
+      Value *cond = br->getCondition();
       SelectInst *sel =
-          SelectInst::Create(br->getCondition(), newNumCaseTrue, newNumCaseFalse, "",
+          SelectInst::Create(cond, newNumCaseTrue, newNumCaseFalse, "",
                              i->getTerminator());
 
       // Erase terminator
       i->getTerminator()->eraseFromParent();
 
-      // Update switchVar and jump to the end of loop
-      new StoreInst(sel, load->getPointerOperand(), i);
-      BranchInst::Create(loopEnd, i);
+      // Update switchVar and jump to the end of loop, or of the loops of
+      // both successors
+      new StoreInst(sel, switchVar, i);
+      if (nextTrue.second == nextFalse.second) {
+        BranchInst::Create(loopEnds[nextTrue.second], i);
+      } else {
+        BranchInst::Create(loopEnds[nextTrue.second],
+                           loopEnds[nextFalse.second], cond, i);
+      }
       continue;
     }
   }
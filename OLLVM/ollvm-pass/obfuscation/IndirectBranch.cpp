@@ -37,10 +37,10 @@ struct IndirectBranch : public FunctionPass {
 
   StringRef getPassName() const override { return {"IndirectBranch"}; }
 
-  void NumberBasicBlock(Function &F) {
+  void NumberBasicBlock(Function &F, const BlockSelector &Selector) {
     for (auto &BB : F) {
       if (auto *BI = dyn_cast<BranchInst>(BB.getTerminator())) {
-        if (BI->isConditional()) {
+        if (BI->isConditional() && Selector.select(&BB)) {
           unsigned N = BI->getNumSuccessors();
           for (unsigned I = 0; I < N; I++) {
             BasicBlock *Succ = BI->getSuccessor(I);
@@ -82,17 +82,17 @@ struct IndirectBranch : public FunctionPass {
     Constant *CA = ConstantArray::get(ATy, ArrayRef<Constant *>(Elements));
     GV = new GlobalVariable(*F.getParent(), ATy, false, GlobalValue::LinkageTypes::PrivateLinkage,
                                                CA, GVName);
-    appendToCompilerUsed(*F.getParent(), {GV});
+    pinIndirectionTable(GV);
     return GV;
   }
 
 
   bool runOnFunction(Function &Fn) override {
-    if (!toObfuscate(flag, &Fn, "indbr")) {
+    if (!toObfuscate(flag, &Fn, "indbr", Options ? Options->Annotations : nullptr)) {
       return false;
     }
 
-    if (Options && Options->skipFunction(Fn.getName())) {
+    if (Options && Options->skipFunction(Fn, ObfuscationOptions::IndirectBr)) {
       return false;
     }
 
@@ -108,7 +108,8 @@ struct IndirectBranch : public FunctionPass {
 
     // llvm cannot split critical edge from IndirectBrInst
     SplitAllCriticalEdges(Fn, CriticalEdgeSplittingOptions(nullptr, nullptr));
-    NumberBasicBlock(Fn);
+    BlockSelector Selector(Fn, Options, ObfuscationOptions::IndirectBr);
+    NumberBasicBlock(Fn, Selector);
 
     if (BBNumbering.empty()) {
       return false;
@@ -129,7 +130,7 @@ struct IndirectBranch : public FunctionPass {
 
     for (auto &BB : Fn) {
       auto *BI = dyn_cast<BranchInst>(BB.getTerminator());
-      if (BI && BI->isConditional()) {
+      if (BI && BI->isConditional() && Selector.select(&BB)) {
         IRBuilder<> IRB(BI);
 
         Value *Cond = BI->getCondition();
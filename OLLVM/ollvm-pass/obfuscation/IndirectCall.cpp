@@ -79,17 +79,17 @@ struct IndirectCall : public FunctionPass {
     Constant *CA = ConstantArray::get(ATy, ArrayRef<Constant *>(Elements));
     GV = new GlobalVariable(*F.getParent(), ATy, false, GlobalValue::LinkageTypes::PrivateLinkage,
                                                CA, GVName);
-    appendToCompilerUsed(*F.getParent(), {GV});
+    pinIndirectionTable(GV);
     return GV;
   }
 
 
   bool runOnFunction(Function &Fn) override {
-    if (!toObfuscate(flag, &Fn, "icall")) {
+    if (!toObfuscate(flag, &Fn, "icall", Options ? Options->Annotations : nullptr)) {
       return false;
     }
 
-    if (Options && Options->skipFunction(Fn.getName())) {
+    if (Options && Options->skipFunction(Fn, ObfuscationOptions::IndirectCall)) {
       return false;
     }
 
@@ -1,6 +1,7 @@
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
 #include "include/IndirectGlobalVariable.h"
 #include "include/ObfuscationOptions.h"
 #include "include/Utils.h"
@@ -10,6 +11,11 @@
 #define DEBUG_TYPE "indgv"
 
 using namespace llvm;
+
+// Above this many globals in one function the O(N^2) !noalias lists cost
+// more than the alias information they carry.
+static const unsigned MaxAliasScopes = 64;
+
 namespace {
 struct IndirectGlobalVariable : public FunctionPass {
   unsigned pointerSize;
@@ -19,6 +25,7 @@ struct IndirectGlobalVariable : public FunctionPass {
   ObfuscationOptions *Options;
   std::map<GlobalVariable *, unsigned> GVNumbering;
   std::vector<GlobalVariable *> GlobalVariables;
+  std::vector<std::pair<Value *, GlobalVariable *>> DecodedPointers;
   CryptoUtils RandomEngine;
   IndirectGlobalVariable(unsigned pointerSize) : FunctionPass(ID) {
     this->pointerSize = pointerSize;
@@ -34,13 +41,24 @@ struct IndirectGlobalVariable : public FunctionPass {
 
   StringRef getPassName() const override { return {"IndirectGlobalVariable"}; }
 
-  void NumberGlobalVariable(Function &F) {
+  static bool isIndirectable(GlobalVariable *GV) {
+    return !GV->isThreadLocal() && !GV->isDLLImportDependent();
+  }
+
+  void NumberGlobalVariable(Function &F, const BlockSelector &Selector) {
     for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
       for (User::op_iterator op = (*I).op_begin(); op != (*I).op_end(); ++op) {
         Value *val = *op;
+        // A PHI operand is rewritten in its incoming block
+        const BasicBlock *UseBB = I->getParent();
+        if (PHINode *PHI = dyn_cast<PHINode>(&*I)) {
+          UseBB = PHI->getIncomingBlock(*op);
+        }
+        if (!Selector.select(UseBB)) {
+          continue;
+        }
         if (GlobalVariable *GV = dyn_cast<GlobalVariable>(val)) {
-          if (!GV->isThreadLocal() && GVNumbering.count(GV) == 0 &&
-              !GV->isDLLImportDependent()) {
+          if (GVNumbering.count(GV) == 0 && isIndirectable(GV)) {
             GVNumbering[GV] = GlobalVariables.size();
             GlobalVariables.push_back((GlobalVariable *) val);
           }
@@ -68,16 +86,144 @@ struct IndirectGlobalVariable : public FunctionPass {
     Constant *CA = ConstantArray::get(ATy, ArrayRef<Constant *>(Elements));
     GV = new GlobalVariable(*F.getParent(), ATy, false, GlobalValue::LinkageTypes::PrivateLinkage,
                             CA, GVName);
-    appendToCompilerUsed(*F.getParent(), {GV});
+    pinIndirectionTable(GV);
     return GV;
   }
 
+  // The decoded address is computed from an encrypted table entry, so it has
+  // no provenance AA can see. Restore what the original global reference
+  // told the optimizer: the table slot is never written and never undef, and
+  // the decoded pointer is the (nonnull, dereferenceable, aligned) global.
+  void annotateDecodedPointer(IRBuilder<> &IRB, LoadInst *EncGVAddr,
+                              Value *GVAddr, GlobalVariable *GV) {
+    LLVMContext &Ctx = GV->getContext();
+    const DataLayout &DL = GV->getParent()->getDataLayout();
+    Function *F = IRB.GetInsertBlock()->getParent();
+
+    EncGVAddr->setMetadata(LLVMContext::MD_noundef, MDNode::get(Ctx, {}));
+    EncGVAddr->setMetadata(LLVMContext::MD_invariant_load,
+                           MDNode::get(Ctx, {}));
+
+    if (GV->hasExternalWeakLinkage()) {
+      return;
+    }
+
+    IntegerType *Int64Ty = Type::getInt64Ty(Ctx);
+    SmallVector<OperandBundleDef, 4> Bundles;
+    Bundles.push_back(OperandBundleDef("noundef", std::vector<Value *>{GVAddr}));
+    if (!NullPointerIsDefined(F, GV->getAddressSpace())) {
+      Bundles.push_back(
+          OperandBundleDef("nonnull", std::vector<Value *>{GVAddr}));
+    }
+    if (GV->getValueType()->isSized()) {
+      uint64_t Size = DL.getTypeAllocSize(GV->getValueType()).getFixedValue();
+      if (Size != 0) {
+        Bundles.push_back(OperandBundleDef(
+            "dereferenceable",
+            std::vector<Value *>{GVAddr, ConstantInt::get(Int64Ty, Size)}));
+      }
+    }
+    Align A = GV->getPointerAlignment(DL);
+    if (A > 1) {
+      Bundles.push_back(OperandBundleDef(
+          "align",
+          std::vector<Value *>{GVAddr, ConstantInt::get(Int64Ty, A.value())}));
+    }
+    IRB.CreateAssumption(ConstantInt::getTrue(Ctx), Bundles);
+  }
+
+  // Distinct globals never alias, but AA can no longer prove it once both
+  // addresses come out of the table. Put every load/store based on a decoded
+  // pointer into a per-global scope that is noalias with all the others.
+  void addAliasScopes(Function &F) {
+    if (GlobalVariables.size() < 2 || GlobalVariables.size() > MaxAliasScopes) {
+      return;
+    }
+
+    MDBuilder MDB(F.getContext());
+    MDNode *Domain = MDB.createAnonymousAliasScopeDomain("IndGV");
+    SmallVector<Metadata *, 16> Scopes;
+    for (unsigned i = 0; i < GlobalVariables.size(); ++i) {
+      Scopes.push_back(MDB.createAnonymousAliasScope(Domain));
+    }
+
+    SmallVector<MDNode *, 16> ScopeLists, NoAliasLists;
+    for (unsigned i = 0; i < Scopes.size(); ++i) {
+      SmallVector<Metadata *, 16> Others;
+      for (unsigned j = 0; j < Scopes.size(); ++j) {
+        if (j != i)
+          Others.push_back(Scopes[j]);
+      }
+      ScopeLists.push_back(MDNode::get(F.getContext(), Scopes[i]));
+      NoAliasLists.push_back(MDNode::get(F.getContext(), Others));
+    }
+
+    // A PHI keeps the scope when all its incoming pointers are decoded from
+    // the same global.
+    std::map<Value *, GlobalVariable *> DecodedGV(DecodedPointers.begin(),
+                                                 DecodedPointers.end());
+    auto sameGlobalPHI = [&](PHINode *PHI, GlobalVariable *GV) {
+      for (Value *In : PHI->incoming_values()) {
+        auto It = DecodedGV.find(In);
+        if (It == DecodedGV.end())
+          It = DecodedGV.find(In->stripInBoundsConstantOffsets());
+        if (It == DecodedGV.end() || It->second != GV)
+          return false;
+      }
+      return true;
+    };
+
+    for (auto &Entry : DecodedPointers) {
+      unsigned N = GVNumbering[Entry.second];
+      SmallPtrSet<Value *, 16> Visited;
+      SmallVector<Value *, 16> WorkList;
+      WorkList.push_back(Entry.first);
+      while (!WorkList.empty()) {
+        Value *V = WorkList.pop_back_val();
+        if (!Visited.insert(V).second)
+          continue;
+        for (User *U : V->users()) {
+          Instruction *I = dyn_cast<Instruction>(U);
+          if (!I)
+            continue;
+          if (auto *GEP = dyn_cast<GetElementPtrInst>(I)) {
+            if (GEP->getPointerOperand() == V)
+              WorkList.push_back(GEP);
+            continue;
+          }
+          if (isa<BitCastInst>(I) || isa<AddrSpaceCastInst>(I)) {
+            WorkList.push_back(I);
+            continue;
+          }
+          if (auto *PHI = dyn_cast<PHINode>(I)) {
+            if (sameGlobalPHI(PHI, Entry.second))
+              WorkList.push_back(PHI);
+            continue;
+          }
+          bool IsAccess =
+              (isa<LoadInst>(I) && cast<LoadInst>(I)->getPointerOperand() == V) ||
+              (isa<StoreInst>(I) && cast<StoreInst>(I)->getPointerOperand() == V);
+          if (!IsAccess)
+            continue;
+          I->setMetadata(LLVMContext::MD_alias_scope,
+                         MDNode::concatenate(
+                             I->getMetadata(LLVMContext::MD_alias_scope),
+                             ScopeLists[N]));
+          I->setMetadata(LLVMContext::MD_noalias,
+                         MDNode::concatenate(
+                             I->getMetadata(LLVMContext::MD_noalias),
+                             NoAliasLists[N]));
+        }
+      }
+    }
+  }
+
   bool runOnFunction(Function &Fn) override {
-    if (!toObfuscate(flag, &Fn, "indgv")) {
+    if (!toObfuscate(flag, &Fn, "indgv", Options ? Options->Annotations : nullptr)) {
       return false;
     }
 
-    if (Options && Options->skipFunction(Fn.getName())) {
+    if (Options && Options->skipFunction(Fn, ObfuscationOptions::IndirectGV)) {
       return false;
     }
 
@@ -85,9 +231,11 @@ struct IndirectGlobalVariable : public FunctionPass {
 
     GVNumbering.clear();
     GlobalVariables.clear();
+    DecodedPointers.clear();
 
-    LowerConstantExpr(Fn);
-    NumberGlobalVariable(Fn);
+    LowerConstantExpr(Fn, isIndirectable);
+    BlockSelector Selector(Fn, Options, ObfuscationOptions::IndirectGV);
+    NumberGlobalVariable(Fn, Selector);
 
     if (GlobalVariables.empty()) {
       return false;
@@ -107,6 +255,25 @@ struct IndirectGlobalVariable : public FunctionPass {
     ConstantInt *Zero = ConstantInt::get(intType, 0);
     GlobalVariable *GVars = getIndirectGlobalVariables(Fn, EncKey1);
 
+    // Every use of a global in a block shares one decoded pointer (and one
+    // assume); PHI operands are decoded at the end of the incoming block.
+    std::map<std::pair<BasicBlock *, GlobalVariable *>, Value *> BlockDecoded,
+        ExitDecoded;
+    auto decode = [&](Instruction *IP, GlobalVariable *GV, const char *Name) {
+      IRBuilder<> IRB(IP);
+      Value *Idx = ConstantInt::get(intType, GVNumbering[GV]);
+      Value *GEP = IRB.CreateGEP(GVars->getValueType(), GVars, {Zero, Idx});
+      LoadInst *EncGVAddr = IRB.CreateLoad(GEP->getType(), GEP, GV->getName());
+
+      Value *Secret = IRB.CreateAdd(EncKey, MySecret);
+      Value *GVAddr = IRB.CreateGEP(Type::getInt8Ty(Ctx), EncGVAddr, Secret);
+      GVAddr = IRB.CreateBitCast(GVAddr, GV->getType());
+      GVAddr->setName(Name);
+      annotateDecodedPointer(IRB, EncGVAddr, GVAddr, GV);
+      DecodedPointers.push_back({GVAddr, GV});
+      return GVAddr;
+    };
+
     for (inst_iterator I = inst_begin(Fn), E = inst_end(Fn); I != E; ++I) {
       Instruction *Inst = &*I;
       if (isa<LandingPadInst>(Inst) || isa<CleanupPadInst>(Inst) ||
@@ -119,63 +286,38 @@ struct IndirectGlobalVariable : public FunctionPass {
         for (unsigned int i = 0; i < PHI->getNumIncomingValues(); ++i) {
           Value *val = PHI->getIncomingValue(i);
           if (GlobalVariable *GV = dyn_cast<GlobalVariable>(val)) {
-            if (GVNumbering.count(GV) == 0) {
+            if (GVNumbering.count(GV) == 0 ||
+                !Selector.select(PHI->getIncomingBlock(i))) {
               continue;
             }
 
-            Instruction *IP = PHI->getIncomingBlock(i)->getTerminator();
-            IRBuilder<> IRB(IP);
-
-            Value *Idx = ConstantInt::get(intType, GVNumbering[GV]);
-            Value *GEP = IRB.CreateGEP(
-                GVars->getValueType(),
-                GVars,
-                {Zero, Idx});
-            LoadInst *EncGVAddr = IRB.CreateLoad(
-                GEP->getType(), GEP,
-                GV->getName());
-
-            Value *Secret = IRB.CreateAdd(EncKey, MySecret);
-            Value *GVAddr = IRB.CreateGEP(
-              Type::getInt8Ty(Ctx),
-                EncGVAddr,
-                Secret);
-            GVAddr = IRB.CreateBitCast(GVAddr, GV->getType());
-            GVAddr->setName("IndGV0_");
+            BasicBlock *InBB = PHI->getIncomingBlock(i);
+            Value *&GVAddr = ExitDecoded[{InBB, GV}];
+            if (!GVAddr) {
+              GVAddr = decode(InBB->getTerminator(), GV, "IndGV0_");
+            }
             PHI->setIncomingValue(i, GVAddr);
           }
         }
-      } else {
+      } else if (Selector.select(Inst->getParent())) {
         for (User::op_iterator op = Inst->op_begin(); op != Inst->op_end(); ++op) {
           if (GlobalVariable *GV = dyn_cast<GlobalVariable>(*op)) {
             if (GVNumbering.count(GV) == 0) {
               continue;
             }
 
-            IRBuilder<> IRB(Inst);
-            Value *Idx = ConstantInt::get(intType, GVNumbering[GV]);
-            Value *GEP = IRB.CreateGEP(
-                GVars->getValueType(),
-                GVars,
-                {Zero, Idx});
-            LoadInst *EncGVAddr = IRB.CreateLoad(
-                GEP->getType(),
-                GEP,
-                GV->getName());
-
-            Value *Secret = IRB.CreateAdd(EncKey, MySecret);
-            Value *GVAddr = IRB.CreateGEP(
-              Type::getInt8Ty(Ctx),
-                EncGVAddr,
-                Secret);
-            GVAddr = IRB.CreateBitCast(GVAddr, GV->getType());
-            GVAddr->setName("IndGV1_");
+            Value *&GVAddr = BlockDecoded[{Inst->getParent(), GV}];
+            if (!GVAddr) {
+              GVAddr = decode(Inst, GV, "IndGV1_");
+            }
             Inst->replaceUsesOfWith(GV, GVAddr);
           }
         }
       }
     }
 
+    addAliasScopes(Fn);
+
       return true;
     }
 
@@ -0,0 +1,443 @@
+#include "include/LinkConsolidation.h"
+#include "include/Utils.h"
+#include "include/CryptoUtils.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Transforms/Utils/GlobalStatus.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#define DEBUG_TYPE "link-consolidation"
+
+using namespace llvm;
+
+STATISTIC(NumDecryptMerged, "Identical strings merged into one decrypt routine");
+STATISTIC(NumEncryptedShared, "Shared decrypt strings pointed at an identical copy");
+STATISTIC(NumStringTablesMerged, "Encrypted string tables merged");
+STATISTIC(NumBitmapsMerged, "Decrypt status bitmaps merged");
+STATISTIC(NumIndirectionTablesDropped, "Unreferenced indirection tables dropped");
+
+// Layout of EncryptedStringTable entries, see StringEncryption
+static const unsigned KeySize = 32;
+static const unsigned CacheLineSize = 64;
+
+//
+// Runs on the output of llvm-link over modules obfuscated one by one. Each
+// of them brought its own EncryptedStringTable, DecryptStatusBitmap and
+// decrypt routines, also for the strings every translation unit gets from
+// the same headers. This pass
+//  - drops the indirection tables of functions the linker discarded, which
+//    only llvm.compiler.used kept alive, and the decrypt routines only those
+//    functions called,
+//  - decrypts the strings listed in !goron.strings: identical strings end up
+//    with one goron_decrypt_string_N and one plain buffer, and in shared
+//    decrypt mode with one copy of the key and the encrypted bytes,
+//  - concatenates the string tables and the status bitmaps of all modules.
+// Per-string tables are moved as they are, since with IndirectGV their key
+// offsets live in instructions that only see the table base. Nothing is
+// re-encrypted.
+//
+namespace {
+struct LinkConsolidation : public ModulePass {
+  static char ID;
+
+  struct EncryptedString {
+    EncryptedString()
+        : Offset(0), Length(0), Align(1), ID(0), DecFunc(nullptr), DecPtr(nullptr),
+          Canonical(nullptr), NewOffset(0) {}
+    unsigned Offset; // of the key in the module's EncryptedStringTable
+    unsigned Length;
+    unsigned Align;
+    unsigned ID;
+    Function *DecFunc; // null in shared decrypt mode
+    Constant *DecPtr;
+    EncryptedString *Canonical; // per-string mode: the copy that is kept
+    unsigned NewOffset; // shared decrypt mode: of the key in the merged table
+  };
+
+  struct StringTable {
+    StringTable()
+        : GV(nullptr), Bitmap(nullptr), SharedDecFunc(nullptr), Descriptors(nullptr) {}
+    GlobalVariable *GV;
+    GlobalVariable *Bitmap;
+    Function *SharedDecFunc;
+    GlobalVariable *Descriptors;
+    std::vector<EncryptedString> Strings;
+  };
+
+  CryptoUtils RandomEngine;
+  std::vector<std::unique_ptr<StringTable>> Tables;
+  SetVector<GlobalVariable *> Bitmaps;
+
+  LinkConsolidation() : ModulePass(ID) {
+    initializeLinkConsolidationPass(*PassRegistry::getPassRegistry());
+  }
+
+  StringRef getPassName() const override { return {"LinkConsolidation"}; }
+
+  bool runOnModule(Module &M) override;
+  bool dropIndirectionTables(Module &M);
+  bool readStringTables(Module &M);
+  bool isMergeable(StringTable &T);
+  void mergeStrings(Module &M);
+  void mergeStatusBitmaps(Module &M);
+  void eraseIfUnused(GlobalValue *GV);
+};
+} // namespace
+
+char LinkConsolidation::ID = 0;
+bool LinkConsolidation::runOnModule(Module &M) {
+  bool Changed = dropIndirectionTables(M);
+  if (readStringTables(M)) {
+    mergeStrings(M);
+    mergeStatusBitmaps(M);
+    Changed = true;
+  }
+  Tables.clear();
+  Bitmaps.clear();
+  return Changed;
+}
+
+bool LinkConsolidation::dropIndirectionTables(Module &M) {
+  GlobalVariable *Used = M.getGlobalVariable("llvm.compiler.used");
+  if (!Used || !Used->hasInitializer()) {
+    return false;
+  }
+  Constant *UsedInit = Used->getInitializer();
+
+  SmallPtrSet<GlobalValue *, 16> Dead;
+  for (GlobalVariable &GV : M.globals()) {
+    if (!GV.getMetadata(IndirectionTableMDKind) || !GV.hasLocalLinkage()) {
+      continue;
+    }
+    GV.removeDeadConstantUsers();
+    if (all_of(GV.users(), [&](User *U) { return U == UsedInit; })) {
+      Dead.insert(&GV);
+    }
+  }
+  if (Dead.empty()) {
+    return false;
+  }
+
+  std::vector<GlobalValue *> Keep;
+  for (Value *V : UsedInit->operands()) {
+    GlobalValue *G = dyn_cast<GlobalValue>(V->stripPointerCasts());
+    if (G && !Dead.count(G)) {
+      Keep.push_back(G);
+    }
+  }
+  Used->eraseFromParent();
+  if (!Keep.empty()) {
+    appendToCompilerUsed(M, Keep);
+  }
+  for (GlobalValue *G : Dead) {
+    GlobalVariable *GV = cast<GlobalVariable>(G);
+    Constant *Init = GV->getInitializer();
+    GV->setInitializer(nullptr);
+    if (isSafeToDestroyConstant(Init)) {
+      Init->destroyConstant();
+    }
+    GV->eraseFromParent();
+  }
+  NumIndirectionTablesDropped += Dead.size();
+  return true;
+}
+
+bool LinkConsolidation::readStringTables(Module &M) {
+  NamedMDNode *NMD = M.getNamedMetadata(StringTableMDName);
+  if (!NMD) {
+    return false;
+  }
+
+  for (MDNode *N : NMD->operands()) {
+    if (N->getNumOperands() < 4) {
+      continue;
+    }
+    std::unique_ptr<StringTable> T(new StringTable());
+    T->GV = mdconst::dyn_extract_or_null<GlobalVariable>(N->getOperand(0));
+    T->Bitmap = mdconst::dyn_extract_or_null<GlobalVariable>(N->getOperand(1));
+    T->SharedDecFunc = mdconst::dyn_extract_or_null<Function>(N->getOperand(2));
+    T->Descriptors = mdconst::dyn_extract_or_null<GlobalVariable>(N->getOperand(3));
+    if (T->Bitmap) {
+      Bitmaps.insert(T->Bitmap);
+    }
+
+    bool Valid = true;
+    for (unsigned i = 4; i < N->getNumOperands(); ++i) {
+      MDNode *SN = dyn_cast_or_null<MDNode>(N->getOperand(i));
+      if (!SN || SN->getNumOperands() != 6) {
+        Valid = false;
+        break;
+      }
+      ConstantInt *Offset = mdconst::dyn_extract_or_null<ConstantInt>(SN->getOperand(0));
+      ConstantInt *Length = mdconst::dyn_extract_or_null<ConstantInt>(SN->getOperand(1));
+      ConstantInt *Align = mdconst::dyn_extract_or_null<ConstantInt>(SN->getOperand(2));
+      ConstantInt *ID = mdconst::dyn_extract_or_null<ConstantInt>(SN->getOperand(3));
+      if (!Offset || !Length || !Align || !ID) {
+        Valid = false;
+        break;
+      }
+      EncryptedString S;
+      S.Offset = static_cast<unsigned>(Offset->getZExtValue());
+      S.Length = static_cast<unsigned>(Length->getZExtValue());
+      S.Align = static_cast<unsigned>(Align->getZExtValue());
+      S.ID = static_cast<unsigned>(ID->getZExtValue());
+      S.DecFunc = mdconst::dyn_extract_or_null<Function>(SN->getOperand(4));
+      S.DecPtr = mdconst::dyn_extract_or_null<Constant>(SN->getOperand(5));
+      // the decrypt routine of a string only a discarded function used is
+      // still linked in, through this very metadata
+      if (S.DecFunc) {
+        S.DecFunc->removeDeadConstantUsers();
+      }
+      if (S.DecFunc && S.DecFunc->use_empty() && S.DecFunc->hasLocalLinkage()) {
+        S.DecFunc->eraseFromParent();
+        if (GlobalVariable *DecGV = dyn_cast_or_null<GlobalVariable>(S.DecPtr)) {
+          eraseIfUnused(DecGV);
+        }
+        continue;
+      }
+      if (!S.DecPtr || (!S.DecFunc && !T->SharedDecFunc)) {
+        continue;
+      }
+      T->Strings.push_back(S);
+    }
+
+    if (Valid && T->GV && isMergeable(*T)) {
+      Tables.push_back(std::move(T));
+    } else if (T->GV) {
+      eraseIfUnused(T->GV);
+    }
+  }
+  NMD->eraseFromParent();
+  return true;
+}
+
+// A constant that only ends up in the initializer of indirection tables,
+// such as the encrypted address IndirectGlobalVariable keeps of a global.
+static bool isIndirectionTableEntry(User *U) {
+  if (!isa<ConstantExpr>(U)) {
+    return false;
+  }
+  return all_of(U->users(), [](User *CU) {
+    return isa<ConstantArray>(CU) && all_of(CU->users(), [](User *TU) {
+             GlobalVariable *GV = dyn_cast<GlobalVariable>(TU);
+             return GV && GV->getMetadata(IndirectionTableMDKind);
+           });
+  });
+}
+
+bool LinkConsolidation::isMergeable(StringTable &T) {
+  GlobalVariable *GV = T.GV;
+  if (!GV->hasLocalLinkage() || !GV->isConstant() || !GV->hasInitializer()) {
+    return false;
+  }
+  ConstantDataArray *CDA = dyn_cast<ConstantDataArray>(GV->getInitializer());
+  if (!CDA || !CDA->getElementType()->isIntegerTy(8)) {
+    return false;
+  }
+  for (const EncryptedString &S : T.Strings) {
+    if (uint64_t(S.Offset) + KeySize + S.Length > CDA->getNumElements()) {
+      return false;
+    }
+  }
+
+  if (!T.SharedDecFunc) {
+    // goron_decrypt_string_N(plain, data) only depends on its arguments and
+    // its status slot, so one routine can stand in for another with the
+    // same plain text, wherever the calls and their arguments come from
+    for (const EncryptedString &S : T.Strings) {
+      GlobalVariable *DecGV = dyn_cast<GlobalVariable>(S.DecPtr);
+      if (!S.DecFunc->hasLocalLinkage() || !DecGV || !DecGV->hasLocalLinkage()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // goron_decrypt_string(id) finds the keys through the descriptors, which
+  // are rewritten, so nothing else may read the table
+  Function *F = T.SharedDecFunc;
+  if (!F->hasLocalLinkage() || !T.Descriptors || !T.Descriptors->hasLocalLinkage() ||
+      !T.Descriptors->hasInitializer() || !isa<ConstantArray>(T.Descriptors->getInitializer())) {
+    return false;
+  }
+  ConstantArray *Descs = cast<ConstantArray>(T.Descriptors->getInitializer());
+  for (const EncryptedString &S : T.Strings) {
+    if (S.ID >= Descs->getNumOperands() || !isa<ConstantStruct>(Descs->getOperand(S.ID))) {
+      return false;
+    }
+  }
+  GV->removeDeadConstantUsers();
+  for (User *U : GV->users()) {
+    Instruction *I = dyn_cast<Instruction>(U);
+    if (I ? I->getFunction() != F : !isIndirectionTableEntry(U)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void LinkConsolidation::mergeStrings(Module &M) {
+  if (Tables.empty()) {
+    return;
+  }
+  LLVMContext &Ctx = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+
+  auto decryptString = [](StringRef Table, const EncryptedString &S, std::string &Plain) {
+    const char *Key = Table.data() + S.Offset;
+    const char *EncString = Key + KeySize;
+    for (unsigned i = 0; i < S.Length; ++i) {
+      Plain.push_back(EncString[i] ^ Key[i % KeySize]);
+    }
+  };
+
+  // | per-string table 1 | per-string table 2 | ... | junk bytes | key | encrypted string | ...
+  // The strings of the shared decrypt tables follow, unless an identical
+  // one is already in there.
+  std::vector<uint8_t> Data;
+  std::vector<uint64_t> Bases;
+  StringMap<unsigned> KeyOffsets; // plain text -> offset of a key in Data
+  StringMap<EncryptedString *> Canonicals; // alignment + plain text
+  std::string Plain;
+  for (auto &T : Tables) {
+    StringRef Bytes = cast<ConstantDataArray>(T->GV->getInitializer())->getRawDataValues();
+    Bases.push_back(Data.size());
+    if (T->SharedDecFunc) {
+      continue;
+    }
+    for (EncryptedString &S : T->Strings) {
+      Plain.assign(reinterpret_cast<const char *>(&S.Align), sizeof(S.Align));
+      decryptString(Bytes, S, Plain);
+      S.Canonical = Canonicals.try_emplace(Plain, &S).first->second;
+      KeyOffsets.try_emplace(StringRef(Plain).drop_front(sizeof(S.Align)),
+                             static_cast<unsigned>(Data.size() + S.Offset));
+    }
+    Data.insert(Data.end(), Bytes.begin(), Bytes.end());
+  }
+
+  size_t SharedStart = Data.size();
+  std::vector<std::pair<const EncryptedString *, StringRef>> Appended;
+  for (auto &T : Tables) {
+    if (!T->SharedDecFunc) {
+      continue;
+    }
+    StringRef Bytes = cast<ConstantDataArray>(T->GV->getInitializer())->getRawDataValues();
+    for (EncryptedString &S : T->Strings) {
+      Plain.clear();
+      decryptString(Bytes, S, Plain);
+      auto Inserted = KeyOffsets.try_emplace(Plain, 0);
+      if (!Inserted.second) {
+        S.NewOffset = Inserted.first->second;
+        ++NumEncryptedShared;
+        continue;
+      }
+      size_t Offset = Data.size() + 16 + RandomEngine.get_uint8_t() % 16;
+      S.NewOffset = Inserted.first->second = static_cast<unsigned>(Offset);
+      Data.resize(Offset + KeySize + S.Length);
+      Appended.push_back({&S, Bytes});
+    }
+  }
+  if (Data.size() > SharedStart) {
+    RandomEngine.get_bytes(reinterpret_cast<char *>(Data.data() + SharedStart),
+                           static_cast<int>(Data.size() - SharedStart));
+  }
+  for (auto &A : Appended) {
+    std::copy_n(A.second.data() + A.first->Offset, KeySize + A.first->Length,
+                Data.begin() + A.first->NewOffset);
+  }
+
+  Constant *CDA = ConstantDataArray::get(Ctx, ArrayRef<uint8_t>(Data));
+  GlobalVariable *Merged = new GlobalVariable(M, CDA->getType(), true, GlobalValue::PrivateLinkage, CDA);
+  for (unsigned i = 0; i < Tables.size(); ++i) {
+    StringTable &T = *Tables[i];
+    if (T.SharedDecFunc) {
+      ConstantArray *Descs = cast<ConstantArray>(T.Descriptors->getInitializer());
+      std::vector<Constant *> NewDescs;
+      for (unsigned j = 0; j < Descs->getNumOperands(); ++j) {
+        NewDescs.push_back(Descs->getOperand(j));
+      }
+      for (const EncryptedString &S : T.Strings) {
+        ConstantStruct *Desc = cast<ConstantStruct>(NewDescs[S.ID]);
+        NewDescs[S.ID] = ConstantStruct::get(
+            Desc->getType(), {ConstantInt::get(Int32Ty, S.NewOffset),
+                              Desc->getOperand(1), Desc->getOperand(2)});
+      }
+      T.Descriptors->setInitializer(ConstantArray::get(Descs->getType(), NewDescs));
+      T.GV->replaceAllUsesWith(Merged);
+    } else {
+      T.GV->replaceAllUsesWith(ConstantExpr::getInBoundsGetElementPtr(
+          Type::getInt8Ty(Ctx), Merged, ConstantInt::get(Int64Ty, Bases[i])));
+      for (EncryptedString &S : T.Strings) {
+        EncryptedString *C = S.Canonical;
+        if (C == &S || S.DecFunc->getFunctionType() != C->DecFunc->getFunctionType()) {
+          continue;
+        }
+        S.DecFunc->replaceAllUsesWith(C->DecFunc);
+        S.DecFunc->eraseFromParent();
+        S.DecPtr->replaceAllUsesWith(C->DecPtr);
+        cast<GlobalVariable>(S.DecPtr)->eraseFromParent();
+        ++NumDecryptMerged;
+      }
+    }
+    T.GV->eraseFromParent();
+  }
+  Merged->setName("EncryptedStringTable");
+  NumStringTablesMerged += Tables.size();
+}
+
+void LinkConsolidation::mergeStatusBitmaps(Module &M) {
+  // whole cache lines each, so every bitmap keeps its alignment at its
+  // offset in the merged one
+  SmallVector<GlobalVariable *, 8> Merging;
+  uint64_t NumWords = 0;
+  for (GlobalVariable *GV : Bitmaps) {
+    GV->removeDeadConstantUsers();
+    if (GV->use_empty()) {
+      eraseIfUnused(GV);
+      continue;
+    }
+    ArrayType *Ty = dyn_cast<ArrayType>(GV->getValueType());
+    if (!GV->hasLocalLinkage() || !GV->hasInitializer() ||
+        !GV->getInitializer()->isNullValue() || !Ty ||
+        !Ty->getElementType()->isIntegerTy(32) ||
+        Ty->getNumElements() % (CacheLineSize / sizeof(uint32_t))) {
+      continue;
+    }
+    Merging.push_back(GV);
+    NumWords += Ty->getNumElements();
+  }
+  if (Merging.size() < 2) {
+    return;
+  }
+
+  LLVMContext &Ctx = M.getContext();
+  ArrayType *BitmapTy = ArrayType::get(Type::getInt32Ty(Ctx), NumWords);
+  GlobalVariable *Merged = new GlobalVariable(M, BitmapTy, false, GlobalValue::PrivateLinkage,
+                                              ConstantAggregateZero::get(BitmapTy));
+  Merged->setAlignment(Align(CacheLineSize));
+  uint64_t Base = 0;
+  for (GlobalVariable *GV : Merging) {
+    GV->replaceAllUsesWith(ConstantExpr::getInBoundsGetElementPtr(
+        Type::getInt32Ty(Ctx), Merged, ConstantInt::get(Type::getInt64Ty(Ctx), Base)));
+    Base += cast<ArrayType>(GV->getValueType())->getNumElements();
+    GV->eraseFromParent();
+  }
+  Merged->setName("DecryptStatusBitmap");
+  NumBitmapsMerged += Merging.size();
+}
+
+void LinkConsolidation::eraseIfUnused(GlobalValue *GV) {
+  GV->removeDeadConstantUsers();
+  if (GV->use_empty() && GV->hasLocalLinkage()) {
+    GV->eraseFromParent();
+  }
+}
+
+ModulePass *llvm::createLinkConsolidationPass() { return new LinkConsolidation(); }
+
+INITIALIZE_PASS(LinkConsolidation, "link-consolidation", "Merge obfuscation tables after linking", false, false)
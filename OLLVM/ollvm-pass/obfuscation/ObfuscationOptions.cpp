@@ -2,13 +2,126 @@
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/ADT/SmallString.h"
+#include "llvm/Demangle/Demangle.h"
 #include "include/ObfuscationOptions.h"
+#include "include/CompileBudget.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/Debug.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
 
 using namespace llvm;
 
 namespace llvm {
 
+FunctionNameMatcher::FunctionNameMatcher() : Trie(1), NumPatterns(0) {}
+
+unsigned FunctionNameMatcher::getTrieNode(StringRef Literal) {
+  unsigned Node = 0;
+  for (char C : Literal) {
+    auto It = Trie[Node].Children.find(C);
+    if (It != Trie[Node].Children.end()) {
+      Node = It->second;
+      continue;
+    }
+    unsigned Child = static_cast<unsigned>(Trie.size());
+    Trie[Node].Children[C] = Child;
+    Trie.emplace_back();
+    Node = Child;
+  }
+  return Node;
+}
+
+int FunctionNameMatcher::add(StringRef Pattern) {
+  auto Known = PatternIds.find(Pattern);
+  if (Known != PatternIds.end()) {
+    return static_cast<int>(Known->second);
+  }
+
+  unsigned Id = NumPatterns;
+  if (Pattern.starts_with("re:")) {
+    Regex R(Pattern.drop_front(3));
+    std::string Error;
+    if (!R.isValid(Error)) {
+      errs() << "goron: invalid regex '" << Pattern << "': " << Error << "\n";
+      return -1;
+    }
+    Regexes.emplace_back(Id, std::move(R));
+  } else {
+    StringRef Literal = Pattern;
+    bool IsPrefix = Literal.ends_with("*");
+    if (IsPrefix) {
+      Literal = Literal.drop_back();
+    }
+    if (Literal.find_first_of("*?[]{}\\") == StringRef::npos) {
+      TrieNode &Node = Trie[getTrieNode(Literal)];
+      (IsPrefix ? Node.Prefix : Node.Exact).push_back(Id);
+    } else {
+      Expected<GlobPattern> G = GlobPattern::create(Pattern);
+      if (!G) {
+        errs() << "goron: invalid glob '" << Pattern
+               << "': " << toString(G.takeError()) << "\n";
+        return -1;
+      }
+      Globs.emplace_back(Id, std::move(*G));
+    }
+  }
+  PatternIds[Pattern] = Id;
+  ++NumPatterns;
+  return static_cast<int>(Id);
+}
+
+unsigned FunctionNameMatcher::addExact(StringRef Name) {
+  auto Known = ExactIds.find(Name);
+  if (Known != ExactIds.end()) {
+    return Known->second;
+  }
+
+  unsigned Id = NumPatterns++;
+  Trie[getTrieNode(Name)].Exact.push_back(Id);
+  ExactIds[Name] = Id;
+  return Id;
+}
+
+void FunctionNameMatcher::match(StringRef Name, BitVector &Matched) const {
+  Matched.reset();
+  Matched.resize(NumPatterns);
+
+  unsigned Node = 0;
+  for (size_t i = 0;; ++i) {
+    for (unsigned Id : Trie[Node].Prefix) {
+      Matched.set(Id);
+    }
+    if (i == Name.size()) {
+      for (unsigned Id : Trie[Node].Exact) {
+        Matched.set(Id);
+      }
+      break;
+    }
+    auto It = Trie[Node].Children.find(Name[i]);
+    if (It == Trie[Node].Children.end()) {
+      break;
+    }
+    Node = It->second;
+  }
+
+  for (const auto &G : Globs) {
+    if (G.second.match(Name)) {
+      Matched.set(G.first);
+    }
+  }
+  for (const auto &R : Regexes) {
+    if (R.second.match(Name)) {
+      Matched.set(R.first);
+    }
+  }
+}
+
 void ObfuscationOptions::init() {
   EnableIndirectBr = false;
   EnableIndirectCall = false;
@@ -16,6 +129,14 @@ void ObfuscationOptions::init() {
   EnableCFF = false;
   EnableCSE = false;
   hasFilter = false;
+  SharedStringDecrypt = false;
+  EagerStringDecrypt = false;
+  Recover = false;
+  Annotations = nullptr;
+  Budget = nullptr;
+  // goron_decrypt_string_N, goron_decrypt_string and goron_decrypt_strings
+  // are emitted by the passes themselves
+  GlobalExclude.push_back(static_cast<unsigned>(Matcher.add("goron_decrypt_string*")));
 }
 
 ObfuscationOptions::ObfuscationOptions() {
@@ -28,37 +149,227 @@ ObfuscationOptions::ObfuscationOptions(const Twine &FileName) {
   }
 }
 
-static StringRef getNodeString(yaml::Node *n) {
+// Quoted scalars with escapes are unescaped into Storage, so the value has
+// to be copied out before Storage goes away.
+static std::string getNodeString(yaml::Node *n) {
   if (yaml::ScalarNode *sn = dyn_cast<yaml::ScalarNode>(n)) {
     SmallString<32> Storage;
-    StringRef Val = sn->getValue(Storage);
-    return Val;
+    return sn->getValue(Storage).str();
   } else {
     return "";
   }
 }
 
 static unsigned long getIntVal(yaml::Node *n) {
-  return strtoul(getNodeString(n).str().c_str(), nullptr, 10);
+  return strtoul(getNodeString(n).c_str(), nullptr, 10);
 }
 
-static std::set<std::string> getStringList(yaml::Node *n) {
-  std::set<std::string> filter;
+void ObfuscationOptions::addPatterns(yaml::Node *n, std::vector<unsigned> &Ids,
+                                     bool Exact) {
   if (yaml::SequenceNode *sn = dyn_cast<yaml::SequenceNode>(n)) {
     for (yaml::SequenceNode::iterator i = sn->begin(), e = sn->end();
          i != e; ++i) {
-      filter.insert(getNodeString(i).str());
+      addPatterns(i, Ids, Exact);
+    }
+  } else if (isa<yaml::ScalarNode>(n)) {
+    std::string Pattern = getNodeString(n);
+    int Id = Exact ? static_cast<int>(Matcher.addExact(Pattern))
+                   : Matcher.add(Pattern);
+    if (Id >= 0) {
+      Ids.push_back(static_cast<unsigned>(Id));
     }
   }
-  return filter;
 }
 
-bool ObfuscationOptions::skipFunction(const Twine &FName) {
-  if (FName.str().find("goron_") == std::string::npos) {
-    return hasFilter && FunctionFilter.count(FName.str()) == 0;
-  } else {
+static bool anyMatched(const std::vector<unsigned> &Ids, const BitVector &Matched) {
+  for (unsigned Id : Ids) {
+    if (Matched.test(Id)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Deterministic "keep Percent% of the items" decision for one item.
+static bool keepByRatio(uint64_t Seed, unsigned Percent) {
+  if (Percent >= 100) {
     return true;
   }
+  return xxHash64(StringRef(reinterpret_cast<const char *>(&Seed),
+                            sizeof(Seed))) % 100 < Percent;
+}
+
+static uint64_t passSalt(unsigned Pass) {
+  return (Pass + 1) * 0x9E3779B97F4A7C15ULL;
+}
+
+// Patterns match the symbol name or its demangled form, so C++ and Rust
+// functions can be selected as "ns::name*" as well as by the mangled name.
+void ObfuscationOptions::matchName(StringRef Name) {
+  Matcher.match(Name, Matched);
+  std::string Demangled = demangle(Name.str());
+  if (Demangled != Name) {
+    Matcher.match(Demangled, DemangledMatched);
+    Matched |= DemangledMatched;
+  }
+}
+
+unsigned ObfuscationOptions::computeSkipMask(StringRef Name) {
+  const unsigned SkipAll = (1u << NumObfPasses) - 1;
+  matchName(Name);
+
+  if (anyMatched(GlobalExclude, Matched)) {
+    return SkipAll;
+  }
+  if (hasFilter && !anyMatched(FunctionFilter, Matched)) {
+    return SkipAll;
+  }
+
+  unsigned Mask = 0;
+  uint64_t Hash = xxHash64(Name);
+  for (unsigned P = 0; P < NumObfPasses; ++P) {
+    const PassPolicy &Policy = Policies[P];
+    bool Skip = anyMatched(Policy.Exclude, Matched) ||
+                (!Policy.Include.empty() && !anyMatched(Policy.Include, Matched));
+    if (!Skip) {
+      // Deterministic per (function, pass), so rebuilds obfuscate the same set.
+      Skip = !keepByRatio(Hash ^ passSalt(P), Policy.Intensity);
+    }
+    if (Skip) {
+      Mask |= 1u << P;
+    }
+  }
+  return Mask;
+}
+
+bool ObfuscationOptions::skipFunction(const Function &F, ObfPass Pass) {
+  StringRef Name = F.getName();
+  auto It = SkipCache.find(Name);
+  if (It == SkipCache.end()) {
+    It = SkipCache.insert({Name, computeSkipMask(Name)}).first;
+  }
+  if ((It->second >> Pass) & 1) {
+    return true;
+  }
+  return Budget && Budget->skip(F, Pass);
+}
+
+BlockSelector::BlockSelector(Function &F, const ObfuscationOptions *Options,
+                             ObfuscationOptions::ObfPass Pass) {
+  if (!Options || !Options->Policies[Pass].hasBlockPolicy()) {
+    return;
+  }
+  const ObfuscationOptions::PassPolicy &Policy = Options->Policies[Pass];
+
+  std::unique_ptr<DominatorTree> DT;
+  std::unique_ptr<LoopInfo> LI;
+  std::unique_ptr<BranchProbabilityInfo> BPI;
+  std::unique_ptr<BlockFrequencyInfo> BFI;
+  if (Policy.SkipLoopDepth || Policy.SkipProfileCount) {
+    DT.reset(new DominatorTree(F));
+    LI.reset(new LoopInfo(*DT));
+  }
+  // Profile counts only exist when the module carries PGO data.
+  if (Policy.SkipProfileCount && F.getEntryCount()) {
+    BPI.reset(new BranchProbabilityInfo(F, *LI));
+    BFI.reset(new BlockFrequencyInfo(F, *BPI, *LI));
+  }
+
+  uint64_t Seed = xxHash64(F.getName()) ^ passSalt(Pass);
+  uint64_t Index = 0;
+  for (BasicBlock &BB : F) {
+    ++Index;
+    bool Skip = !keepByRatio(Seed + Index * 0xBF58476D1CE4E5B9ULL,
+                             Policy.BlockRatio);
+    if (!Skip && Policy.SkipLoopDepth) {
+      Skip = LI->getLoopDepth(&BB) >= Policy.SkipLoopDepth;
+    }
+    if (!Skip && BFI) {
+      auto Count = BFI->getBlockProfileCount(&BB);
+      Skip = Count && *Count > Policy.SkipProfileCount;
+    }
+    if (Skip) {
+      Skipped.insert(&BB);
+    }
+  }
+}
+
+// A pass entry is either a plain on/off value or a mapping:
+//   IndirectBr:
+//     Enable: 1
+//     Include: ["parser::*", "re:^core::fmt::.*"]
+//     Exclude: ["*_slow_path"]
+//     Intensity: 50
+//     BlockRatio: 30
+//     SkipLoopDepth: 2
+//     SkipProfileCount: 100000
+// The block keys apply to IndirectBr, IndirectGV and ControlFlowFlatten.
+// ConstantStringEncryption also takes SharedDecrypt: 1 or EagerDecrypt: 1.
+bool ObfuscationOptions::handlePass(yaml::Node *n, ObfPass Pass) {
+  yaml::MappingNode *mn = dyn_cast<yaml::MappingNode>(n);
+  if (!mn) {
+    return static_cast<bool>(getIntVal(n));
+  }
+
+  bool Enable = true;
+  PassPolicy &Policy = Policies[Pass];
+  for (yaml::MappingNode::iterator i = mn->begin(), e = mn->end();
+       i != e; ++i) {
+    std::string K = getNodeString(i->getKey());
+    if (K == "Enable") {
+      Enable = static_cast<bool>(getIntVal(i->getValue()));
+    } else if (K == "Include") {
+      addPatterns(i->getValue(), Policy.Include);
+    } else if (K == "Exclude") {
+      addPatterns(i->getValue(), Policy.Exclude);
+    } else if (K == "Intensity") {
+      Policy.Intensity = std::min<unsigned>(getIntVal(i->getValue()), 100);
+    } else if (K == "BlockRatio") {
+      Policy.BlockRatio = std::min<unsigned>(getIntVal(i->getValue()), 100);
+    } else if (K == "SkipLoopDepth") {
+      Policy.SkipLoopDepth = static_cast<unsigned>(getIntVal(i->getValue()));
+    } else if (K == "SharedDecrypt" && Pass == CSE) {
+      SharedStringDecrypt = static_cast<bool>(getIntVal(i->getValue()));
+    } else if (K == "EagerDecrypt" && Pass == CSE) {
+      EagerStringDecrypt = static_cast<bool>(getIntVal(i->getValue()));
+    } else if (K == "SkipProfileCount") {
+      Policy.SkipProfileCount = strtoull(getNodeString(i->getValue()).c_str(), nullptr, 10);
+    }
+  }
+  return Enable;
+}
+
+// Limits:
+//   MaxBlocks: 20000
+//   MaxInstructions: 200000
+//   MaxFlattenBlocks: 1000
+//   MaxEstimatedSize: 1000000
+//   TimeBudgetMs: 0
+//   Report: "goron-report.txt"
+// Each limit is described in CompileBudget.h, 0 (the default) disables it.
+// The values above are a starting point for very large generated modules.
+void ObfuscationOptions::handleLimits(yaml::Node *n) {
+  yaml::MappingNode *mn = dyn_cast<yaml::MappingNode>(n);
+  if (!mn) {
+    return;
+  }
+  for (yaml::MappingNode::iterator i = mn->begin(), e = mn->end();
+       i != e; ++i) {
+    std::string K = getNodeString(i->getKey());
+    if (K == "MaxBlocks") {
+      Limits.MaxBlocks = static_cast<unsigned>(getIntVal(i->getValue()));
+    } else if (K == "MaxInstructions") {
+      Limits.MaxInstructions = static_cast<unsigned>(getIntVal(i->getValue()));
+    } else if (K == "MaxFlattenBlocks") {
+      Limits.MaxFlattenBlocks = static_cast<unsigned>(getIntVal(i->getValue()));
+    } else if (K == "MaxEstimatedSize") {
+      Limits.MaxEstimatedSize = strtoull(getNodeString(i->getValue()).c_str(), nullptr, 10);
+    } else if (K == "TimeBudgetMs") {
+      Limits.TimeBudgetMs = static_cast<unsigned>(getIntVal(i->getValue()));
+    } else if (K == "Report") {
+      Limits.Report = getNodeString(i->getValue());
+    }
+  }
 }
 
 void ObfuscationOptions::handleRoot(yaml::Node *n) {
@@ -67,20 +378,31 @@ void ObfuscationOptions::handleRoot(yaml::Node *n) {
   if (yaml::MappingNode *mn = dyn_cast<yaml::MappingNode>(n)) {
     for (yaml::MappingNode::iterator i = mn->begin(), e = mn->end();
          i != e; ++i) {
-      StringRef K = getNodeString(i->getKey());
+      std::string K = getNodeString(i->getKey());
       if (K == "IndirectBr") {
-        EnableIndirectBr = static_cast<bool>(getIntVal(i->getValue()));
+        EnableIndirectBr = handlePass(i->getValue(), IndirectBr);
       } else if (K == "IndirectCall") {
-        EnableIndirectCall = static_cast<bool>(getIntVal(i->getValue()));
+        EnableIndirectCall = handlePass(i->getValue(), IndirectCall);
       } else if (K == "IndirectGV") {
-        EnableIndirectGV = static_cast<bool>(getIntVal(i->getValue()));
+        EnableIndirectGV = handlePass(i->getValue(), IndirectGV);
       } else if (K == "ControlFlowFlatten") {
-        EnableCFF = static_cast<bool>(getIntVal(i->getValue()));
+        EnableCFF = handlePass(i->getValue(), CFF);
       } else if (K == "ConstantStringEncryption") {
-        EnableCSE = static_cast<bool>(getIntVal(i->getValue()));
+        EnableCSE = handlePass(i->getValue(), CSE);
       } else if (K == "Filter") {
+        // exact names, kept literal for configurations written before
+        // patterns existed
         hasFilter = true;
-        FunctionFilter = getStringList(i->getValue());
+        addPatterns(i->getValue(), FunctionFilter, true);
+      } else if (K == "Include") {
+        hasFilter = true;
+        addPatterns(i->getValue(), FunctionFilter);
+      } else if (K == "Exclude") {
+        addPatterns(i->getValue(), GlobalExclude);
+      } else if (K == "Recover") {
+        Recover = static_cast<bool>(getIntVal(i->getValue()));
+      } else if (K == "Limits") {
+        handleLimits(i->getValue());
       }
     }
   }
@@ -110,7 +432,26 @@ void ObfuscationOptions::dump() {
          << "EnableIndirectCall: " << EnableIndirectCall << "\n"
          << "EnableIndirectGV: " << EnableIndirectGV << "\n"
          << "EnableCFF: " << EnableCFF << "\n"
-         << "hasFilter:" << hasFilter << "\n";
+         << "hasFilter:" << hasFilter << "\n"
+         << "SharedStringDecrypt: " << SharedStringDecrypt << "\n"
+         << "EagerStringDecrypt: " << EagerStringDecrypt << "\n"
+         << "Recover: " << Recover << "\n"
+         << "Limits: max blocks " << Limits.MaxBlocks << ", max instructions "
+         << Limits.MaxInstructions << ", max flatten blocks "
+         << Limits.MaxFlattenBlocks << ", max estimated size "
+         << Limits.MaxEstimatedSize << ", time budget "
+         << Limits.TimeBudgetMs << " ms\n"
+         << "Patterns: " << Matcher.size() << "\n";
+  const char *Names[NumObfPasses] = {"IndirectBr", "IndirectCall", "IndirectGV",
+                                     "CFF", "CSE"};
+  for (unsigned P = 0; P < NumObfPasses; ++P) {
+    dbgs() << Names[P] << ": include " << Policies[P].Include.size()
+           << ", exclude " << Policies[P].Exclude.size() << ", intensity "
+           << Policies[P].Intensity << ", block ratio "
+           << Policies[P].BlockRatio << ", skip loop depth "
+           << Policies[P].SkipLoopDepth << ", skip profile count "
+           << Policies[P].SkipProfileCount << "\n";
+  }
 }
 
 }
@@ -1,10 +1,13 @@
 #include "include/ObfuscationPassManager.h"
+#include "include/CompileBudget.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Path.h"
+#include <chrono>
 #include "include/ObfuscationOptions.h"
+#include "include/Utils.h"
 
 #define DEBUG_TYPE "ir-obfuscation"
 
@@ -37,6 +40,34 @@ static cl::opt<bool>
     EnableIRStringEncryption("irobf-cse", cl::init(false), cl::NotHidden,
                              cl::desc("Enable IR Constant String Encryption."), cl::ZeroOrMore);
 
+static cl::opt<bool> EnableLinkConsolidation(
+    "irobf-merge", cl::init(false), cl::NotHidden,
+    cl::desc("Merge the string and indirection tables of modules obfuscated "
+             "one by one, run on the output of llvm-link."),
+    cl::ZeroOrMore);
+
+static cl::opt<bool> EnableRecovery(
+    "irobf-recover", cl::init(false), cl::NotHidden,
+    cl::desc("Clean up the obfuscated functions with a pipeline that keeps "
+             "the transforms (SROA, InstCombine, GVN, SimplifyCFG, DCE)."),
+    cl::ZeroOrMore);
+
+// Where the obfuscation runs in a default clang/opt/rustc -O<n> pipeline, so
+// it needs no separate opt run (e.g. clang -fpass-plugin=... -mllvm
+// -irobf-ep=last). -passes="irobf(...)" works regardless. There is no
+// pipeline start position: the loop vectorizer crashes on the obfuscated
+// loops, and the optimizations fold away what they do not crash on.
+enum class ObfuscationEP { None, OptimizerLast };
+static cl::opt<ObfuscationEP> ObfuscationPosition(
+    "irobf-ep", cl::init(ObfuscationEP::None), cl::NotHidden,
+    cl::desc("Run the IR obfuscation at an extension point of the default "
+             "pipelines."),
+    cl::values(clEnumValN(ObfuscationEP::None, "none",
+                          "Only when named in -passes"),
+               clEnumValN(ObfuscationEP::OptimizerLast, "last",
+                          "After the optimizations, once inlining is done")),
+    cl::ZeroOrMore);
+
 static cl::opt<std::string> GoronConfigure("goron-cfg",
                                            cl::desc("Goron configuration file"),
                                            cl::Optional);
@@ -46,8 +77,12 @@ namespace llvm {
 struct ObfuscationPassManager : public ModulePass {
   static char ID; // Pass identification
   SmallVector<Pass *, 8> Passes;
+  CompileBudget *Budget;
+  // Runs as if -irobf was given, for the extension point.
+  bool Enabled;
 
-  ObfuscationPassManager() : ModulePass(ID) {
+  explicit ObfuscationPassManager(bool Enabled = false)
+      : ModulePass(ID), Budget(nullptr), Enabled(Enabled) {
     initializeObfuscationPassManagerPass(*PassRegistry::getPassRegistry());
   };
 
@@ -77,6 +112,7 @@ struct ObfuscationPassManager : public ModulePass {
       default:
         continue;
       }
+      pinIndirectionTables(M);
     }
     return Change;
   }
@@ -84,7 +120,15 @@ struct ObfuscationPassManager : public ModulePass {
   bool runFunctionPass(Module &M, FunctionPass *P) {
     bool Changed = false;
     for (Function &F : M) {
+      if (!Budget || !Budget->isTimed()) {
+        Changed |= P->runOnFunction(F);
+        continue;
+      }
+      auto Start = std::chrono::steady_clock::now();
       Changed |= P->runOnFunction(F);
+      std::chrono::duration<double> Elapsed =
+          std::chrono::steady_clock::now() - Start;
+      Budget->charge(F, P->getPassName(), Elapsed.count());
     }
     return Changed;
   }
@@ -109,16 +153,29 @@ struct ObfuscationPassManager : public ModulePass {
 
   bool runOnModule(Module &M) override {
     
-    if (EnableIndirectBr || EnableIndirectCall || EnableIndirectGV ||
-        EnableIRFlattening || EnableIRStringEncryption) {
-      EnableIRObfusaction = true;
+    bool Obfuscate = EnableIndirectBr || EnableIndirectCall || EnableIndirectGV ||
+                     EnableIRFlattening || EnableIRStringEncryption;
+    // Not written back to the option: irvana-obf runs modules on several
+    // threads.
+    if (!Enabled && !EnableIRObfusaction && !Obfuscate &&
+        !EnableLinkConsolidation) {
+      return false;
     }
 
-    if (!EnableIRObfusaction) {
-      return false;
+    // Post-link run over modules that were obfuscated one by one: the
+    // configuration and annotations were already applied to each of them.
+    if (EnableLinkConsolidation && !Obfuscate) {
+      add(llvm::createLinkConsolidationPass());
+      return run(M);
     }
 
     std::unique_ptr<ObfuscationOptions> Options(getOptions());
+    AnnotationIndex Annotations(M);
+    Options->Annotations = &Annotations;
+    CompileBudget Limits(M, Options->Limits,
+                         EnableIRFlattening || Options->EnableCFF,
+                         EnableIndirectBr || Options->EnableIndirectBr);
+    Options->Budget = Budget = &Limits;
     unsigned pointerSize = M.getDataLayout().getTypeAllocSize(PointerType::getUnqual(M.getContext()));
     if (EnableIRStringEncryption || Options->EnableCSE) {
       add(llvm::createStringEncryptionPass(true, Options.get()));
@@ -131,8 +188,16 @@ struct ObfuscationPassManager : public ModulePass {
                                          Options->EnableIndirectCall, Options.get()));
     add(llvm::createIndirectGlobalVariablePass(pointerSize,
         EnableIndirectGV || Options->EnableIndirectGV, Options.get()));
+    if (EnableRecovery || Options->Recover) {
+      add(llvm::createRecoveryPass());
+    }
+    if (EnableLinkConsolidation) {
+      add(llvm::createLinkConsolidationPass());
+    }
 
     bool Changed = run(M);
+    Limits.writeReport();
+    Budget = nullptr;
 
     return Changed;
   }
@@ -140,8 +205,46 @@ struct ObfuscationPassManager : public ModulePass {
 } // namespace llvm
 
 char ObfuscationPassManager::ID = 0;
-ModulePass *llvm::createObfuscationPassManager() {
-  return new ObfuscationPassManager();
+
+bool llvm::hasObfuscationWork(Module &M) {
+  bool Obfuscate = EnableIndirectBr || EnableIndirectCall || EnableIndirectGV ||
+                   EnableIRFlattening || EnableIRStringEncryption;
+  if (!EnableIRObfusaction && !Obfuscate && !EnableLinkConsolidation) {
+    return false;
+  }
+  std::unique_ptr<ObfuscationOptions> Options(
+      ObfuscationPassManager::getOptions());
+  // Both run over every function, selected or not.
+  if (EnableLinkConsolidation || EnableRecovery || Options->Recover) {
+    return true;
+  }
+
+  // Same selection as the passes themselves: flag or annotation, then the
+  // configuration. String encryption only runs when enabled.
+  AnnotationIndex Annotations(M);
+  bool CSE = EnableIRStringEncryption || Options->EnableCSE;
+  for (Function &F : M) {
+    auto Selects = [&](bool Flag, StringRef Attr,
+                       ObfuscationOptions::ObfPass Pass) {
+      return toObfuscate(Flag, &F, Attr, &Annotations) &&
+             !Options->skipFunction(F, Pass);
+    };
+    if ((CSE && Selects(true, "cse", ObfuscationOptions::CSE)) ||
+        Selects(EnableIRFlattening || Options->EnableCFF, "fla",
+                ObfuscationOptions::CFF) ||
+        Selects(EnableIndirectBr || Options->EnableIndirectBr, "indbr",
+                ObfuscationOptions::IndirectBr) ||
+        Selects(EnableIndirectCall || Options->EnableIndirectCall, "icall",
+                ObfuscationOptions::IndirectCall) ||
+        Selects(EnableIndirectGV || Options->EnableIndirectGV, "indgv",
+                ObfuscationOptions::IndirectGV)) {
+      return true;
+    }
+  }
+  return false;
+}
+ModulePass *llvm::createObfuscationPassManager(bool Enabled) {
+  return new ObfuscationPassManager(Enabled);
 }
 INITIALIZE_PASS_BEGIN(ObfuscationPassManager, "irobf", "Enable IR Obfuscation",
                       false, false)
@@ -172,6 +275,10 @@ llvm::PassPluginLibraryInfo getObfPassPluginInfo() {
                           EnableIRObfusaction = true;
                         } else if (Element.Name == EnableIRStringEncryption.ArgStr) {
                           EnableIRStringEncryption = true;
+                        } else if (Element.Name == EnableLinkConsolidation.ArgStr) {
+                          EnableLinkConsolidation = true;
+                        } else if (Element.Name == EnableRecovery.ArgStr) {
+                          EnableRecovery = true;
                         }
                       }
 
@@ -180,6 +287,12 @@ llvm::PassPluginLibraryInfo getObfPassPluginInfo() {
                     }
                     return false;
                 });
+            PB.registerOptimizerLastEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel Level) {
+                  if (ObfuscationPosition == ObfuscationEP::OptimizerLast) {
+                    MPM.addPass(ObfuscationPassManagerPass(true));
+                  }
+                });
           }};
 }
 
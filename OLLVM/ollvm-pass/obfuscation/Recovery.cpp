@@ -0,0 +1,220 @@
+#include "include/Recovery.h"
+#include "include/Utils.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/IR/ValueHandle.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/DCE.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/SROA.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+
+#define DEBUG_TYPE "obf-recovery"
+
+using namespace llvm;
+
+STATISTIC(NumRecovered, "Functions cleaned up after obfuscation");
+STATISTIC(NumPinned, "Allocas kept in memory across the dispatcher");
+
+//
+// Cleans up after the obfuscation passes: the allocas, stores and reloads
+// fixStack leaves for every value that lives across blocks, the constant
+// arithmetic the transforms emit in place of plain constants, and the
+// instructions that end up dead. The pipeline is SROA, InstCombine, GVN,
+// SimplifyCFG and DCE, set up so it does not undo the transforms:
+//  - the flattening dispatch state (tagged DispatchStateMDKind) and every
+//    alloca whose value crosses the dispatcher are volatile while the passes
+//    run. SROA keeps them in memory, so it does not rebuild the phis that
+//    fixStack removed (a phi per live value in the dispatcher, which is what
+//    makes register allocation blow up) and GVN cannot forward the next
+//    case to the dispatcher, which SimplifyCFG would then thread. Values set
+//    before the dispatcher and values used in the block that stores them
+//    are promoted,
+//  - SimplifyCFG leaves conditional branches and switches alone and does
+//    not hoist, sink or build lookup tables, so the lowered dispatch tree
+//    stays as it is,
+//  - indirectbr, icall and indgv targets are loaded from tables that are
+//    not constant and are kept alive by llvm.compiler.used, so nothing folds
+//    them back into a direct block, function or global.
+// Functions with optnone are skipped like any pipeline would. clang -O0
+// marks every function optnone, so a module where nothing else is left is
+// reported instead of passing through unchanged without a word.
+//
+namespace {
+struct Recovery : public ModulePass {
+  static char ID;
+
+  Recovery() : ModulePass(ID) {
+    initializeRecoveryPass(*PassRegistry::getPassRegistry());
+  }
+
+  StringRef getPassName() const override { return "Obfuscation Recovery"; }
+
+  bool runOnModule(Module &M) override;
+
+  void pinDispatcherAllocas(Function &F,
+                            SmallVectorImpl<WeakTrackingVH> &Pinned);
+};
+} // namespace
+
+char Recovery::ID = 0;
+
+// An alloca crosses the dispatcher if it is stored after a dispatcher and
+// loaded in a block that does not store it first, which approximates being
+// live into the dispatcher with more than one reaching store. Functions
+// flattened in partitions have one dispatcher per partition.
+static bool crossesDispatcher(AllocaInst *AI,
+                              ArrayRef<BasicBlock *> Dispatchers,
+                              DominatorTree &DT) {
+  DenseMap<BasicBlock *, Instruction *> FirstStore;
+  bool StoredInLoop = false;
+  for (User *U : AI->users()) {
+    auto *SI = dyn_cast<StoreInst>(U);
+    if (!SI || SI->getPointerOperand() != AI) {
+      continue;
+    }
+    Instruction *&First = FirstStore[SI->getParent()];
+    if (!First || SI->comesBefore(First)) {
+      First = SI;
+    }
+    StoredInLoop |= any_of(Dispatchers, [&](BasicBlock *Dispatcher) {
+      return !DT.dominates(SI->getParent(), Dispatcher);
+    });
+  }
+  if (!StoredInLoop) {
+    return false;
+  }
+  for (User *U : AI->users()) {
+    if (auto *LI = dyn_cast<LoadInst>(U)) {
+      Instruction *First = FirstStore.lookup(LI->getParent());
+      if (!First || LI->comesBefore(First)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Marks the loads and stores of AI volatile, or clears the flag again. SROA
+// rewrites the accesses of an alloca it cannot promote, so the alloca is
+// what gets tracked rather than the accesses.
+static void setAccessesVolatile(AllocaInst *AI, bool Volatile) {
+  for (User *U : AI->users()) {
+    if (auto *LI = dyn_cast<LoadInst>(U)) {
+      LI->setVolatile(Volatile);
+    } else if (auto *SI = dyn_cast<StoreInst>(U)) {
+      if (SI->getPointerOperand() == AI) {
+        SI->setVolatile(Volatile);
+      }
+    }
+  }
+}
+
+static bool hasVolatileAccess(AllocaInst *AI) {
+  return any_of(AI->users(), [](User *U) {
+    if (auto *LI = dyn_cast<LoadInst>(U)) {
+      return LI->isVolatile();
+    }
+    auto *SI = dyn_cast<StoreInst>(U);
+    return SI && SI->isVolatile();
+  });
+}
+
+void Recovery::pinDispatcherAllocas(Function &F,
+                                    SmallVectorImpl<WeakTrackingVH> &Pinned) {
+  SmallVector<AllocaInst *, 16> Allocas;
+  SmallVector<BasicBlock *, 1> Dispatchers;
+  for (Instruction &I : F.getEntryBlock()) {
+    if (auto *AI = dyn_cast<AllocaInst>(&I)) {
+      if (AI->getMetadata(DispatchStateMDKind)) {
+        for (User *U : AI->users()) {
+          if (isa<LoadInst>(U)) {
+            Dispatchers.push_back(cast<LoadInst>(U)->getParent());
+          }
+        }
+      }
+      Allocas.push_back(AI);
+    }
+  }
+  if (Dispatchers.empty()) {
+    return;
+  }
+
+  DominatorTree DT(F);
+  for (AllocaInst *AI : Allocas) {
+    if (hasVolatileAccess(AI) || (!AI->getMetadata(DispatchStateMDKind) &&
+                                  !crossesDispatcher(AI, Dispatchers, DT))) {
+      continue;
+    }
+    ++NumPinned;
+    setAccessesVolatile(AI, true);
+    Pinned.push_back(AI);
+  }
+}
+
+bool Recovery::runOnModule(Module &M) {
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassBuilder PB;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  FunctionPassManager FPM;
+  FPM.addPass(SROAPass(SROAOptions::PreserveCFG));
+  FPM.addPass(InstCombinePass());
+  FPM.addPass(GVNPass());
+  FPM.addPass(SimplifyCFGPass(SimplifyCFGOptions()
+                                  .forwardSwitchCondToPhi(false)
+                                  .convertSwitchRangeToICmp(false)
+                                  .convertSwitchToLookupTable(false)
+                                  .hoistCommonInsts(false)
+                                  .sinkCommonInsts(false)
+                                  .setSimplifyCondBranch(false)));
+  FPM.addPass(DCEPass());
+
+  bool Changed = false;
+  unsigned NumDefined = 0;
+  unsigned NumOptNone = 0;
+  for (Function &F : M) {
+    if (F.isDeclaration()) {
+      continue;
+    }
+    ++NumDefined;
+    if (F.hasOptNone()) {
+      ++NumOptNone;
+      continue;
+    }
+    SmallVector<WeakTrackingVH, 16> Pinned;
+    pinDispatcherAllocas(F, Pinned);
+    PreservedAnalyses PA = FPM.run(F, FAM);
+    for (WeakTrackingVH &V : Pinned) {
+      if (auto *AI = dyn_cast_or_null<AllocaInst>(V)) {
+        setAccessesVolatile(AI, false);
+      }
+    }
+    if (!PA.areAllPreserved()) {
+      ++NumRecovered;
+      Changed = true;
+    }
+  }
+  if (NumOptNone && NumOptNone == NumDefined) {
+    errs() << "goron: recover skipped all " << NumOptNone << " functions of '"
+           << M.getModuleIdentifier() << "', they are optnone (clang -O0 "
+           << "without -Xclang -disable-O0-optnone)\n";
+  }
+  return Changed;
+}
+
+ModulePass *llvm::createRecoveryPass() { return new Recovery(); }
+
+INITIALIZE_PASS(Recovery, "obf-recovery", "Clean up after IR obfuscation", false, false)
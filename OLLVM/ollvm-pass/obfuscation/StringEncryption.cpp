@@ -1,94 +1,174 @@
 #include "include/ObfuscationOptions.h"
 #include "include/StringEncryption.h"
 #include "include/Utils.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/Transforms/Utils/GlobalStatus.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
 #include "llvm/Transforms/IPO/Attributor.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/GlobalValue.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicsAArch64.h"
+#include "llvm/IR/IntrinsicsX86.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/TargetParser/Triple.h"
 #include "include/CryptoUtils.h"
-#include <map>
-#include <set>
 #include <iostream>
 #include <algorithm>
 
 #define DEBUG_TYPE "string-encryption"
 
 using namespace llvm;
+
+// Every key is one vector stride long, so the decrypt loop xors whole
+// <32 x i8> blocks with the same key vector and the scalar tail indexes the
+// key with a mask instead of a urem.
+static const unsigned DecryptStride = 32;
+// Each decrypt routine and initializer owns two bits of DecryptStatusBitmap,
+// 16 slots per 32-bit word: the low bit is set once the plain data is
+// published, the high bit by whichever thread claimed the decryption.
+static const unsigned StatusSlotsPerWord = 16;
+static const unsigned CacheLineSize = 64;
+// Constant string users with at least this many scalar elements are copied
+// from a read-only template and only their string slots are patched, instead
+// of being stored element by element.
+static const unsigned MinTemplateElements = 16;
+// From this many pointer slots on, they are patched by a loop over a table.
+static const unsigned MinFixupLoop = 4;
 namespace {
 struct StringEncryption : public ModulePass {
   static char ID;
   bool flag;
 
   struct CSPEntry {
-    CSPEntry() : ID(0), Offset(0), DecGV(nullptr), DecStatus(nullptr), DecFunc(nullptr) {}
+    CSPEntry() : ID(0), Offset(0), DecOffset(0), GV(nullptr), DecGV(nullptr),
+                 DecPtr(nullptr), DecFunc(nullptr) {}
     unsigned ID;
-    unsigned Offset;
+    unsigned Offset; // of the key in EncryptedStringTable
+    unsigned DecOffset; // offset in DecryptedStringPool (shared decrypt)
+    GlobalVariable *GV;
     GlobalVariable *DecGV;
-    GlobalVariable *DecStatus; // is decrypted or not
-    std::vector<uint8_t> Data;
-    std::vector<uint8_t> EncKey;
+    Constant *DecPtr; // what the uses of the plain string are replaced with
+    ArrayRef<uint8_t> Data; // plain bytes, copied into Arena
     Function *DecFunc;
   };
 
   struct CSUser {
     CSUser(Type* ETy, GlobalVariable *User, GlobalVariable *NewGV)
-        : Ty(ETy), GV(User), DecGV(NewGV), DecStatus(nullptr),
-          InitFunc(nullptr) {}
+        : Ty(ETy), GV(User), DecGV(NewGV), Slot(0), InitFunc(nullptr) {}
     Type *Ty;
     GlobalVariable *GV;
     GlobalVariable *DecGV;
-    GlobalVariable *DecStatus; // is decrypted or not
+    // Slot and InitFunc are shared by every user of an InitGroups entry
+    unsigned Slot; // in DecryptStatusBitmap, after the constant strings
     Function *InitFunc; // InitFunc will use decryted string to initialize DecGV
   };
 
+  // A slot of a constant string user that is written after its template is
+  // copied, at Offset bytes from the start of the user.
+  struct Fixup {
+    uint64_t Offset;
+    Constant *Value;
+  };
+
+  // What a global referenced from code is replaced with: either a constant
+  // string or a constant string user. Group is scratch space for
+  // processConstantStringUse and is ~0U outside of it.
+  struct EncryptedGlobal {
+    EncryptedGlobal() : Entry(nullptr), User(nullptr), Group(~0U) {}
+    CSPEntry *Entry;
+    CSUser *User;
+    unsigned Group;
+  };
+
   ObfuscationOptions *Options;
   CryptoUtils RandomEngine;
+  // CSPEntry, CSUser and plain string bytes, all released in doFinalization
+  BumpPtrAllocator Arena;
   std::vector<CSPEntry *> ConstantStringPool;
-  std::map<GlobalVariable *, CSPEntry *> CSPEntryMap;
-  std::map<GlobalVariable *, CSUser *> CSUserMap;
+  std::vector<CSUser *> CSUsers;
+  // Users whose initializers refer to each other, directly or in a cycle,
+  // are initialized together: an InitFunc that called one already running
+  // would wait on its claimed slot forever.
+  std::vector<SmallVector<CSUser *, 1>> InitGroups;
+  DenseMap<GlobalVariable *, EncryptedGlobal> EncryptedGlobals;
   GlobalVariable *EncryptedStringTable;
-  std::set<GlobalVariable *> MaybeDeadGlobalVars;
+  GlobalVariable *DecryptStatusBitmap;
+  SetVector<GlobalVariable *> MaybeDeadGlobalVars;
+
+  // Shared decrypt mode: one goron_decrypt_string(id) for the whole module
+  bool SharedDecrypt;
+  GlobalVariable *DecryptedStringPool;
+  GlobalVariable *StringDescriptorTable;
+  Function *SharedDecFunc;
+
+  // Eager decrypt mode: a module constructor decrypts DecryptedStringPool
+  // in one pass and uses point straight into it, without status checks
+  bool EagerDecrypt;
 
   StringEncryption() : ModulePass(ID) {
     this->flag = false;
     Options = nullptr;
+    SharedDecrypt = false;
+    EagerDecrypt = false;
   }
 
   StringEncryption(bool flag, ObfuscationOptions *Options) : ModulePass(ID) {
     this->flag = flag;
     this->Options = Options;
+    EagerDecrypt = Options && Options->EagerStringDecrypt;
+    SharedDecrypt = !EagerDecrypt && Options && Options->SharedStringDecrypt;
     initializeStringEncryptionPass(*PassRegistry::getPassRegistry());
   }
 
   bool doFinalization(Module &) {
-    for (CSPEntry *Entry : ConstantStringPool) {
-      delete (Entry);
-    }
-    for (auto &I : CSUserMap) {
-      CSUser *User = I.second;
-      delete (User);
-    }
     ConstantStringPool.clear();
-    CSPEntryMap.clear();
-    CSUserMap.clear();
+    CSUsers.clear();
+    InitGroups.clear();
+    EncryptedGlobals.clear();
     MaybeDeadGlobalVars.clear();
+    Arena.Reset();
     return false;
   }
 
   StringRef getPassName() const override { return {"StringEncryption"}; }
 
   bool runOnModule(Module &M) override;
-  void collectConstantStringUser(GlobalVariable *CString, std::set<GlobalVariable *> &Users);
+  bool runEager(Module &M, ArrayRef<Function *> Funcs,
+                const SetVector<GlobalVariable *> &ConstantStringUsers, uint32_t PoolSize);
+  void collectConstantStringUser(GlobalVariable *CString, SetVector<GlobalVariable *> &Users);
   bool isValidToEncrypt(GlobalVariable *GV);
   bool processConstantStringUse(Function *F);
   void deleteUnusedGlobalVariable();
   Function *buildDecryptFunction(Module *M, const CSPEntry *Entry);
-  Function *buildInitFunction(Module *M, const CSUser *User);
-  void getRandomBytes(std::vector<uint8_t> &Bytes, uint32_t MinSize, uint32_t MaxSize);
+  Function *buildSharedDecryptFunction(Module *M);
+  Function *buildEagerDecryptFunction(Module *M, uint32_t PoolSize);
+  void emitDecryptCall(IRBuilder<> &IRB, const CSPEntry *Entry);
+  void createStatusBitmap(Module &M, unsigned NumSlots);
+  Value *emitStatusCheck(IRBuilder<> &IRB, Value *Slot, BasicBlock *Decrypt, BasicBlock *Exit,
+                         Value *&DoneBit);
+  void emitDecryptLoop(IRBuilder<> &IRB, Value *Key, Value *EncPtr,
+                       Value *PlainString, Value *Length, BasicBlock *Done);
+  Function *createInitFunction(Module *M, const CSUser *User);
+  void groupConstantStringUsers();
+  void buildInitFunction(ArrayRef<CSUser *> Group);
+  void mapEncryptedGlobals(Constant *C, IRBuilder<> &IRB, ValueToValueMapTy &VMap);
+  bool refersToEncryptedGlobal(Constant *C);
+  Constant *splitGlobalConstant(Constant *CV, uint64_t Offset, const DataLayout &DL,
+                                std::vector<Fixup> &Fixups, unsigned &NumElements);
+  void lowerGlobalConstantTemplate(Constant *Template, ArrayRef<Fixup> Fixups,
+                                   IRBuilder<> &IRB, const CSUser *User,
+                                   ValueToValueMapTy &VMap);
+  void getRandomBytes(MutableArrayRef<uint8_t> Bytes);
+  void recordStringTable(Module &M);
   void lowerGlobalConstant(Constant *CV, IRBuilder<> &IRB, Value *Ptr, Type *Ty);
   void lowerGlobalConstantStruct(ConstantStruct *CS, IRBuilder<> &IRB, Value *Ptr, Type *Ty);
   void lowerGlobalConstantArray(ConstantArray *CA, IRBuilder<> &IRB, Value *Ptr, Type *Ty);
@@ -97,12 +177,26 @@ struct StringEncryption : public ModulePass {
 
 char StringEncryption::ID = 0;
 bool StringEncryption::runOnModule(Module &M) {
-  std::set<GlobalVariable *> ConstantStringUsers;
+  SetVector<GlobalVariable *> ConstantStringUsers;
+  uint64_t PoolSize = 0;
+  uint64_t PoolAlign = 1;
+
+  DecryptedStringPool = nullptr;
+  StringDescriptorTable = nullptr;
+  DecryptStatusBitmap = nullptr;
+  SharedDecFunc = nullptr;
+
+  // functions built below never reference the plain globals
+  std::vector<Function *> Funcs;
+  for (Function &F : M) {
+    if (!F.isDeclaration()) {
+      Funcs.push_back(&F);
+    }
+  }
 
   // collect all c strings
 
   LLVMContext &Ctx = M.getContext();
-  ConstantInt *Zero = ConstantInt::get(Type::getInt32Ty(Ctx), 0);
   for (GlobalVariable &GV : M.globals()) {
     if (!GV.isConstant() || !GV.hasInitializer() ||
       GV.hasDLLExportStorageClass() || GV.isDLLImportDependent()) {
@@ -113,38 +207,53 @@ bool StringEncryption::runOnModule(Module &M) {
       continue;
     if (ConstantDataSequential *CDS = dyn_cast<ConstantDataSequential>(Init)) {
       if (CDS->isCString()) {
-        CSPEntry *Entry = new CSPEntry();
+        CSPEntry *Entry = new (Arena.Allocate<CSPEntry>()) CSPEntry();
         StringRef Data = CDS->getRawDataValues();
-        Entry->Data.reserve(Data.size());
-        for (unsigned i = 0; i < Data.size(); ++i) {
-          Entry->Data.push_back(static_cast<uint8_t>(Data[i]));
-        }
+        uint8_t *Plain = Arena.Allocate<uint8_t>(Data.size());
+        std::copy(Data.begin(), Data.end(), Plain);
+        Entry->Data = ArrayRef<uint8_t>(Plain, Data.size());
         Entry->ID = static_cast<unsigned>(ConstantStringPool.size());
-        Constant *ZeroInit = Constant::getNullValue(CDS->getType());
-        GlobalVariable *DecGV = new GlobalVariable(M, CDS->getType(), false, GlobalValue::PrivateLinkage,
-                                                   ZeroInit, "dec" + Twine::utohexstr(Entry->ID) + GV.getName());
-        GlobalVariable *DecStatus = new GlobalVariable(M, Type::getInt32Ty(Ctx), false, GlobalValue::PrivateLinkage,
-                                                   Zero, "dec_status_" + Twine::utohexstr(Entry->ID) + GV.getName());
-        DecGV->setAlignment(MaybeAlign(GV.getAlignment()));
-        Entry->DecGV = DecGV;
-        Entry->DecStatus = DecStatus;
+        Entry->GV = &GV;
+        if (SharedDecrypt || EagerDecrypt) {
+          // decrypted strings share one buffer, laid out at their own alignment
+          uint64_t A = std::max<uint64_t>(GV.getAlignment(), 1);
+          PoolSize = alignTo(PoolSize, A);
+          PoolAlign = std::max(PoolAlign, A);
+          Entry->DecOffset = static_cast<unsigned>(PoolSize);
+          PoolSize += Data.size();
+        } else {
+          Constant *ZeroInit = Constant::getNullValue(CDS->getType());
+          GlobalVariable *DecGV = new GlobalVariable(M, CDS->getType(), false, GlobalValue::PrivateLinkage,
+                                                     ZeroInit, "dec" + Twine::utohexstr(Entry->ID) + GV.getName());
+          DecGV->setAlignment(MaybeAlign(GV.getAlignment()));
+          Entry->DecGV = DecGV;
+          Entry->DecPtr = DecGV;
+        }
         ConstantStringPool.push_back(Entry);
-        CSPEntryMap[&GV] = Entry;
+        EncryptedGlobals[&GV].Entry = Entry;
         collectConstantStringUser(&GV, ConstantStringUsers);
       }
     }
   }
 
-  // encrypt those strings, build corresponding decrypt function
-  for (CSPEntry *Entry: ConstantStringPool) {
-    getRandomBytes(Entry->EncKey, 16, 32);
-    for (unsigned i = 0; i < Entry->Data.size(); ++i) {
-      Entry->Data[i] ^= Entry->EncKey[i % Entry->EncKey.size()];
+  if ((SharedDecrypt || EagerDecrypt) && !ConstantStringPool.empty()) {
+    ArrayType *PoolTy = ArrayType::get(Type::getInt8Ty(Ctx), PoolSize);
+    DecryptedStringPool = new GlobalVariable(M, PoolTy, false, GlobalValue::PrivateLinkage,
+                                             ConstantAggregateZero::get(PoolTy), "DecryptedStringPool");
+    DecryptedStringPool->setAlignment(Align(PoolAlign));
+    for (CSPEntry *Entry : ConstantStringPool) {
+      Entry->DecPtr = ConstantExpr::getInBoundsGetElementPtr(
+          Type::getInt8Ty(Ctx), DecryptedStringPool,
+          ConstantInt::get(Type::getInt64Ty(Ctx), Entry->DecOffset));
     }
-    Entry->DecFunc = buildDecryptFunction(&M, Entry);
   }
 
-  // build initialization function for supported constant string users
+  if (EagerDecrypt) {
+    return runEager(M, Funcs, ConstantStringUsers, static_cast<uint32_t>(PoolSize));
+  }
+
+  // one decrypted copy per supported constant string user, every user known
+  // before any initializer is built: one may initialize another
   for (GlobalVariable *GV: ConstantStringUsers) {
     if (isValidToEncrypt(GV)) {
       Type *EltType = GV->getValueType();
@@ -152,90 +261,323 @@ bool StringEncryption::runOnModule(Module &M) {
       GlobalVariable *DecGV = new GlobalVariable(M, EltType, false, GlobalValue::PrivateLinkage,
                                                  ZeroInit, "dec_" + GV->getName());
       DecGV->setAlignment(MaybeAlign(GV->getAlignment()));
-      GlobalVariable *DecStatus = new GlobalVariable(M, Type::getInt32Ty(Ctx), false, GlobalValue::PrivateLinkage,
-          Zero, "dec_status_" + GV->getName());
-      CSUser *User = new CSUser(EltType, GV, DecGV);
-      User->DecStatus = DecStatus;
-      User->InitFunc = buildInitFunction(&M, User);
-      CSUserMap[GV] = User;
+      CSUser *User = new (Arena.Allocate<CSUser>()) CSUser(EltType, GV, DecGV);
+      CSUsers.push_back(User);
+      EncryptedGlobals[GV].User = User;
     }
   }
+  groupConstantStringUsers();
+
+  // one status slot per constant string, then one per group of users
+  unsigned NumSlots = static_cast<unsigned>(ConstantStringPool.size());
+  for (SmallVector<CSUser *, 1> &Group : InitGroups) {
+    Function *InitFunc = createInitFunction(&M, Group.front());
+    for (CSUser *User : Group) {
+      User->Slot = NumSlots;
+      User->InitFunc = InitFunc;
+    }
+    ++NumSlots;
+  }
+  if (NumSlots) {
+    createStatusBitmap(M, NumSlots);
+  }
 
   // emit the constant string pool
   // | junk bytes | key 1 | encrypted string 1 | junk bytes | key 2 | encrypted string 2 | ...
-  std::vector<uint8_t> Data;
-  std::vector<uint8_t> JunkBytes;
-
-  JunkBytes.reserve(32);
-  for (CSPEntry *Entry: ConstantStringPool) {
-    JunkBytes.clear();
-    getRandomBytes(JunkBytes, 16, 32);
-    Data.insert(Data.end(), JunkBytes.begin(), JunkBytes.end());
-    Entry->Offset = static_cast<unsigned>(Data.size());
-    Data.insert(Data.end(), Entry->EncKey.begin(), Entry->EncKey.end());
-    Data.insert(Data.end(), Entry->Data.begin(), Entry->Data.end());
+  // Junk lengths, junk and keys come out of two bulk random draws, then
+  // every string is encrypted in place with the key in front of it.
+  std::vector<uint8_t> Data(ConstantStringPool.size());
+  getRandomBytes(Data);
+  size_t TableSize = 0;
+  for (unsigned i = 0; i < ConstantStringPool.size(); ++i) {
+    CSPEntry *Entry = ConstantStringPool[i];
+    TableSize += 16 + Data[i] % 16;
+    Entry->Offset = static_cast<unsigned>(TableSize);
+    TableSize += DecryptStride + Entry->Data.size();
+  }
+  Data.resize(TableSize);
+  getRandomBytes(Data);
+  for (CSPEntry *Entry : ConstantStringPool) {
+    const uint8_t *Key = &Data[Entry->Offset];
+    uint8_t *EncString = &Data[Entry->Offset + DecryptStride];
+    for (unsigned i = 0; i < Entry->Data.size(); ++i) {
+      EncString[i] = Entry->Data[i] ^ Key[i % DecryptStride];
+    }
   }
 
   Constant *CDA = ConstantDataArray::get(M.getContext(), ArrayRef<uint8_t>(Data));
   EncryptedStringTable = new GlobalVariable(M, CDA->getType(), true, GlobalValue::PrivateLinkage,
                                             CDA, "EncryptedStringTable");
 
-  // decrypt string back at every use, change the plain string use to the decrypted one
-  bool Changed = false;
-  for (Function &F:M) {
-    if (F.isDeclaration())
-      continue;
-    Changed |= processConstantStringUse(&F);
+  // build corresponding decrypt function
+  if (DecryptedStringPool) {
+    SharedDecFunc = buildSharedDecryptFunction(&M);
+  } else {
+    for (CSPEntry *Entry : ConstantStringPool) {
+      Entry->DecFunc = buildDecryptFunction(&M, Entry);
+    }
   }
 
-  for (auto &I : CSUserMap) {
-    CSUser *User = I.second;
-    Changed |= processConstantStringUse(User->InitFunc);
+  // build initialization function for supported constant string users
+  for (SmallVector<CSUser *, 1> &Group : InitGroups) {
+    buildInitFunction(Group);
   }
 
-  // delete unused global variables
-  deleteUnusedGlobalVariable();
+  // decrypt string back at every use, change the plain string use to the decrypted one
+  bool Changed = !InitGroups.empty();
+  for (Function *F : Funcs) {
+    Changed |= processConstantStringUse(F);
+  }
+
+  if (SharedDecFunc && SharedDecFunc->use_empty()) {
+    SharedDecFunc->eraseFromParent();
+    SharedDecFunc = nullptr;
+    MaybeDeadGlobalVars.insert(DecryptedStringPool);
+    MaybeDeadGlobalVars.insert(StringDescriptorTable);
+  }
   for (CSPEntry *Entry: ConstantStringPool) {
-    if (Entry->DecFunc->use_empty()) {
+    if (Entry->DecFunc && Entry->DecFunc->use_empty()) {
       Entry->DecFunc->eraseFromParent();
+      Entry->DecFunc = nullptr;
     }
   }
+  if (DecryptStatusBitmap) {
+    MaybeDeadGlobalVars.insert(DecryptStatusBitmap);
+  }
+  recordStringTable(M);
+
+  // delete unused global variables
+  deleteUnusedGlobalVariable();
   return Changed;
 }
 
-void StringEncryption::getRandomBytes(std::vector<uint8_t> &Bytes, uint32_t MinSize, uint32_t MaxSize) {
-  uint32_t N = RandomEngine.get_uint32_t();
-  uint32_t Len;
+bool StringEncryption::runEager(Module &M, ArrayRef<Function *> Funcs,
+                                const SetVector<GlobalVariable *> &ConstantStringUsers,
+                                uint32_t PoolSize) {
+  if (!DecryptedStringPool) {
+    return false;
+  }
+
+  // constant string users, mutable ones too, just point into the pool, it is
+  // decrypted before any of them can be read. llvm.used and the like must
+  // keep naming the globals themselves
+  ValueToValueMapTy VMap;
+  for (CSPEntry *Entry : ConstantStringPool) {
+    VMap[Entry->GV] = Entry->DecPtr;
+  }
+  for (GlobalVariable *GV : ConstantStringUsers) {
+    if (GV->hasInitializer() && !GV->getName().starts_with("llvm.") &&
+        !EncryptedGlobals.count(GV)) {
+      GV->setInitializer(MapValue(GV->getInitializer(), VMap, RF_NoModuleLevelChanges));
+    }
+  }
 
-  assert(MaxSize >= MinSize);
+  bool Changed = false;
+  for (Function *F : Funcs) {
+    Changed |= processConstantStringUse(F);
+  }
+  for (CSPEntry *Entry : ConstantStringPool) {
+    MaybeDeadGlobalVars.insert(Entry->GV);
+  }
+  deleteUnusedGlobalVariable();
 
-  if (MinSize == MaxSize) {
-    Len = MinSize;
-  } else {
-    Len = MinSize + (N % (MaxSize - MinSize));
+  if (DecryptedStringPool->use_empty()) {
+    DecryptedStringPool->eraseFromParent();
+    DecryptedStringPool = nullptr;
+    return Changed;
   }
 
-  char *Buffer = new char[Len];
-  RandomEngine.get_bytes(Buffer, Len);
-  for (uint32_t i = 0; i < Len; ++i) {
-    Bytes.push_back(static_cast<uint8_t>(Buffer[i]));
+  // | key | pool image encrypted with key |
+  // Alignment padding in the image is random, so it does not expose the key.
+  std::vector<uint8_t> Data(DecryptStride + PoolSize);
+  getRandomBytes(Data);
+  for (CSPEntry *Entry : ConstantStringPool) {
+    std::copy(Entry->Data.begin(), Entry->Data.end(),
+              Data.begin() + DecryptStride + Entry->DecOffset);
+  }
+  for (uint32_t i = 0; i < PoolSize; ++i) {
+    Data[DecryptStride + i] ^= Data[i % DecryptStride];
   }
+  Constant *CDA = ConstantDataArray::get(M.getContext(), ArrayRef<uint8_t>(Data));
+  EncryptedStringTable = new GlobalVariable(M, CDA->getType(), true, GlobalValue::PrivateLinkage,
+                                            CDA, "EncryptedStringTable");
+
+  // Priority 0 runs ahead of user constructors, which may already use strings.
+  appendToGlobalCtors(M, buildEagerDecryptFunction(&M, PoolSize), 0);
+  return true;
+}
 
-  delete[] Buffer;
+void StringEncryption::getRandomBytes(MutableArrayRef<uint8_t> Bytes) {
+  if (!Bytes.empty()) {
+    RandomEngine.get_bytes(reinterpret_cast<char *>(Bytes.data()),
+                           static_cast<int>(Bytes.size()));
+  }
+}
+
+//
+// !goron.strings = !{..., !{table, bitmap, shared decrypt, descriptors, strings...}}
+// string: !{i32 key offset, i32 length, i32 align, i32 id, decrypt, plain ptr}
+//
+// One node per module, for LinkConsolidation to merge the tables and the
+// identical strings of every module after llvm-link. Only strings with a
+// live decrypt call are listed; globals deleted afterwards turn into null.
+void StringEncryption::recordStringTable(Module &M) {
+  LLVMContext &Ctx = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  auto getMD = [](Constant *C) -> Metadata * {
+    return C ? ConstantAsMetadata::get(C) : nullptr;
+  };
+  auto getIntMD = [&](uint64_t V) -> Metadata * {
+    return ConstantAsMetadata::get(ConstantInt::get(Int32Ty, V));
+  };
+
+  SmallVector<Metadata *, 16> Ops = {getMD(EncryptedStringTable), getMD(DecryptStatusBitmap),
+                                     getMD(SharedDecFunc),
+                                     getMD(SharedDecFunc ? StringDescriptorTable : nullptr)};
+  for (const CSPEntry *Entry : ConstantStringPool) {
+    if (!SharedDecFunc && !Entry->DecFunc) {
+      continue;
+    }
+    Ops.push_back(MDNode::get(Ctx, {getIntMD(Entry->Offset), getIntMD(Entry->Data.size()),
+                                    getIntMD(Entry->GV->getAlign().valueOrOne().value()),
+                                    getIntMD(Entry->ID), getMD(Entry->DecFunc),
+                                    getMD(Entry->DecPtr)}));
+  }
+  if (Ops.size() > 4) {
+    M.getOrInsertNamedMetadata(StringTableMDName)->addOperand(MDNode::get(Ctx, Ops));
+  }
 }
 
 //
 //static void goron_decrypt_string(uint8_t *plain_string, const uint8_t *data)
 //{
 //  const uint8_t *key = data;
-//  uint32_t key_size = 1234;
-//  uint8_t *es = (uint8_t *) &data[key_size];
+//  uint8_t *es = (uint8_t *) &data[32];
 //  uint32_t i;
-//  for (i = 0;i < 5678;i ++) {
-//    plain_string[i] = es[i] ^ key[i % key_size];
+//  for (i = 0;i < (5678 & ~31);i += 32) {
+//    *(v32u8 *) &plain_string[i] = *(v32u8 *) &es[i] ^ *(v32u8 *) key;
+//  }
+//  for (;i < 5678;i ++) {
+//    plain_string[i] = es[i] ^ key[i & 31];
 //  }
 //}
 
+void StringEncryption::emitDecryptLoop(IRBuilder<> &IRB, Value *Key, Value *EncPtr,
+                                       Value *PlainString, Value *Length, BasicBlock *Done) {
+  LLVMContext &Ctx = IRB.getContext();
+  Function *F = IRB.GetInsertBlock()->getParent();
+  Type *Int8Ty = IRB.getInt8Ty();
+  Type *Int32Ty = IRB.getInt32Ty();
+  FixedVectorType *VecTy = FixedVectorType::get(Int8Ty, DecryptStride);
+
+  BasicBlock *Entry = IRB.GetInsertBlock();
+  BasicBlock *VecBody = BasicBlock::Create(Ctx, "VecBody", F, Done);
+  BasicBlock *TailCheck = BasicBlock::Create(Ctx, "TailCheck", F, Done);
+  BasicBlock *TailBody = BasicBlock::Create(Ctx, "TailBody", F, Done);
+
+  Value *VecEnd = IRB.CreateAnd(Length, IRB.getInt32(~(DecryptStride - 1)));
+  Value *KeyVec = IRB.CreateAlignedLoad(VecTy, Key, MaybeAlign(1));
+  IRB.CreateCondBr(IRB.CreateICmpEQ(VecEnd, IRB.getInt32(0)), TailCheck, VecBody);
+
+  IRB.SetInsertPoint(VecBody);
+  PHINode *VecCounter = IRB.CreatePHI(Int32Ty, 2);
+  VecCounter->addIncoming(IRB.getInt32(0), Entry);
+  Value *EncVec = IRB.CreateAlignedLoad(
+      VecTy, IRB.CreateInBoundsGEP(Int8Ty, EncPtr, VecCounter), MaybeAlign(1));
+  IRB.CreateAlignedStore(IRB.CreateXor(EncVec, KeyVec),
+                         IRB.CreateInBoundsGEP(Int8Ty, PlainString, VecCounter),
+                         MaybeAlign(1));
+  Value *NewVecCounter = IRB.CreateAdd(VecCounter, IRB.getInt32(DecryptStride), "", true, true);
+  VecCounter->addIncoming(NewVecCounter, VecBody);
+  IRB.CreateCondBr(IRB.CreateICmpEQ(NewVecCounter, VecEnd), TailCheck, VecBody);
+
+  IRB.SetInsertPoint(TailCheck);
+  IRB.CreateCondBr(IRB.CreateICmpEQ(VecEnd, Length), Done, TailBody);
+
+  IRB.SetInsertPoint(TailBody);
+  PHINode *LoopCounter = IRB.CreatePHI(Int32Ty, 2);
+  LoopCounter->addIncoming(VecEnd, TailCheck);
+  Value *EncChar = IRB.CreateLoad(Int8Ty,
+      IRB.CreateInBoundsGEP(Int8Ty, EncPtr, LoopCounter));
+  Value *KeyIdx = IRB.CreateAnd(LoopCounter, IRB.getInt32(DecryptStride - 1));
+  Value *KeyChar = IRB.CreateLoad(Int8Ty,
+      IRB.CreateInBoundsGEP(Int8Ty, Key, KeyIdx));
+  IRB.CreateStore(IRB.CreateXor(EncChar, KeyChar),
+                  IRB.CreateInBoundsGEP(Int8Ty, PlainString, LoopCounter));
+  Value *NewCounter = IRB.CreateAdd(LoopCounter, IRB.getInt32(1), "", true, true);
+  LoopCounter->addIncoming(NewCounter, TailBody);
+  IRB.CreateCondBr(IRB.CreateICmpEQ(NewCounter, Length), Done, TailBody);
+}
+
+void StringEncryption::createStatusBitmap(Module &M, unsigned NumSlots) {
+  // whole cache lines of its own, so the words that are read on every
+  // decrypt call never share a line with data that is written
+  unsigned NumWords = alignTo(divideCeil(NumSlots, StatusSlotsPerWord),
+                              CacheLineSize / sizeof(uint32_t));
+  ArrayType *BitmapTy = ArrayType::get(Type::getInt32Ty(M.getContext()), NumWords);
+  DecryptStatusBitmap = new GlobalVariable(M, BitmapTy, false, GlobalValue::PrivateLinkage,
+                                           ConstantAggregateZero::get(BitmapTy), "DecryptStatusBitmap");
+  DecryptStatusBitmap->setAlignment(Align(CacheLineSize));
+}
+
+//
+// Once-only initialization of a status slot:
+//
+//  word = &bitmap[slot / 16]; done = 1 << (slot % 16 * 2); busy = done << 1;
+//  if (load_acquire(word) & done) goto exit;
+//  if (fetch_or(word, busy) & busy) {
+//    while (!(load_acquire(word) & done)) { pause(); }
+//    goto exit;
+//  }
+//  decrypt: ...
+//  fetch_or_release(word, done);
+//
+// The fast path is a single acquire load, a plain load on x86 and ARM64.
+// The first caller to set the busy bit decrypts; concurrent callers spin
+// until it publishes, so nobody can read a half-written buffer. pause (x86)
+// or yield (ARM64) keeps the spin from starving the thread that decrypts
+// when both share a core.
+// Emits the checks at the insert point, continues in Decrypt for the caller
+// that owns the slot and returns the word pointer to publish DoneBit to.
+Value *StringEncryption::emitStatusCheck(IRBuilder<> &IRB, Value *Slot, BasicBlock *Decrypt,
+                                         BasicBlock *Exit, Value *&DoneBit) {
+  LLVMContext &Ctx = IRB.getContext();
+  Function *F = IRB.GetInsertBlock()->getParent();
+  Type *Int32Ty = IRB.getInt32Ty();
+  BasicBlock *Claim = BasicBlock::Create(Ctx, "Claim", F, Decrypt);
+  BasicBlock *Wait = BasicBlock::Create(Ctx, "Wait", F, Decrypt);
+
+  Value *Word = IRB.CreateInBoundsGEP(
+      DecryptStatusBitmap->getValueType(), DecryptStatusBitmap,
+      {IRB.getInt32(0), IRB.CreateLShr(Slot, Log2_32(StatusSlotsPerWord))});
+  Value *Shift = IRB.CreateShl(IRB.CreateAnd(Slot, StatusSlotsPerWord - 1), 1);
+  DoneBit = IRB.CreateShl(IRB.getInt32(1), Shift);
+  Value *BusyBit = IRB.CreateShl(IRB.getInt32(2), Shift);
+
+  LoadInst *Status = IRB.CreateAlignedLoad(Int32Ty, Word, Align(4));
+  Status->setAtomic(AtomicOrdering::Acquire);
+  IRB.CreateCondBr(IRB.CreateIsNotNull(IRB.CreateAnd(Status, DoneBit)), Exit, Claim);
+
+  IRB.SetInsertPoint(Claim);
+  Value *Old = IRB.CreateAtomicRMW(AtomicRMWInst::Or, Word, BusyBit, Align(4),
+                                   AtomicOrdering::Acquire);
+  IRB.CreateCondBr(IRB.CreateIsNotNull(IRB.CreateAnd(Old, BusyBit)), Wait, Decrypt);
+
+  IRB.SetInsertPoint(Wait);
+  Triple TT(F->getParent()->getTargetTriple());
+  if (TT.isX86()) {
+    IRB.CreateIntrinsic(Intrinsic::x86_sse2_pause, {}, {});
+  } else if (TT.isAArch64()) {
+    IRB.CreateIntrinsic(Intrinsic::aarch64_hint, {}, {IRB.getInt32(1)}); // yield
+  }
+  Status = IRB.CreateAlignedLoad(Int32Ty, Word, Align(4));
+  Status->setAtomic(AtomicOrdering::Acquire);
+  IRB.CreateCondBr(IRB.CreateIsNotNull(IRB.CreateAnd(Status, DoneBit)), Exit, Wait);
+
+  IRB.SetInsertPoint(Decrypt);
+  return Word;
+}
+
 Function *StringEncryption::buildDecryptFunction(Module *M, const StringEncryption::CSPEntry *Entry) {
   LLVMContext &Ctx = M->getContext();
   IRBuilder<> IRB(Ctx);
@@ -258,44 +600,88 @@ Function *StringEncryption::buildDecryptFunction(Module *M, const StringEncrypti
   Data->addAttr(Attribute::ReadOnly);
 
   BasicBlock *Enter = BasicBlock::Create(Ctx, "Enter", DecFunc);
-  BasicBlock *LoopBody = BasicBlock::Create(Ctx, "LoopBody", DecFunc);
+  BasicBlock *Decrypt = BasicBlock::Create(Ctx, "Decrypt", DecFunc);
   BasicBlock *UpdateDecStatus = BasicBlock::Create(Ctx, "UpdateDecStatus", DecFunc);
   BasicBlock *Exit = BasicBlock::Create(Ctx, "Exit", DecFunc);
 
   IRB.SetInsertPoint(Enter);
-  ConstantInt *KeySize = ConstantInt::get(Type::getInt32Ty(Ctx), Entry->EncKey.size());
-  Value *EncPtr = IRB.CreateInBoundsGEP(IRB.getInt8Ty(), Data, KeySize);
-  Value *DecStatus = IRB.CreateLoad(
-      Entry->DecStatus->getValueType(), Entry->DecStatus);
-  Value *IsDecrypted = IRB.CreateICmpEQ(DecStatus, IRB.getInt32(1));
-  IRB.CreateCondBr(IsDecrypted, Exit, LoopBody);
-
-  IRB.SetInsertPoint(LoopBody);
-  PHINode *LoopCounter = IRB.CreatePHI(IRB.getInt32Ty(), 2);
-  LoopCounter->addIncoming(IRB.getInt32(0), Enter);
-
-  Value *EncCharPtr =
-      IRB.CreateInBoundsGEP(IRB.getInt8Ty(), EncPtr,
-      LoopCounter);
-  Value *EncChar = IRB.CreateLoad(IRB.getInt8Ty(), EncCharPtr);
-  Value *KeyIdx = IRB.CreateURem(LoopCounter, KeySize);
-
-  Value *KeyCharPtr = IRB.CreateInBoundsGEP(IRB.getInt8Ty(), Data, KeyIdx);
-  Value *KeyChar = IRB.CreateLoad(IRB.getInt8Ty(), KeyCharPtr);
-
-  Value *DecChar = IRB.CreateXor(EncChar, KeyChar);
-  Value *DecCharPtr = IRB.CreateInBoundsGEP(IRB.getInt8Ty(),
-      PlainString, LoopCounter);
-  IRB.CreateStore(DecChar, DecCharPtr);
+  Value *DoneBit;
+  Value *StatusWord = emitStatusCheck(IRB, IRB.getInt32(Entry->ID), Decrypt, Exit, DoneBit);
+  Value *EncPtr = IRB.CreateInBoundsGEP(IRB.getInt8Ty(), Data, IRB.getInt32(DecryptStride));
+  emitDecryptLoop(IRB, Data, EncPtr, PlainString,
+                  IRB.getInt32(static_cast<uint32_t>(Entry->Data.size())), UpdateDecStatus);
 
-  Value *NewCounter = IRB.CreateAdd(LoopCounter, IRB.getInt32(1), "", true, true);
-  LoopCounter->addIncoming(NewCounter, LoopBody);
+  IRB.SetInsertPoint(UpdateDecStatus);
+  IRB.CreateAtomicRMW(AtomicRMWInst::Or, StatusWord, DoneBit, Align(4),
+                      AtomicOrdering::Release);
+  IRB.CreateBr(Exit);
 
-  Value *Cond = IRB.CreateICmpEQ(NewCounter, IRB.getInt32(static_cast<uint32_t>(Entry->Data.size())));
-  IRB.CreateCondBr(Cond, UpdateDecStatus, LoopBody);
+  IRB.SetInsertPoint(Exit);
+  IRB.CreateRetVoid();
+
+  return DecFunc;
+}
+
+//
+//static void goron_decrypt_string(uint32_t id)
+//{
+//  ... once-only check on status slot id, see emitStatusCheck ...
+//  const uint8_t *key = &data[desc[id].key_offset];
+//  uint8_t *es = (uint8_t *) &key[32];
+//  uint8_t *plain_string = &pool[desc[id].dec_offset];
+//  ... same loops as goron_decrypt_string_N, up to desc[id].length ...
+//  ... publish status slot id ...
+//}
+
+Function *StringEncryption::buildSharedDecryptFunction(Module *M) {
+  LLVMContext &Ctx = M->getContext();
+  IRBuilder<> IRB(Ctx);
+  Type *Int32Ty = IRB.getInt32Ty();
+
+  // { key offset in EncryptedStringTable, length, offset in DecryptedStringPool }
+  StructType *DescTy = StructType::get(Ctx, {Int32Ty, Int32Ty, Int32Ty});
+  std::vector<Constant *> Descs;
+  Descs.reserve(ConstantStringPool.size());
+  for (const CSPEntry *Entry : ConstantStringPool) {
+    Descs.push_back(ConstantStruct::get(
+        DescTy, {IRB.getInt32(Entry->Offset),
+                 IRB.getInt32(static_cast<uint32_t>(Entry->Data.size())),
+                 IRB.getInt32(Entry->DecOffset)}));
+  }
+  ArrayType *DescTableTy = ArrayType::get(DescTy, Descs.size());
+  StringDescriptorTable = new GlobalVariable(*M, DescTableTy, true, GlobalValue::PrivateLinkage,
+                                             ConstantArray::get(DescTableTy, Descs), "StringDescriptorTable");
+
+  FunctionType *FuncTy = FunctionType::get(Type::getVoidTy(Ctx), {Int32Ty}, false);
+  Function *DecFunc =
+      Function::Create(FuncTy, GlobalValue::PrivateLinkage, "goron_decrypt_string", M);
+  // With a constant id every descriptor load folds, so the inliner would
+  // copy the loop back into each call site.
+  DecFunc->addFnAttr(Attribute::NoInline);
+  Argument *Id = DecFunc->arg_begin();
+  Id->setName("id");
+
+  BasicBlock *Enter = BasicBlock::Create(Ctx, "Enter", DecFunc);
+  BasicBlock *Decrypt = BasicBlock::Create(Ctx, "Decrypt", DecFunc);
+  BasicBlock *UpdateDecStatus = BasicBlock::Create(Ctx, "UpdateDecStatus", DecFunc);
+  BasicBlock *Exit = BasicBlock::Create(Ctx, "Exit", DecFunc);
+
+  IRB.SetInsertPoint(Enter);
+  Value *DoneBit;
+  Value *StatusWord = emitStatusCheck(IRB, Id, Decrypt, Exit, DoneBit);
+  Value *DescPtr = IRB.CreateInBoundsGEP(DescTableTy, StringDescriptorTable,
+                                         {IRB.getInt32(0), Id});
+  Value *KeyOffset = IRB.CreateLoad(Int32Ty, IRB.CreateStructGEP(DescTy, DescPtr, 0));
+  Value *Length = IRB.CreateLoad(Int32Ty, IRB.CreateStructGEP(DescTy, DescPtr, 1));
+  Value *DecOffset = IRB.CreateLoad(Int32Ty, IRB.CreateStructGEP(DescTy, DescPtr, 2));
+  Value *Key = IRB.CreateInBoundsGEP(IRB.getInt8Ty(), EncryptedStringTable, KeyOffset);
+  Value *EncPtr = IRB.CreateInBoundsGEP(IRB.getInt8Ty(), Key, IRB.getInt32(DecryptStride));
+  Value *PlainString = IRB.CreateInBoundsGEP(IRB.getInt8Ty(), DecryptedStringPool, DecOffset);
+  emitDecryptLoop(IRB, Key, EncPtr, PlainString, Length, UpdateDecStatus);
 
   IRB.SetInsertPoint(UpdateDecStatus);
-  IRB.CreateStore(IRB.getInt32(1), Entry->DecStatus);
+  IRB.CreateAtomicRMW(AtomicRMWInst::Or, StatusWord, DoneBit, Align(4),
+                      AtomicOrdering::Release);
   IRB.CreateBr(Exit);
 
   IRB.SetInsertPoint(Exit);
@@ -304,9 +690,44 @@ Function *StringEncryption::buildDecryptFunction(Module *M, const StringEncrypti
   return DecFunc;
 }
 
-Function *StringEncryption::buildInitFunction(Module *M, const StringEncryption::CSUser *User) {
+Function *StringEncryption::buildEagerDecryptFunction(Module *M, uint32_t PoolSize) {
   LLVMContext &Ctx = M->getContext();
   IRBuilder<> IRB(Ctx);
+  FunctionType *FuncTy = FunctionType::get(Type::getVoidTy(Ctx), false);
+  Function *DecFunc =
+      Function::Create(FuncTy, GlobalValue::PrivateLinkage, "goron_decrypt_strings", M);
+
+  BasicBlock *Enter = BasicBlock::Create(Ctx, "Enter", DecFunc);
+  BasicBlock *Exit = BasicBlock::Create(Ctx, "Exit", DecFunc);
+
+  IRB.SetInsertPoint(Enter);
+  Value *EncPtr = IRB.CreateInBoundsGEP(IRB.getInt8Ty(), EncryptedStringTable,
+                                        IRB.getInt32(DecryptStride));
+  emitDecryptLoop(IRB, EncryptedStringTable, EncPtr, DecryptedStringPool,
+                  IRB.getInt32(PoolSize), Exit);
+
+  IRB.SetInsertPoint(Exit);
+  IRB.CreateRetVoid();
+  return DecFunc;
+}
+
+void StringEncryption::emitDecryptCall(IRBuilder<> &IRB, const CSPEntry *Entry) {
+  if (SharedDecFunc) {
+    IRB.CreateCall(SharedDecFunc, {IRB.getInt32(Entry->ID)});
+    return;
+  }
+
+  Value *OutBuf = IRB.CreateBitCast(Entry->DecGV,
+                                    PointerType::getUnqual(IRB.getContext()));
+  Value *Data = IRB.CreateInBoundsGEP(
+      EncryptedStringTable->getValueType(),
+      EncryptedStringTable,
+      {IRB.getInt32(0), IRB.getInt32(Entry->Offset)});
+  IRB.CreateCall(Entry->DecFunc, {OutBuf, Data});
+}
+
+Function *StringEncryption::createInitFunction(Module *M, const StringEncryption::CSUser *User) {
+  LLVMContext &Ctx = M->getContext();
   FunctionType *FuncTy = FunctionType::get(Type::getVoidTy(Ctx), {User->DecGV->getType()}, false);
   Function *InitFunc =
       Function::Create(FuncTy, GlobalValue::PrivateLinkage, "__global_variable_initializer_" + User->GV->getName(), M);
@@ -316,6 +737,131 @@ Function *StringEncryption::buildInitFunction(Module *M, const StringEncryption:
 
   thiz->setName("this");
   thiz->addAttr(Attribute::NoCapture);
+  return InitFunc;
+}
+
+// Tarjan's algorithm over the references between constant string users, with
+// an explicit stack: reference chains can be as long as a linked list.
+void StringEncryption::groupConstantStringUsers() {
+  unsigned NumUsers = static_cast<unsigned>(CSUsers.size());
+  DenseMap<CSUser *, unsigned> Index;
+  std::vector<SmallVector<unsigned, 2>> Refs(NumUsers);
+  for (unsigned i = 0; i < NumUsers; ++i) {
+    Index[CSUsers[i]] = i;
+  }
+  for (unsigned i = 0; i < NumUsers; ++i) {
+    SmallPtrSet<Constant *, 16> Visited;
+    SmallVector<Constant *, 16> ToVisit{CSUsers[i]->GV->getInitializer()};
+    while (!ToVisit.empty()) {
+      Constant *C = ToVisit.pop_back_val();
+      if (!Visited.insert(C).second) {
+        continue;
+      }
+      if (auto *GV = dyn_cast<GlobalVariable>(C)) {
+        auto Iter = EncryptedGlobals.find(GV);
+        if (Iter != EncryptedGlobals.end() && Iter->second.User) {
+          Refs[i].push_back(Index[Iter->second.User]);
+        }
+        continue;
+      }
+      if (!isa<GlobalValue>(C)) {
+        for (Value *Op : C->operands()) {
+          ToVisit.push_back(cast<Constant>(Op));
+        }
+      }
+    }
+  }
+
+  const unsigned Unvisited = ~0U;
+  std::vector<unsigned> Order(NumUsers, Unvisited), LowLink(NumUsers);
+  std::vector<bool> OnStack(NumUsers);
+  std::vector<unsigned> Stack;
+  std::vector<std::pair<unsigned, unsigned>> Path; // user, next reference
+  unsigned NextOrder = 0;
+  auto Visit = [&](unsigned V) {
+    Order[V] = LowLink[V] = NextOrder++;
+    Stack.push_back(V);
+    OnStack[V] = true;
+    Path.push_back({V, 0});
+  };
+  for (unsigned Root = 0; Root < NumUsers; ++Root) {
+    if (Order[Root] != Unvisited) {
+      continue;
+    }
+    Visit(Root);
+    while (!Path.empty()) {
+      unsigned V = Path.back().first;
+      unsigned &Next = Path.back().second;
+      if (Next < Refs[V].size()) {
+        unsigned W = Refs[V][Next++];
+        if (Order[W] == Unvisited) {
+          Visit(W);
+        } else if (OnStack[W]) {
+          LowLink[V] = std::min(LowLink[V], Order[W]);
+        }
+        continue;
+      }
+      Path.pop_back();
+      if (!Path.empty()) {
+        unsigned Parent = Path.back().first;
+        LowLink[Parent] = std::min(LowLink[Parent], LowLink[V]);
+      }
+      if (LowLink[V] != Order[V]) {
+        continue;
+      }
+      SmallVector<CSUser *, 1> Group;
+      unsigned W;
+      do {
+        W = Stack.back();
+        Stack.pop_back();
+        OnStack[W] = false;
+        Group.push_back(CSUsers[W]);
+      } while (W != V);
+      std::reverse(Group.begin(), Group.end());
+      InitGroups.push_back(std::move(Group));
+    }
+  }
+}
+
+// Decrypts or initializes, once, every encrypted global C refers to that
+// VMap does not map yet, and maps it to its decrypted counterpart.
+void StringEncryption::mapEncryptedGlobals(Constant *C, IRBuilder<> &IRB,
+                                           ValueToValueMapTy &VMap) {
+  SmallPtrSet<Constant *, 16> Visited;
+  SmallVector<Constant *, 16> ToVisit{C};
+  while (!ToVisit.empty()) {
+    C = ToVisit.pop_back_val();
+    if (!Visited.insert(C).second) {
+      continue;
+    }
+    auto *GV = dyn_cast<GlobalVariable>(C);
+    if (!GV) {
+      if (!isa<GlobalValue>(C)) {
+        for (Value *Op : C->operands()) {
+          ToVisit.push_back(cast<Constant>(Op));
+        }
+      }
+      continue;
+    }
+    auto Iter = EncryptedGlobals.find(GV);
+    if (Iter == EncryptedGlobals.end() || VMap.count(GV)) {
+      continue;
+    }
+    if (CSUser *Other = Iter->second.User) {
+      IRB.CreateCall(Other->InitFunc, {Other->DecGV});
+      VMap[GV] = Other->DecGV;
+    } else {
+      emitDecryptCall(IRB, Iter->second.Entry);
+      VMap[GV] = Iter->second.Entry->DecPtr;
+    }
+    MaybeDeadGlobalVars.insert(GV);
+  }
+}
+
+void StringEncryption::buildInitFunction(ArrayRef<CSUser *> Group) {
+  Function *InitFunc = Group.front()->InitFunc;
+  LLVMContext &Ctx = InitFunc->getContext();
+  IRBuilder<> IRB(Ctx);
 
   // convert constant initializer into a series of instructions
   BasicBlock *Enter = BasicBlock::Create(Ctx, "Enter", InitFunc);
@@ -323,20 +869,209 @@ Function *StringEncryption::buildInitFunction(Module *M, const StringEncryption:
   BasicBlock *Exit = BasicBlock::Create(Ctx, "Exit", InitFunc);
 
   IRB.SetInsertPoint(Enter);
-  Value *DecStatus = IRB.CreateLoad(
-      User->DecStatus->getValueType(), User->DecStatus);
-  Value *IsDecrypted = IRB.CreateICmpEQ(DecStatus, IRB.getInt32(1));
-  IRB.CreateCondBr(IsDecrypted, Exit, InitBlock);
-
-  IRB.SetInsertPoint(InitBlock);
-  Constant *Init = User->GV->getInitializer();
-  lowerGlobalConstant(Init, IRB, User->DecGV, User->Ty);
-  IRB.CreateStore(IRB.getInt32(1), User->DecStatus);
+  Value *DoneBit;
+  Value *StatusWord = emitStatusCheck(IRB, IRB.getInt32(Group.front()->Slot), InitBlock, Exit,
+                                      DoneBit);
+
+  // the group is published as a whole, so its users refer to one another,
+  // and to themselves, without calling back into InitFunc
+  ValueToValueMapTy VMap;
+  for (CSUser *User : Group) {
+    VMap[User->GV] = User->DecGV;
+    MaybeDeadGlobalVars.insert(User->GV);
+  }
+  for (CSUser *User : Group) {
+    Constant *Init = User->GV->getInitializer();
+    std::vector<Fixup> Fixups;
+    unsigned NumElements = 0;
+    Constant *Template = splitGlobalConstant(Init, 0, InitFunc->getParent()->getDataLayout(),
+                                             Fixups, NumElements);
+    if (NumElements < MinTemplateElements) {
+      mapEncryptedGlobals(Init, IRB, VMap);
+      lowerGlobalConstant(MapValue(Init, VMap, RF_NoModuleLevelChanges), IRB, User->DecGV,
+                          User->Ty);
+    } else {
+      lowerGlobalConstantTemplate(Template, Fixups, IRB, User, VMap);
+    }
+  }
+  IRB.CreateAtomicRMW(AtomicRMWInst::Or, StatusWord, DoneBit, Align(4),
+                      AtomicOrdering::Release);
   IRB.CreateBr(Exit);
 
   IRB.SetInsertPoint(Exit);
   IRB.CreateRetVoid();
-  return InitFunc;
+}
+
+bool StringEncryption::refersToEncryptedGlobal(Constant *C) {
+  if (auto *GV = dyn_cast<GlobalVariable>(C)) {
+    return EncryptedGlobals.count(GV) > 0;
+  }
+  if (isa<ConstantExpr>(C) || isa<ConstantVector>(C)) {
+    for (Value *Op : C->operands()) {
+      if (refersToEncryptedGlobal(cast<Constant>(Op))) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Whether C is the address of a global defined in this module and not
+// preemptible, which a 32-bit offset from read-only data can reach.
+static bool isLocalAddress(Constant *C) {
+  if (auto *GV = dyn_cast<GlobalValue>(C)) {
+    return GV->hasLocalLinkage();
+  }
+  if (isa<ConstantExpr>(C)) {
+    for (Value *Op : C->operands()) {
+      if (!isLocalAddress(cast<Constant>(Op))) {
+        return false;
+      }
+    }
+    return true;
+  }
+  return isa<ConstantInt>(C) || isa<ConstantPointerNull>(C);
+}
+
+// Returns CV with every scalar that refers to an encrypted global, or that is
+// the address of a local global, replaced by null, and appends those scalars
+// to Fixups. Pointers to non-local globals are left in the template, which
+// then still needs a relocation for each of them. NumElements counts the
+// scalars.
+Constant *StringEncryption::splitGlobalConstant(Constant *CV, uint64_t Offset, const DataLayout &DL,
+                                                std::vector<Fixup> &Fixups, unsigned &NumElements) {
+  if (isa<ConstantArray>(CV) || isa<ConstantStruct>(CV)) {
+    const StructLayout *SL = nullptr;
+    uint64_t EltSize = 0;
+    if (StructType *STy = dyn_cast<StructType>(CV->getType())) {
+      SL = DL.getStructLayout(STy);
+    } else {
+      EltSize = DL.getTypeAllocSize(CV->getType()->getArrayElementType());
+    }
+    std::vector<Constant *> Elements;
+    Elements.reserve(CV->getNumOperands());
+    bool Split = false;
+    for (unsigned i = 0, e = CV->getNumOperands(); i != e; ++i) {
+      Constant *Op = cast<Constant>(CV->getOperand(i));
+      uint64_t OpOffset = Offset + (SL ? SL->getElementOffset(i) : EltSize * i);
+      Constant *NewOp = splitGlobalConstant(Op, OpOffset, DL, Fixups, NumElements);
+      Split |= NewOp != Op;
+      Elements.push_back(NewOp);
+    }
+    if (!Split) {
+      return CV;
+    }
+    if (StructType *STy = dyn_cast<StructType>(CV->getType())) {
+      return ConstantStruct::get(STy, Elements);
+    }
+    return ConstantArray::get(cast<ArrayType>(CV->getType()), Elements);
+  }
+
+  if (auto *CDS = dyn_cast<ConstantDataSequential>(CV)) {
+    NumElements += CDS->getNumElements();
+  } else {
+    ++NumElements;
+  }
+  bool LocalPointer = CV->getType()->isPointerTy() && CV->needsRelocation() && isLocalAddress(CV);
+  if (!LocalPointer && !refersToEncryptedGlobal(CV)) {
+    return CV;
+  }
+  Fixups.push_back({Offset, CV});
+  return Constant::getNullValue(CV->getType());
+}
+
+// DecGV = Template, then every fixup slot is written, with the encrypted
+// globals it refers to replaced by their decrypted counterparts, as mapped
+// by VMap or by mapEncryptedGlobals. Local
+// pointers are patched in a loop over a read-only table of
+// { i32 offset in DecGV, i32 target relative to the entry } pairs, so the
+// table needs no dynamic relocations either; anything else is stored on its
+// own.
+void StringEncryption::lowerGlobalConstantTemplate(Constant *Template, ArrayRef<Fixup> Fixups,
+                                                   IRBuilder<> &IRB, const CSUser *User,
+                                                   ValueToValueMapTy &VMap) {
+  Module *M = User->GV->getParent();
+  const DataLayout &DL = M->getDataLayout();
+  LLVMContext &Ctx = M->getContext();
+  Align DecAlign = User->DecGV->getPointerAlignment(DL);
+
+  // DecGV starts out zeroed, an all zero template has nothing to copy
+  if (!Template->isNullValue()) {
+    GlobalVariable *TemplateGV = new GlobalVariable(*M, Template->getType(), true, GlobalValue::PrivateLinkage,
+                                                    Template, "tpl_" + User->GV->getName());
+    TemplateGV->setAlignment(DecAlign);
+    TemplateGV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    IRB.CreateMemCpy(User->DecGV, DecAlign, TemplateGV, DecAlign,
+                     DL.getTypeAllocSize(User->Ty));
+  }
+
+  for (const Fixup &F : Fixups) {
+    mapEncryptedGlobals(F.Value, IRB, VMap);
+  }
+
+  std::vector<std::pair<uint64_t, Constant *>> Relative;
+  Align PtrAlign = DecAlign;
+  for (const Fixup &F : Fixups) {
+    Constant *V = ConstantFoldConstant(MapValue(F.Value, VMap, RF_NoModuleLevelChanges), DL);
+    if (V->getType()->isPointerTy() && isLocalAddress(V)) {
+      Relative.push_back({F.Offset, V});
+      PtrAlign = commonAlignment(PtrAlign, F.Offset);
+      continue;
+    }
+    Value *Ptr = IRB.CreateConstInBoundsGEP1_64(IRB.getInt8Ty(), User->DecGV, F.Offset);
+    IRB.CreateAlignedStore(V, Ptr, commonAlignment(DecAlign, F.Offset));
+  }
+  if (Relative.size() < MinFixupLoop) {
+    for (auto &R : Relative) {
+      Value *Ptr = IRB.CreateConstInBoundsGEP1_64(IRB.getInt8Ty(), User->DecGV, R.first);
+      IRB.CreateAlignedStore(R.second, Ptr, PtrAlign);
+    }
+    return;
+  }
+
+  Type *Int32Ty = IRB.getInt32Ty();
+  Type *IntPtrTy = DL.getIntPtrType(Ctx);
+  StructType *EntryTy = StructType::get(Int32Ty, Int32Ty);
+  ArrayType *TableTy = ArrayType::get(EntryTy, Relative.size());
+  GlobalVariable *FixupTable = new GlobalVariable(*M, TableTy, true, GlobalValue::PrivateLinkage,
+                                                  nullptr, "fixups_" + User->GV->getName());
+  FixupTable->setAlignment(Align(4));
+  std::vector<Constant *> Entries;
+  Entries.reserve(Relative.size());
+  for (unsigned i = 0; i < Relative.size(); ++i) {
+    Constant *Place = ConstantExpr::getInBoundsGetElementPtr(
+        TableTy, FixupTable,
+        ArrayRef<Constant *>{IRB.getInt32(0), IRB.getInt32(i), IRB.getInt32(1)});
+    Constant *Rel = ConstantExpr::getSub(ConstantExpr::getPtrToInt(Relative[i].second, IntPtrTy),
+                                         ConstantExpr::getPtrToInt(Place, IntPtrTy));
+    Entries.push_back(ConstantStruct::get(
+        EntryTy, {IRB.getInt32(static_cast<uint32_t>(Relative[i].first)),
+                  ConstantExpr::getTrunc(Rel, Int32Ty)}));
+  }
+  FixupTable->setInitializer(ConstantArray::get(TableTy, Entries));
+
+  Function *InitFunc = IRB.GetInsertBlock()->getParent();
+  BasicBlock *Preheader = IRB.GetInsertBlock();
+  BasicBlock *Body = BasicBlock::Create(Ctx, "Fixup", InitFunc);
+  BasicBlock *Done = BasicBlock::Create(Ctx, "FixupDone", InitFunc);
+  IRB.CreateBr(Body);
+
+  IRB.SetInsertPoint(Body);
+  PHINode *I = IRB.CreatePHI(Int32Ty, 2);
+  I->addIncoming(IRB.getInt32(0), Preheader);
+  Value *Offset = IRB.CreateLoad(Int32Ty,
+      IRB.CreateInBoundsGEP(TableTy, FixupTable, {IRB.getInt32(0), I, IRB.getInt32(0)}));
+  Value *Place = IRB.CreateInBoundsGEP(TableTy, FixupTable, {IRB.getInt32(0), I, IRB.getInt32(1)});
+  Value *Rel = IRB.CreateLoad(Int32Ty, Place);
+  Value *Target = IRB.CreateGEP(IRB.getInt8Ty(), Place, IRB.CreateSExt(Rel, IntPtrTy));
+  Value *Ptr = IRB.CreateInBoundsGEP(IRB.getInt8Ty(), User->DecGV,
+                                     IRB.CreateZExt(Offset, IntPtrTy));
+  IRB.CreateAlignedStore(Target, Ptr, PtrAlign);
+  Value *Next = IRB.CreateAdd(I, IRB.getInt32(1));
+  I->addIncoming(Next, Body);
+  IRB.CreateCondBr(IRB.CreateICmpEQ(Next, IRB.getInt32(Relative.size())), Done, Body);
+
+  IRB.SetInsertPoint(Done);
 }
 
 void StringEncryption::lowerGlobalConstant(Constant *CV, IRBuilder<> &IRB, Value *Ptr, Type *Ty) {
@@ -372,19 +1107,72 @@ void StringEncryption::lowerGlobalConstantStruct(ConstantStruct *CS, IRBuilder<>
   }
 }
 
+// Where one decrypt call covers every use in Uses: the nearest common
+// dominator of the use sites, moved out of every loop that has a preheader.
+// A PHI operand is used at the end of its incoming block. Uses in
+// unreachable blocks are ignored; returns null if there are no others.
+static Instruction *findDecryptPoint(ArrayRef<Use *> Uses, DominatorTree &DT, LoopInfo &LI) {
+  auto UseBlock = [](Use *U) {
+    if (PHINode *PHI = dyn_cast<PHINode>(U->getUser())) {
+      return PHI->getIncomingBlock(*U);
+    }
+    return cast<Instruction>(U->getUser())->getParent();
+  };
+
+  BasicBlock *BB = nullptr;
+  for (Use *U : Uses) {
+    BasicBlock *UseBB = UseBlock(U);
+    if (DT.isReachableFromEntry(UseBB)) {
+      BB = BB ? DT.findNearestCommonDominator(BB, UseBB) : UseBB;
+    }
+  }
+  if (!BB) {
+    return nullptr;
+  }
+  for (;;) {
+    if (BB->isEHPad()) {
+      BB = DT.getNode(BB)->getIDom()->getBlock();
+      continue;
+    }
+    Loop *L = LI.getLoopFor(BB);
+    BasicBlock *Preheader = L ? L->getLoopPreheader() : nullptr;
+    if (!Preheader) {
+      break;
+    }
+    BB = Preheader;
+  }
+
+  // before the first use in BB, or at its end
+  Instruction *IP = BB->getTerminator();
+  for (Use *U : Uses) {
+    Instruction *I = cast<Instruction>(U->getUser());
+    if (!isa<PHINode>(I) && I->getParent() == BB && I->comesBefore(IP)) {
+      IP = I;
+    }
+  }
+  return IP;
+}
+
 bool StringEncryption::processConstantStringUse(Function *F) {
-  if (!toObfuscate(flag, F, "cse")) {
+  if (!toObfuscate(flag, F, "cse", Options ? Options->Annotations : nullptr)) {
     return false;
   }
-  if (Options && Options->skipFunction(F->getName())) {
+  if (Options && Options->skipFunction(*F, ObfuscationOptions::CSE)) {
     return false;
   }
-  LLVMContext &Ctx = F->getContext();
-  LowerConstantExpr(*F);
-  SmallPtrSet<GlobalVariable *, 16> DecryptedGV; // if GV has multiple use in a block, decrypt only at the first use
-  bool Changed = false;
+  LowerConstantExpr(*F, [this](GlobalVariable *GV) {
+    return EncryptedGlobals.count(GV) > 0;
+  });
+
+  // every use of an encrypted global, grouped by global in first-use order;
+  // EncryptedGlobal::Group maps a global to its group with the one lookup
+  struct UseGroup {
+    GlobalVariable *GV;
+    EncryptedGlobal *Target;
+    SmallVector<Use *, 4> Uses;
+  };
+  SmallVector<UseGroup, 8> Groups;
   for (BasicBlock &BB : *F) {
-    DecryptedGV.clear();
     if (BB.isEHPad()) {
       continue;
     }
@@ -392,95 +1180,69 @@ bool StringEncryption::processConstantStringUse(Function *F) {
       if (Inst.isEHPad()) {
         continue;
       }
-      if (PHINode *PHI = dyn_cast<PHINode>(&Inst)) {
-        for (unsigned int i = 0; i < PHI->getNumIncomingValues(); ++i) {
-          if (GlobalVariable *GV = dyn_cast<GlobalVariable>(PHI->getIncomingValue(i))) {
-            auto Iter1 = CSPEntryMap.find(GV);
-            auto Iter2 = CSUserMap.find(GV);
-            if (Iter2 != CSUserMap.end()) { // GV is a constant string user
-              CSUser *User = Iter2->second;
-              if (DecryptedGV.count(GV) > 0) {
-                Inst.replaceUsesOfWith(GV, User->DecGV);
-              } else {
-                Instruction *InsertPoint = PHI->getIncomingBlock(i)->getTerminator();
-                IRBuilder<> IRB(InsertPoint);
-                IRB.CreateCall(User->InitFunc, {User->DecGV});
-                Inst.replaceUsesOfWith(GV, User->DecGV);
-                MaybeDeadGlobalVars.insert(GV);
-                DecryptedGV.insert(GV);
-                Changed = true;
-              }
-            } else if (Iter1 != CSPEntryMap.end()) { // GV is a constant string
-              CSPEntry *Entry = Iter1->second;
-              if (DecryptedGV.count(GV) > 0) {
-                Inst.replaceUsesOfWith(GV, Entry->DecGV);
-              } else {
-                Instruction *InsertPoint = PHI->getIncomingBlock(i)->getTerminator();
-                IRBuilder<> IRB(InsertPoint);
-
-                Value *OutBuf = IRB.CreateBitCast(Entry->DecGV,
-                                                  PointerType::getUnqual(Ctx));
-                Value *Data = IRB.CreateInBoundsGEP(
-                    EncryptedStringTable->getValueType(),
-                    EncryptedStringTable,
-                    {IRB.getInt32(0), IRB.getInt32(Entry->Offset)});
-                IRB.CreateCall(Entry->DecFunc, {OutBuf, Data});
-
-                Inst.replaceUsesOfWith(GV, Entry->DecGV);
-                MaybeDeadGlobalVars.insert(GV);
-                DecryptedGV.insert(GV);
-                Changed = true;
-              }
-            }
-          }
+      for (Use &U : Inst.operands()) {
+        GlobalVariable *GV = dyn_cast<GlobalVariable>(U.get());
+        if (!GV) {
+          continue;
         }
-      } else {
-        for (User::op_iterator op = Inst.op_begin(); op != Inst.op_end(); ++op) {
-          if (GlobalVariable *GV = dyn_cast<GlobalVariable>(*op)) {
-            auto Iter1 = CSPEntryMap.find(GV);
-            auto Iter2 = CSUserMap.find(GV);
-            if (Iter2 != CSUserMap.end()) {
-              CSUser *User = Iter2->second;
-              if (DecryptedGV.count(GV) > 0) {
-                Inst.replaceUsesOfWith(GV, User->DecGV);
-              } else {
-                IRBuilder<> IRB(&Inst);
-                IRB.CreateCall(User->InitFunc, {User->DecGV});
-                Inst.replaceUsesOfWith(GV, User->DecGV);
-                MaybeDeadGlobalVars.insert(GV);
-                DecryptedGV.insert(GV);
-                Changed = true;
-              }
-            } else if (Iter1 != CSPEntryMap.end()) {
-              CSPEntry *Entry = Iter1->second;
-              if (DecryptedGV.count(GV) > 0) {
-                Inst.replaceUsesOfWith(GV, Entry->DecGV);
-              } else {
-                IRBuilder<> IRB(&Inst);
-
-                Value *OutBuf = IRB.CreateBitCast(Entry->DecGV,
-                                                  PointerType::getUnqual(Ctx));
-                Value *Data = IRB.CreateInBoundsGEP(
-                    EncryptedStringTable->getValueType(),
-                    EncryptedStringTable,
-                    {IRB.getInt32(0), IRB.getInt32(Entry->Offset)});
-                IRB.CreateCall(Entry->DecFunc, {OutBuf, Data});
-
-                Inst.replaceUsesOfWith(GV, Entry->DecGV);
-                MaybeDeadGlobalVars.insert(GV);
-                DecryptedGV.insert(GV);
-                Changed = true;
-              }
-            }
-          }
+        auto Iter = EncryptedGlobals.find(GV);
+        if (Iter == EncryptedGlobals.end()) {
+          continue;
+        }
+        EncryptedGlobal &Target = Iter->second;
+        if (Target.Group == ~0U) {
+          Target.Group = Groups.size();
+          Groups.push_back({GV, &Target, {}});
         }
+        Groups[Target.Group].Uses.push_back(&U);
       }
     }
   }
-  return Changed;
+  for (UseGroup &G : Groups) {
+    G.Target->Group = ~0U;
+  }
+  if (Groups.empty()) {
+    return false;
+  }
+
+  if (EagerDecrypt) {
+    for (UseGroup &G : Groups) {
+      for (Use *U : G.Uses) {
+        U->set(G.Target->Entry->DecPtr);
+      }
+    }
+    return true;
+  }
+
+  // one decrypt call per global, at a point that dominates all its uses
+  DominatorTree DT(*F);
+  LoopInfo LI(DT);
+  for (UseGroup &G : Groups) {
+    Instruction *IP = findDecryptPoint(G.Uses, DT, LI);
+    Constant *Decrypted;
+    if (CSUser *User = G.Target->User) { // GV is a constant string user
+      if (IP) {
+        IRBuilder<> IRB(IP);
+        IRB.CreateCall(User->InitFunc, {User->DecGV});
+      }
+      Decrypted = User->DecGV;
+    } else { // GV is a constant string
+      CSPEntry *Entry = G.Target->Entry;
+      if (IP) {
+        IRBuilder<> IRB(IP);
+        emitDecryptCall(IRB, Entry);
+      }
+      Decrypted = Entry->DecPtr;
+    }
+    for (Use *U : G.Uses) {
+      U->set(Decrypted);
+    }
+    MaybeDeadGlobalVars.insert(G.GV);
+  }
+  return true;
 }
 
-void StringEncryption::collectConstantStringUser(GlobalVariable *CString, std::set<GlobalVariable *> &Users) {
+void StringEncryption::collectConstantStringUser(GlobalVariable *CString, SetVector<GlobalVariable *> &Users) {
   SmallPtrSet<Value *, 16> Visited;
   SmallVector<Value *, 16> ToVisit;
 
@@ -508,32 +1270,58 @@ bool StringEncryption::isValidToEncrypt(GlobalVariable *GV) {
   }
 }
 
+// Erasing a global can only make the globals its initializer refers to
+// unused, so those are the ones that go back on the worklist.
+static void collectReferencedGlobals(Constant *Init, SmallVectorImpl<GlobalVariable *> &Globals) {
+  SmallPtrSet<Constant *, 16> Visited;
+  SmallVector<Constant *, 16> ToVisit;
+
+  ToVisit.push_back(Init);
+  while (!ToVisit.empty()) {
+    Constant *C = ToVisit.pop_back_val();
+    if (!Visited.insert(C).second)
+      continue;
+    if (auto *GV = dyn_cast<GlobalVariable>(C)) {
+      Globals.push_back(GV);
+      continue;
+    }
+    for (Value *Op : C->operands()) {
+      ToVisit.push_back(cast<Constant>(Op));
+    }
+  }
+}
+
 void StringEncryption::deleteUnusedGlobalVariable() {
-  bool Changed = true;
-  while (Changed) {
-    Changed = false;
-    for (auto Iter = MaybeDeadGlobalVars.begin(); Iter != MaybeDeadGlobalVars.end();) {
-      GlobalVariable *GV = *Iter;
-      if (!GV->hasLocalLinkage()) {
-        ++Iter;
-        continue;
-      }
+  SmallPtrSet<GlobalVariable *, 16> Candidates;
+  SmallVector<GlobalVariable *, 16> WorkList;
+  SmallVector<GlobalVariable *, 8> Referenced;
+  for (GlobalVariable *GV : MaybeDeadGlobalVars) {
+    if (GV->hasLocalLinkage()) {
+      Candidates.insert(GV);
+      WorkList.push_back(GV);
+    }
+  }
+  MaybeDeadGlobalVars.clear();
 
-      GV->removeDeadConstantUsers();
-      if (GV->use_empty()) {
-        if (GV->hasInitializer()) {
-          Constant *Init = GV->getInitializer();
-          GV->setInitializer(nullptr);
-          if (isSafeToDestroyConstant(Init))
-            Init->destroyConstant();
-        }
-        Iter = MaybeDeadGlobalVars.erase(Iter);
-        GV->eraseFromParent();
-        Changed = true;
-      } else {
-        ++Iter;
-      }
+  while (!WorkList.empty()) {
+    GlobalVariable *GV = WorkList.pop_back_val();
+    if (!Candidates.count(GV))
+      continue;
+    GV->removeDeadConstantUsers();
+    if (!GV->use_empty())
+      continue;
+
+    Candidates.erase(GV);
+    if (GV->hasInitializer()) {
+      Constant *Init = GV->getInitializer();
+      Referenced.clear();
+      collectReferencedGlobals(Init, Referenced);
+      GV->setInitializer(nullptr);
+      if (isSafeToDestroyConstant(Init))
+        Init->destroyConstant();
+      WorkList.append(Referenced.begin(), Referenced.end());
     }
+    GV->eraseFromParent();
   }
 }
 
@@ -1,7 +1,13 @@
 #include "include/Utils.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+const char StringTableMDName[] = "goron.strings";
+const char IndirectionTableMDKind[] = "goron.table";
+const char DispatchStateMDKind[] = "goron.dispatch";
 
 // Shamefully borrowed from ../Scalar/RegToMem.cpp :(
 bool valueEscapes(Instruction *Inst) {
@@ -43,7 +49,8 @@ void fixStack(Function *f) {
       }
     }
     for (unsigned int i = 0; i != tmpReg.size(); ++i) {
-      DemoteRegToStack(*tmpReg.at(i), f->begin()->getTerminator());
+      // Plain (not volatile) reloads, allocas at the start of the entry block
+      DemoteRegToStack(*tmpReg.at(i));
     }
 
     for (unsigned int i = 0; i != tmpPhi.size(); ++i) {
@@ -53,52 +60,80 @@ void fixStack(Function *f) {
   } while (tmpReg.size() != 0 || tmpPhi.size() != 0);
 }
 
-std::string readAnnotate(Function *f) {
-  std::string annotation = "";
-
+AnnotationIndex::AnnotationIndex(Module &M) {
   // Get annotation variable
-  GlobalVariable *glob =
-      f->getParent()->getGlobalVariable("llvm.global.annotations");
-
-  if (glob != NULL) {
-    // Get the array
-    if (ConstantArray *ca = dyn_cast<ConstantArray>(glob->getInitializer())) {
-      for (unsigned i = 0; i < ca->getNumOperands(); ++i) {
-        // Get the struct
-        if (ConstantStruct *structAn =
-            dyn_cast<ConstantStruct>(ca->getOperand(i))) {
-          if (ConstantExpr *expr =
-              dyn_cast<ConstantExpr>(structAn->getOperand(0))) {
-            // If it's a bitcast we can check if the annotation is concerning
-            // the current function
-            if (expr->getOpcode() == Instruction::BitCast &&
-                expr->getOperand(0) == f) {
-              ConstantExpr *note = cast<ConstantExpr>(structAn->getOperand(1));
-              // If it's a GetElementPtr, that means we found the variable
-              // containing the annotations
-              if (note->getOpcode() == Instruction::GetElementPtr) {
-                if (GlobalVariable *annoteStr =
-                    dyn_cast<GlobalVariable>(note->getOperand(0))) {
-                  if (ConstantDataSequential *data =
-                      dyn_cast<ConstantDataSequential>(
-                          annoteStr->getInitializer())) {
-                    if (data->isString()) {
-                      annotation += data->getAsString().lower() + " ";
-                    }
-                  }
-                }
-              }
-            }
-          }
-        }
+  GlobalVariable *glob = M.getGlobalVariable("llvm.global.annotations");
+  if (glob == nullptr || !glob->hasInitializer()) {
+    return;
+  }
+
+  // Get the array
+  ConstantArray *ca = dyn_cast<ConstantArray>(glob->getInitializer());
+  if (ca == nullptr) {
+    return;
+  }
+
+  for (unsigned i = 0; i < ca->getNumOperands(); ++i) {
+    // Get the struct
+    ConstantStruct *structAn = dyn_cast<ConstantStruct>(ca->getOperand(i));
+    if (structAn == nullptr || structAn->getNumOperands() < 2) {
+      continue;
+    }
+    // Older clang wraps both fields in bitcast/GEP constant expressions,
+    // opaque-pointer clang refers to the function and the string directly.
+    Function *f = dyn_cast<Function>(structAn->getOperand(0)->stripPointerCasts());
+    GlobalVariable *annoteStr =
+        dyn_cast<GlobalVariable>(structAn->getOperand(1)->stripPointerCasts());
+    if (f == nullptr || annoteStr == nullptr || !annoteStr->hasInitializer()) {
+      continue;
+    }
+    if (ConstantDataSequential *data =
+        dyn_cast<ConstantDataSequential>(annoteStr->getInitializer())) {
+      if (data->isString()) {
+        Annotations[f].push_back(data->getAsString().lower());
       }
     }
   }
-  return annotation;
 }
 
-bool toObfuscate(bool flag, Function *f, std::string attribute) {
-  std::string attr = attribute;
+bool AnnotationIndex::hasAnnotation(const Function *f, StringRef attr) const {
+  auto It = Annotations.find(f);
+  if (It == Annotations.end()) {
+    return false;
+  }
+  for (const std::string &annotation : It->second) {
+    if (StringRef(annotation).contains(attr)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+const AnnotationIndex &getAnnotationIndex(Module &M) {
+  // One entry per thread: irvana-obf obfuscates one module per thread, and a
+  // pass without options asks for the same module once per function. The
+  // initializer changes whenever an annotation is added or removed.
+  struct CachedIndex {
+    const Module *M = nullptr;
+    const Constant *Init = nullptr;
+    std::unique_ptr<AnnotationIndex> Index;
+  };
+  static thread_local CachedIndex Cache;
+
+  GlobalVariable *glob = M.getGlobalVariable("llvm.global.annotations");
+  const Constant *Init =
+      glob && glob->hasInitializer() ? glob->getInitializer() : nullptr;
+  if (!Cache.Index || Cache.M != &M || Cache.Init != Init) {
+    Cache.Index = std::make_unique<AnnotationIndex>(M);
+    Cache.M = &M;
+    Cache.Init = Init;
+  }
+  return *Cache.Index;
+}
+
+bool toObfuscate(bool flag, Function *f, StringRef attribute,
+                 const AnnotationIndex *Annotations) {
+  std::string attr = attribute.str();
   std::string attrNo = "no" + attr;
 
   // Check if declaration
@@ -111,43 +146,68 @@ bool toObfuscate(bool flag, Function *f, std::string attribute) {
     return false;
   }
 
+  if (Annotations == nullptr) {
+    Annotations = &getAnnotationIndex(*f->getParent());
+  }
+
   // We have to check the nofla flag first
   // Because .find("fla") is true for a string like "fla" or
   // "nofla"
-  if (readAnnotate(f).find(attrNo) != std::string::npos) {
+  if (Annotations->hasAnnotation(f, attrNo)) {
     return false;
   }
 
   // If fla annotations
-  if (readAnnotate(f).find(attr) != std::string::npos) {
+  if (Annotations->hasAnnotation(f, attr)) {
     return true;
   }
 
   // If fla flag is set
   if (flag == true) {
-    /* Check if the number of applications is correct
-    if (!((Percentage > 0) && (Percentage <= 100))) {
-      LLVMContext &ctx = llvm::getGlobalContext();
-      ctx.emitError(Twine("Flattening application function\
-              percentage -perFLA=x must be 0 < x <= 100"));
-    }
-    // Check name
-    else if (func.size() != 0 && func.find(f->getName()) != std::string::npos) {
-      return true;
-    }
-
-    if ((((int)llvm::cryptoutils->get_range(100))) < Percentage) {
-      return true;
-    }
-    */
+    // Ratios are applied by ObfuscationOptions (Intensity, BlockRatio)
     return true;
   }
 
   return false;
 }
 
-void LowerConstantExpr(Function &F) {
-  SmallPtrSet<Instruction *, 8> WorkList;
+// Returns true if CE, or any constant expression nested in it, refers to a
+// global selected by ShouldLower.
+static bool referencesSelectedGlobal(
+    ConstantExpr *CE, function_ref<bool(GlobalVariable *)> ShouldLower,
+    DenseMap<ConstantExpr *, bool> &Cache) {
+  auto It = Cache.find(CE);
+  if (It != Cache.end()) {
+    return It->second;
+  }
+
+  bool Found = false;
+  for (Value *Op : CE->operands()) {
+    if (GlobalVariable *GV = dyn_cast<GlobalVariable>(Op)) {
+      Found = ShouldLower(GV);
+    } else if (ConstantExpr *Inner = dyn_cast<ConstantExpr>(Op)) {
+      Found = referencesSelectedGlobal(Inner, ShouldLower, Cache);
+    }
+    if (Found) {
+      break;
+    }
+  }
+  Cache[CE] = Found;
+  return Found;
+}
+
+void LowerConstantExpr(Function &F,
+                       function_ref<bool(GlobalVariable *)> ShouldLower) {
+  DenseMap<ConstantExpr *, bool> Cache;
+  SmallVector<Instruction *, 32> WorkList;
+
+  auto NeedsLowering = [&](Value *V) -> ConstantExpr * {
+    ConstantExpr *CE = dyn_cast<ConstantExpr>(V);
+    if (CE && referencesSelectedGlobal(CE, ShouldLower, Cache)) {
+      return CE;
+    }
+    return nullptr;
+  };
 
   for (inst_iterator It = inst_begin(F), E = inst_end(F); It != E; ++It) {
     Instruction *I = &*It;
@@ -161,35 +221,67 @@ void LowerConstantExpr(Function &F) {
     }
 
     for (unsigned int i = 0; i < I->getNumOperands(); ++i) {
-      if (isa<ConstantExpr>(I->getOperand(i)))
-        WorkList.insert(I);
+      if (NeedsLowering(I->getOperand(i))) {
+        WorkList.push_back(I);
+        break;
+      }
     }
   }
 
   while (!WorkList.empty()) {
-    auto It = WorkList.begin();
-    Instruction *I = *It;
-    WorkList.erase(*It);
+    Instruction *I = WorkList.pop_back_val();
 
     if (PHINode *PHI = dyn_cast<PHINode>(I)) {
+      // A block may appear several times in a PHI; it must get the same value.
+      SmallDenseMap<std::pair<BasicBlock *, ConstantExpr *>, Instruction *, 4>
+          Lowered;
       for (unsigned int i = 0; i < PHI->getNumIncomingValues(); ++i) {
-        Instruction *TI = PHI->getIncomingBlock(i)->getTerminator();
-        if (ConstantExpr *CE = dyn_cast<ConstantExpr>(PHI->getIncomingValue(i))) {
-          Instruction *NewInst = CE->getAsInstruction();
-          NewInst->insertBefore(TI);
+        if (ConstantExpr *CE = NeedsLowering(PHI->getIncomingValue(i))) {
+          BasicBlock *BB = PHI->getIncomingBlock(i);
+          Instruction *&NewInst = Lowered[{BB, CE}];
+          if (!NewInst) {
+            NewInst = CE->getAsInstruction();
+            NewInst->insertBefore(BB->getTerminator());
+            WorkList.push_back(NewInst);
+          }
           PHI->setIncomingValue(i, NewInst);
-          WorkList.insert(NewInst);
         }
       }
     } else {
       for (unsigned int i = 0; i < I->getNumOperands(); ++i) {
-        if (ConstantExpr *CE = dyn_cast<ConstantExpr>(I->getOperand(i))) {
+        if (ConstantExpr *CE = NeedsLowering(I->getOperand(i))) {
           Instruction *NewInst = CE->getAsInstruction();
           NewInst->insertBefore(I);
           I->replaceUsesOfWith(CE, NewInst);
-          WorkList.insert(NewInst);
+          WorkList.push_back(NewInst);
         }
       }
     }
   }
 }
+
+void pinIndirectionTable(GlobalVariable *GV) {
+  GV->setMetadata(IndirectionTableMDKind, MDNode::get(GV->getContext(), {}));
+}
+
+// appendToCompilerUsed rebuilds the whole array, so the tables of a pass are
+// added in one go rather than one per function.
+void pinIndirectionTables(Module &M) {
+  SmallPtrSet<GlobalValue *, 16> Used;
+  if (GlobalVariable *GV = M.getGlobalVariable("llvm.compiler.used")) {
+    if (GV->hasInitializer()) {
+      for (Value *V : GV->getInitializer()->operands()) {
+        Used.insert(dyn_cast<GlobalValue>(V->stripPointerCasts()));
+      }
+    }
+  }
+  SmallVector<GlobalValue *, 16> Tables;
+  for (GlobalVariable &GV : M.globals()) {
+    if (GV.getMetadata(IndirectionTableMDKind) && !Used.count(&GV)) {
+      Tables.push_back(&GV);
+    }
+  }
+  if (!Tables.empty()) {
+    appendToCompilerUsed(M, Tables);
+  }
+}
@@ -0,0 +1,65 @@
+#ifndef OBFUSCATION_COMPILEBUDGET_H
+#define OBFUSCATION_COMPILEBUDGET_H
+
+#include <string>
+#include "include/ObfuscationOptions.h"
+#include "llvm/ADT/DenseMap.h"
+
+namespace llvm {
+
+class Module;
+
+// Per-function downgrades that keep the obfuscated module compilable in
+// bounded time. The size limits are checked once, on the functions as they
+// are before any pass runs:
+//  - more than MaxBlocks blocks or MaxInstructions instructions: the
+//    function is not obfuscated,
+//  - more than MaxFlattenBlocks blocks: it is flattened with one dispatcher
+//    per MaxFlattenBlocks blocks instead of a single one,
+//  - an estimated size after flattening and indbr above MaxEstimatedSize:
+//    indbr skips it, and if that is not enough the function is skipped.
+// TimeBudgetMs is charged while the passes run: once the passes spent more
+// than that on a function, the remaining ones skip it.
+class CompileBudget {
+public:
+  CompileBudget(Module &M, const ObfuscationOptions::CompileLimits &Limits,
+                bool Flatten, bool IndirectBr);
+
+  bool skip(const Function &F, ObfuscationOptions::ObfPass Pass) const;
+  // Blocks per dispatcher, 0 for a single dispatcher.
+  unsigned flattenPartition(const Function &F) const;
+
+  bool isTimed() const { return Limits.TimeBudgetMs != 0; }
+  void charge(const Function &F, StringRef PassName, double Seconds);
+
+  // Writes one line per downgraded function to Limits.Report, if set.
+  void writeReport() const;
+
+private:
+  struct Decision {
+    Decision()
+        : Blocks(0), Instructions(0), Estimate(0), Partition(0),
+          SkipIndirectBr(false), SkipAll(false), Seconds(0) {}
+    bool isDowngraded() const {
+      return Partition || SkipIndirectBr || SkipAll;
+    }
+    unsigned Blocks;
+    unsigned Instructions;
+    uint64_t Estimate;
+    unsigned Partition;
+    bool SkipIndirectBr;
+    bool SkipAll;
+    double Seconds;
+    // Pass after which the time budget ran out.
+    std::string StoppedAfter;
+    std::string Reason;
+  };
+
+  const ObfuscationOptions::CompileLimits &Limits;
+  std::vector<const Function *> Order;
+  DenseMap<const Function *, Decision> Decisions;
+};
+
+}
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef OBFUSCATION_LINK_CONSOLIDATION_H
+#define OBFUSCATION_LINK_CONSOLIDATION_H
+
+namespace llvm {
+class ModulePass;
+class PassRegistry;
+
+ModulePass* createLinkConsolidationPass();
+void initializeLinkConsolidationPass(PassRegistry &Registry);
+
+}
+
+#endif
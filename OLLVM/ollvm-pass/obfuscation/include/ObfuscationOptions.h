@@ -1,15 +1,73 @@
 #ifndef OBFUSCATION_OBFUSCATIONOPTIONS_H
 #define OBFUSCATION_OBFUSCATIONOPTIONS_H
 
-#include <set>
+#include <map>
+#include <vector>
+#include <llvm/ADT/BitVector.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/GlobPattern.h>
+#include <llvm/Support/Regex.h>
 #include <llvm/Support/YAMLParser.h>
 
+class AnnotationIndex;
+
 namespace llvm {
 
+class BasicBlock;
+class CompileBudget;
+class Function;
+
+// Function name patterns from the configuration, compiled once.
+// Exact names and "prefix*" globs share a trie that is walked once per name;
+// other globs and "re:" regular expressions are matched one by one.
+class FunctionNameMatcher {
+public:
+  FunctionNameMatcher();
+  // Returns the pattern id, or -1 if the pattern does not compile.
+  int add(StringRef Pattern);
+  // Name is matched literally, glob and regex characters included.
+  unsigned addExact(StringRef Name);
+  void match(StringRef Name, BitVector &Matched) const;
+  unsigned size() const { return NumPatterns; }
+
+private:
+  struct TrieNode {
+    std::map<char, unsigned> Children;
+    SmallVector<unsigned, 1> Exact;
+    SmallVector<unsigned, 1> Prefix;
+  };
+  unsigned getTrieNode(StringRef Literal);
+
+  std::vector<TrieNode> Trie;
+  std::vector<std::pair<unsigned, GlobPattern>> Globs;
+  std::vector<std::pair<unsigned, Regex>> Regexes;
+  StringMap<unsigned> PatternIds;
+  StringMap<unsigned> ExactIds;
+  unsigned NumPatterns;
+};
+
 struct ObfuscationOptions {
+  enum ObfPass { IndirectBr, IndirectCall, IndirectGV, CFF, CSE, NumObfPasses };
+
+  // Compile-time limits applied by CompileBudget, 0 disables a limit. All
+  // are off by default: a downgraded function is less protected.
+  struct CompileLimits {
+    CompileLimits()
+        : MaxBlocks(0), MaxInstructions(0), MaxFlattenBlocks(0),
+          MaxEstimatedSize(0), TimeBudgetMs(0) {}
+    unsigned MaxBlocks;
+    unsigned MaxInstructions;
+    unsigned MaxFlattenBlocks;
+    uint64_t MaxEstimatedSize;
+    unsigned TimeBudgetMs;
+    // File the downgraded functions are appended to.
+    std::string Report;
+  };
+
   explicit ObfuscationOptions(const Twine &FileName);
   explicit ObfuscationOptions();
-  bool skipFunction(const Twine &FName);
+  bool skipFunction(const Function &F, ObfPass Pass);
   void dump();
 
   bool EnableIndirectBr;
@@ -18,12 +76,75 @@ struct ObfuscationOptions {
   bool EnableCFF;
   bool EnableCSE;
   bool hasFilter;
+  // Decrypt every constant string through one routine and a descriptor
+  // table instead of one goron_decrypt_string_N per string.
+  bool SharedStringDecrypt;
+  // Decrypt every constant string once from a module constructor instead
+  // of lazily at the first use.
+  bool EagerStringDecrypt;
+  // Run the recovery pipeline over the obfuscated module.
+  bool Recover;
+  CompileLimits Limits;
+  // Owned by the pass manager, valid for the module being obfuscated.
+  const AnnotationIndex *Annotations;
+  CompileBudget *Budget;
 
 private:
+  friend class BlockSelector;
+
+  // Per-pass selection: Include (if any) must match, Exclude must not, and
+  // Intensity is the percentage of the remaining functions that are kept.
+  // Inside a kept function, BlockRatio is the percentage of blocks that are
+  // transformed; blocks at loop depth >= SkipLoopDepth or with a profile
+  // count > SkipProfileCount are left alone (0 disables either predicate).
+  struct PassPolicy {
+    PassPolicy()
+        : Intensity(100), BlockRatio(100), SkipLoopDepth(0),
+          SkipProfileCount(0) {}
+    bool hasBlockPolicy() const {
+      return BlockRatio < 100 || SkipLoopDepth || SkipProfileCount;
+    }
+    std::vector<unsigned> Include;
+    std::vector<unsigned> Exclude;
+    unsigned Intensity;
+    unsigned BlockRatio;
+    unsigned SkipLoopDepth;
+    uint64_t SkipProfileCount;
+  };
+
   void init();
   void handleRoot(yaml::Node *n);
+  void handleLimits(yaml::Node *n);
+  bool handlePass(yaml::Node *n, ObfPass Pass);
+  void addPatterns(yaml::Node *n, std::vector<unsigned> &Ids,
+                   bool Exact = false);
   bool parseOptions(const Twine &FileName);
-  std::set<std::string> FunctionFilter;
+  unsigned computeSkipMask(StringRef Name);
+  void matchName(StringRef Name);
+
+  FunctionNameMatcher Matcher;
+  std::vector<unsigned> FunctionFilter;
+  std::vector<unsigned> GlobalExclude;
+  PassPolicy Policies[NumObfPasses];
+  // Function name -> bit per ObfPass that should skip it.
+  StringMap<unsigned> SkipCache;
+  BitVector Matched;
+  BitVector DemangledMatched;
+};
+
+// Per-block selection for a function that passed skipFunction. Decisions
+// are made once, on the blocks that exist at construction, and depend only
+// on the function name, the block position and the pass, so rebuilds pick
+// the same blocks. Blocks created afterwards are always selected.
+class BlockSelector {
+public:
+  BlockSelector(Function &F, const ObfuscationOptions *Options,
+                ObfuscationOptions::ObfPass Pass);
+  bool select(const BasicBlock *BB) const { return !Skipped.count(BB); }
+  bool selectAll() const { return Skipped.empty(); }
+
+private:
+  DenseSet<const BasicBlock *> Skipped;
 };
 
 }
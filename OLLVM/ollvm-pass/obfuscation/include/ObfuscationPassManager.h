@@ -5,6 +5,8 @@
 #include "include/IndirectBranch.h"
 #include "include/IndirectCall.h"
 #include "include/IndirectGlobalVariable.h"
+#include "include/LinkConsolidation.h"
+#include "include/Recovery.h"
 #include "include/StringEncryption.h"
 #include "llvm/Passes/PassBuilder.h"
 
@@ -13,14 +15,23 @@ namespace llvm {
 class ModulePass;
 class PassRegistry;
 
-ModulePass *createObfuscationPassManager();
+// Enabled runs the passes the configuration enables, as -irobf does.
+ModulePass *createObfuscationPassManager(bool Enabled = false);
 void initializeObfuscationPassManagerPass(PassRegistry &Registry);
 
+// Whether the obfuscation configured by the -irobf* options and goron.yaml
+// selects any function of M. Only looks at function names and annotations,
+// so M can be a lazily loaded module whose bodies are not materialized.
+bool hasObfuscationWork(Module &M);
+
 class ObfuscationPassManagerPass
     : public PassInfoMixin<ObfuscationPassManagerPass> {
 public:
+  explicit ObfuscationPassManagerPass(bool Enabled = false)
+      : Enabled(Enabled) {}
+
   PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
-    ModulePass *OPM = createObfuscationPassManager();
+    ModulePass *OPM = createObfuscationPassManager(Enabled);
     bool Changed = OPM->runOnModule(M);
     OPM->doFinalization(M);
     delete OPM;
@@ -29,6 +40,9 @@ public:
     }
     return PreservedAnalyses::all();
   }
+
+private:
+  bool Enabled;
 };
 
 } // namespace llvm
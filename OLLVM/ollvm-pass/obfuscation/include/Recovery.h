@@ -0,0 +1,13 @@
+#ifndef OBFUSCATION_RECOVERY_H
+#define OBFUSCATION_RECOVERY_H
+
+namespace llvm {
+class ModulePass;
+class PassRegistry;
+
+ModulePass* createRecoveryPass();
+void initializeRecoveryPass(PassRegistry &Registry);
+
+}
+
+#endif
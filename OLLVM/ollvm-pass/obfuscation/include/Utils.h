@@ -1,6 +1,9 @@
 #ifndef __UTILS_OBF__
 #define __UTILS_OBF__
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/Transforms/Utils/Local.h" // For DemoteRegToStack and DemotePHIToStack
@@ -8,8 +11,45 @@
 using namespace llvm;
 bool valueEscapes(Instruction *Inst);
 void fixStack(Function *f);
-std::string readAnnotate(Function *f);
-bool toObfuscate(bool flag, Function *f, std::string attribute);
-void LowerConstantExpr(Function &F);
+
+// Lowercased llvm.global.annotations strings of every annotated function,
+// collected once per module instead of once per function and pass.
+class AnnotationIndex {
+public:
+  explicit AnnotationIndex(Module &M);
+  bool hasAnnotation(const Function *f, StringRef attr) const;
+
+private:
+  DenseMap<const Function *, SmallVector<std::string, 2>> Annotations;
+};
+
+// Index of M, built once and reused until M or its annotations change.
+const AnnotationIndex &getAnnotationIndex(Module &M);
+
+// Annotations may be null, in which case getAnnotationIndex is used.
+bool toObfuscate(bool flag, Function *f, StringRef attribute,
+                 const AnnotationIndex *Annotations = nullptr);
+
+// Expand constant expressions that (transitively) refer to a global selected
+// by ShouldLower into instructions, so the global shows up as a plain operand.
+void LowerConstantExpr(Function &F,
+                       function_ref<bool(GlobalVariable *)> ShouldLower);
+
+// Metadata read by LinkConsolidation once the obfuscated modules are linked:
+// StringEncryption lists its tables under the named metadata
+// StringTableMDName, indirection tables carry IndirectionTableMDKind.
+extern const char StringTableMDName[];
+extern const char IndirectionTableMDKind[];
+
+// Flattening tags the alloca holding the next case with DispatchStateMDKind,
+// the recovery pipeline keeps it in memory.
+extern const char DispatchStateMDKind[];
+
+// Tag a per-function indirection table, so a copy left behind by a discarded
+// linkonce function can be dropped after linking. pinIndirectionTables then
+// keeps the tagged tables alive through llvm.compiler.used; the pass manager
+// calls it after each pass.
+void pinIndirectionTable(GlobalVariable *GV);
+void pinIndirectionTables(Module &M);
 
 #endif
@@ -0,0 +1,121 @@
+; Flattening under compile-time limits (Limits: MaxBlocks 12,
+; MaxFlattenBlocks 3): classify is flattened with one dispatcher per three
+; blocks, huge is over MaxBlocks and is not flattened at all.
+; CHECK: 156 3 1 0 2
+; CHECK-NOT: %huge.acc.reg2mem = alloca
+; CHECK-IR: %class.acc.reg2mem = alloca
+; CHECK-IR: loopEntry2:
+
+@.str.fmt = private unnamed_addr constant [16 x i8] c"%d %d %d %d %d\0A\00", align 1
+
+declare i32 @printf(ptr, ...)
+
+; 9 blocks, flattened with three dispatchers
+define i32 @classify(i32 %x) {
+entry:
+  %neg = icmp slt i32 %x, 0
+  br i1 %neg, label %negative, label %check.zero
+
+negative:
+  br label %exit
+
+check.zero:
+  %zero = icmp eq i32 %x, 0
+  br i1 %zero, label %is.zero, label %check.small
+
+is.zero:
+  br label %exit
+
+check.small:
+  %small = icmp slt i32 %x, 10
+  br i1 %small, label %is.small, label %check.odd
+
+is.small:
+  br label %exit
+
+check.odd:
+  %bit = and i32 %x, 1
+  %odd = icmp ne i32 %bit, 0
+  br i1 %odd, label %exit, label %is.even
+
+is.even:
+  br label %exit
+
+exit:
+  %class.acc = phi i32 [ 0, %negative ], [ 1, %is.zero ], [ 2, %is.small ], [ 3, %check.odd ], [ 4, %is.even ]
+  ret i32 %class.acc
+}
+
+; 15 blocks, above MaxBlocks and left alone
+define i32 @huge(i32 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %b12 ]
+  %huge.acc = phi i32 [ 0, %entry ], [ %a12, %b12 ]
+  %done = icmp eq i32 %i, %n
+  br i1 %done, label %exit, label %b1
+
+b1:
+  %a1 = add i32 %huge.acc, 1
+  br label %b2
+
+b2:
+  %a2 = add i32 %a1, 2
+  br label %b3
+
+b3:
+  %a3 = add i32 %a2, 3
+  br label %b4
+
+b4:
+  %a4 = add i32 %a3, 4
+  br label %b5
+
+b5:
+  %a5 = add i32 %a4, 5
+  br label %b6
+
+b6:
+  %a6 = add i32 %a5, 6
+  br label %b7
+
+b7:
+  %a7 = add i32 %a6, 7
+  br label %b8
+
+b8:
+  %a8 = add i32 %a7, 8
+  br label %b9
+
+b9:
+  %a9 = add i32 %a8, 9
+  br label %b10
+
+b10:
+  %a10 = add i32 %a9, 10
+  br label %b11
+
+b11:
+  %a11 = add i32 %a10, 11
+  br label %b12
+
+b12:
+  %a12 = add i32 %a11, 12
+  %i.next = add i32 %i, 1
+  br label %loop
+
+exit:
+  ret i32 %huge.acc
+}
+define i32 @main() {
+entry:
+  %h = call i32 @huge(i32 2)
+  %c0 = call i32 @classify(i32 11)
+  %c1 = call i32 @classify(i32 0)
+  %c2 = call i32 @classify(i32 -5)
+  %c3 = call i32 @classify(i32 7)
+  %r = call i32 (ptr, ...) @printf(ptr @.str.fmt, i32 %h, i32 %c0, i32 %c1, i32 %c2, i32 %c3)
+  ret i32 0
+}
@@ -0,0 +1,51 @@
+; Flattening followed by the recovery pipeline (Recover: 1). The stack
+; slots fixStack gives values that do not cross the dispatcher are promoted
+; again, the dispatch state stays in memory.
+; CHECK: 30 even
+; CHECK-NOT: %s2.reg2mem = alloca
+; CHECK-IR: %switchVar = alloca i64, align 8, !goron.dispatch
+
+@.str.fmt = private unnamed_addr constant [7 x i8] c"%d %s\0A\00", align 1
+@.str.odd = private unnamed_addr constant [4 x i8] c"odd\00", align 1
+@.str.even = private unnamed_addr constant [5 x i8] c"even\00", align 1
+
+declare i32 @printf(ptr, ...)
+
+define i32 @sum(i32 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %body ]
+  %acc = phi i32 [ 0, %entry ], [ %acc.next, %body ]
+  %done = icmp sgt i32 %i, %n
+  br i1 %done, label %exit, label %body
+
+body:
+  %acc.next = add i32 %acc, %i
+  %next = add i32 %i, 1
+  br label %loop
+
+exit:
+  ret i32 %acc
+}
+
+define i32 @main() {
+entry:
+  %s = call i32 @sum(i32 7)
+  %s2 = add i32 %s, 2
+  %bit = and i32 %s, 1
+  %odd = icmp ne i32 %bit, 0
+  br i1 %odd, label %o, label %e
+
+o:
+  br label %print
+
+e:
+  br label %print
+
+print:
+  %name = phi ptr [ @.str.odd, %o ], [ @.str.even, %e ]
+  %r = call i32 (ptr, ...) @printf(ptr @.str.fmt, i32 %s2, ptr %name)
+  ret i32 0
+}
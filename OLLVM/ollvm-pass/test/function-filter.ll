@@ -0,0 +1,39 @@
+; Functions selected by the root Filter (exact names, glob characters taken
+; literally) and Include (patterns, matched against demangled names too).
+; user_goron_helper must not be mistaken for a function of the plugin.
+; CHECK: alpha beta gamma
+; CHECK-NOT: c"alpha\00"
+; CHECK-NOT: c"beta\00"
+; CHECK-NOT: c"gamma\00"
+
+@.str.alpha = private unnamed_addr constant [6 x i8] c"alpha\00", align 1
+@.str.beta = private unnamed_addr constant [5 x i8] c"beta\00", align 1
+@.str.gamma = private unnamed_addr constant [6 x i8] c"gamma\00", align 1
+@.str.fmt = private unnamed_addr constant [10 x i8] c"%s %s %s\0A\00", align 1
+
+declare i32 @printf(ptr, ...)
+
+; keep::first()
+define ptr @_ZN4keep5firstEv() {
+entry:
+  ret ptr @.str.alpha
+}
+
+define ptr @user_goron_helper() {
+entry:
+  ret ptr @.str.beta
+}
+
+define ptr @"exact[1]"() {
+entry:
+  ret ptr @.str.gamma
+}
+
+define i32 @main() {
+entry:
+  %a = call ptr @_ZN4keep5firstEv()
+  %b = call ptr @user_goron_helper()
+  %c = call ptr @"exact[1]"()
+  %r = call i32 (ptr, ...) @printf(ptr @.str.fmt, ptr %a, ptr %b, ptr %c)
+  ret i32 0
+}
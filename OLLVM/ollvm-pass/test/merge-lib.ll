@@ -0,0 +1,26 @@
+; Second module of the merge test, see merge.ll
+
+@.str.hello = private unnamed_addr constant [6 x i8] c"hello\00", align 1
+
+define internal i32 @add(i32 %a, i32 %b) {
+entry:
+  %r = add i32 %a, %b
+  ret i32 %r
+}
+
+define linkonce_odr i32 @twice(i32 %x) {
+entry:
+  %r = call i32 @add(i32 %x, i32 %x)
+  ret i32 %r
+}
+
+define ptr @lib_hello() {
+entry:
+  ret ptr @.str.hello
+}
+
+define i32 @lib_twice(i32 %x) {
+entry:
+  %r = call i32 @twice(i32 %x)
+  ret i32 %r
+}
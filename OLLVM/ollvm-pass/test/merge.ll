@@ -0,0 +1,37 @@
+; Linked with merge-lib.ll after both were obfuscated. Each brought its
+; copy of "hello", its string table and status bitmap, and its indirection
+; table for the inline function twice, of which the linker kept one.
+; irobf-merge leaves one of each; llvm-link gave the others a numeric suffix.
+; CHECK: hello hello 14
+; CHECK-NOT: @EncryptedStringTable.
+; CHECK-NOT: @DecryptStatusBitmap.
+; CHECK-NOT: @twice_IndirectCallees.
+
+@.str.hello = private unnamed_addr constant [6 x i8] c"hello\00", align 1
+@.str.fmt = private unnamed_addr constant [10 x i8] c"%s %s %d\0A\00", align 1
+
+declare i32 @printf(ptr, ...)
+declare ptr @lib_hello()
+declare i32 @lib_twice(i32)
+
+define internal i32 @add(i32 %a, i32 %b) {
+entry:
+  %r = add i32 %a, %b
+  ret i32 %r
+}
+
+define linkonce_odr i32 @twice(i32 %x) {
+entry:
+  %r = call i32 @add(i32 %x, i32 %x)
+  ret i32 %r
+}
+
+define i32 @main() {
+entry:
+  %h = call ptr @lib_hello()
+  %a = call i32 @twice(i32 3)
+  %b = call i32 @lib_twice(i32 4)
+  %s = add i32 %a, %b
+  %r = call i32 (ptr, ...) @printf(ptr @.str.fmt, ptr @.str.hello, ptr %h, i32 %s)
+  ret i32 0
+}
@@ -0,0 +1,115 @@
+# cmake -DOPT=... -DLLI=... -DPLUGIN=... -DPASSES=... -DCONFIG=... -DINPUT=... -DOUTPUT=...
+#       -P run_obf.cmake
+# cmake -DOBF_TOOL=... -DSHARDS=... -DLLI=... -DCONFIG=... -DINPUT=... -DOUTPUT=...
+#       -P run_obf.cmake
+# cmake -DOPT=... -DLLVM_LINK=... -DLINK_INPUT=... -DLLI=... -DPLUGIN=... -DPASSES=...
+#       -DCONFIG=... -DINPUT=... -DOUTPUT=... -P run_obf.cmake
+#
+# Obfuscates INPUT with the plugin, or with irvana-obf split into SHARDS
+# partitions, or INPUT and LINK_INPUT one by one, then links them and runs
+# irobf-merge over the result. The program is run with lli and what it
+# prints is compared with the "; CHECK: " line of INPUT, which the program
+# built from the unobfuscated input(s) must print as well. Each
+# "; CHECK-NOT: " line of INPUT is text that must not appear in the
+# obfuscated IR, and each "; CHECK-IR: " line text that must.
+if(OBF_TOOL)
+  # irvana-obf names the output after the input; -irobf runs the passes the
+  # configuration enables, as -passes=irobf does
+  get_filename_component(Dir ${OUTPUT} DIRECTORY)
+  get_filename_component(InputName ${INPUT} NAME_WE)
+  get_filename_component(OutputName ${OUTPUT} NAME_WE)
+  string(REPLACE "${InputName}" "" Suffix "${OutputName}")
+  execute_process(
+    COMMAND ${OBF_TOOL} -irobf -goron-cfg=${CONFIG} -shards=${SHARDS} -format=ll
+            -suffix=${Suffix} -o ${Dir} ${INPUT}
+    RESULT_VARIABLE Result)
+  if(NOT Result EQUAL 0)
+    message(FATAL_ERROR "irvana-obf failed: ${Result}")
+  endif()
+elseif(LINK_INPUT)
+  # each input is obfuscated on its own, as the Makefiles do per
+  # translation unit, and the plain inputs are linked for the reference run
+  set(Parts)
+  foreach(Source ${INPUT} ${LINK_INPUT})
+    get_filename_component(SourceName ${Source} NAME_WE)
+    string(REGEX REPLACE "\\.ll$" ".${SourceName}.ll" Part ${OUTPUT})
+    execute_process(
+      COMMAND ${OPT} -load ${PLUGIN} -load-pass-plugin=${PLUGIN} -goron-cfg=${CONFIG}
+              -passes=${PASSES} ${Source} -S -o ${Part}
+      RESULT_VARIABLE Result)
+    if(NOT Result EQUAL 0)
+      message(FATAL_ERROR "opt ${Source} failed: ${Result}")
+    endif()
+    list(APPEND Parts ${Part})
+  endforeach()
+  string(REGEX REPLACE "\\.ll$" ".plain.ll" Reference ${OUTPUT})
+  string(REGEX REPLACE "\\.ll$" ".linked.ll" Linked ${OUTPUT})
+  execute_process(
+    COMMAND ${LLVM_LINK} ${INPUT} ${LINK_INPUT} -S -o ${Reference}
+    RESULT_VARIABLE Result)
+  if(NOT Result EQUAL 0)
+    message(FATAL_ERROR "llvm-link failed: ${Result}")
+  endif()
+  execute_process(
+    COMMAND ${LLVM_LINK} ${Parts} -S -o ${Linked}
+    RESULT_VARIABLE Result)
+  if(NOT Result EQUAL 0)
+    message(FATAL_ERROR "llvm-link failed: ${Result}")
+  endif()
+  execute_process(
+    COMMAND ${OPT} -load ${PLUGIN} -load-pass-plugin=${PLUGIN}
+            "-passes=irobf(irobf-merge)" ${Linked} -S -o ${OUTPUT}
+    RESULT_VARIABLE Result)
+  if(NOT Result EQUAL 0)
+    message(FATAL_ERROR "opt irobf-merge failed: ${Result}")
+  endif()
+else()
+  execute_process(
+    COMMAND ${OPT} -load ${PLUGIN} -load-pass-plugin=${PLUGIN} -goron-cfg=${CONFIG}
+            -passes=${PASSES} ${INPUT} -S -o ${OUTPUT}
+    RESULT_VARIABLE Result)
+  if(NOT Result EQUAL 0)
+    message(FATAL_ERROR "opt failed: ${Result}")
+  endif()
+endif()
+if(NOT Reference)
+  set(Reference ${INPUT})
+endif()
+
+file(READ ${INPUT} Input)
+string(REGEX MATCH "; CHECK: ([^\n]*)" Expected "${Input}")
+set(Expected "${CMAKE_MATCH_1}")
+
+foreach(Program ${Reference} ${OUTPUT})
+  execute_process(
+    COMMAND ${LLI} ${Program}
+    OUTPUT_VARIABLE Output
+    RESULT_VARIABLE Result
+    TIMEOUT 30)
+  if(NOT Result EQUAL 0)
+    message(FATAL_ERROR "lli ${Program} failed: ${Result}")
+  endif()
+  string(STRIP "${Output}" Output)
+  if(NOT Output STREQUAL Expected)
+    message(FATAL_ERROR "${Program}: expected \"${Expected}\", got \"${Output}\"")
+  endif()
+endforeach()
+
+file(READ ${OUTPUT} Obfuscated)
+# without the leading "; ", which would split the list
+string(REGEX MATCHALL "CHECK-NOT: [^\n]*" Unexpected "${Input}")
+foreach(Line IN LISTS Unexpected)
+  string(REPLACE "CHECK-NOT: " "" Text "${Line}")
+  string(FIND "${Obfuscated}" "${Text}" Pos)
+  if(NOT Pos EQUAL -1)
+    message(FATAL_ERROR "found \"${Text}\" in ${OUTPUT}")
+  endif()
+endforeach()
+string(REGEX MATCHALL "CHECK-IR: [^\n]*" Wanted "${Input}")
+foreach(Line IN LISTS Wanted)
+  string(REPLACE "CHECK-IR: " "" Text "${Line}")
+  string(FIND "${Obfuscated}" "${Text}" Pos)
+  if(Pos EQUAL -1)
+    message(FATAL_ERROR "missing \"${Text}\" in ${OUTPUT}")
+  endif()
+endforeach()
@@ -0,0 +1,55 @@
+; Functions split across partitions by irvana-obf -shards:
+;
+;   static const int sentinel;            // address compared, not unnamed_addr
+;   const int *get(void) { return &sentinel; }
+;   int is_sentinel(const int *p) { return p == &sentinel; }
+;
+; Both partitions must refer to the one sentinel. The string literal is
+; unnamed_addr and copied into each partition, and the unnamed global gets
+; its empty name back.
+; CHECK: same 7 shared shared
+; CHECK-NOT: __irvana_shard_unnamed
+
+@sentinel = internal constant i32 0, align 4
+@.str.shared = private unnamed_addr constant [7 x i8] c"shared\00", align 1
+@.str.fmt = private unnamed_addr constant [13 x i8] c"%s %d %s %s\0A\00", align 1
+@.str.same = private unnamed_addr constant [5 x i8] c"same\00", align 1
+@.str.diff = private unnamed_addr constant [10 x i8] c"different\00", align 1
+@0 = internal global i32 7, align 4
+
+declare i32 @printf(ptr, ...)
+
+define ptr @get() noinline {
+entry:
+  ret ptr @sentinel
+}
+
+define ptr @name_a() noinline {
+entry:
+  ret ptr @.str.shared
+}
+
+define i32 @is_sentinel(ptr %p) noinline {
+entry:
+  %c = icmp eq ptr %p, @sentinel
+  %r = zext i1 %c to i32
+  ret i32 %r
+}
+
+define ptr @name_b() noinline {
+entry:
+  ret ptr @.str.shared
+}
+
+define i32 @main() {
+entry:
+  %p = call ptr @get()
+  %s = call i32 @is_sentinel(ptr %p)
+  %c = icmp ne i32 %s, 0
+  %w = select i1 %c, ptr @.str.same, ptr @.str.diff
+  %v = load i32, ptr @0, align 4
+  %a = call ptr @name_a()
+  %b = call ptr @name_b()
+  %r = call i32 (ptr, ...) @printf(ptr @.str.fmt, ptr %w, i32 %v, ptr %a, ptr %b)
+  ret i32 0
+}
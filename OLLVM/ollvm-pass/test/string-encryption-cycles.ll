@@ -0,0 +1,52 @@
+; Constant string users that refer to themselves or to each other:
+;
+;   struct node { const char *name; const struct node *next; };
+;   static const struct node self = {"self", &self};
+;   static const struct node a = {"a", &b}, b = {"b", &a};
+;
+; and the same with 16 more elements, above MinTemplateElements, so they are
+; copied from a template instead of stored element by element. Their
+; initializers used to wait on their own status slot forever.
+; CHECK: self a b a big c d
+
+%struct.node = type { ptr, ptr }
+%struct.bignode = type { ptr, ptr, [16 x i32] }
+
+@.str.self = private unnamed_addr constant [5 x i8] c"self\00", align 1
+@.str.a = private unnamed_addr constant [2 x i8] c"a\00", align 1
+@.str.b = private unnamed_addr constant [2 x i8] c"b\00", align 1
+@.str.big = private unnamed_addr constant [4 x i8] c"big\00", align 1
+@.str.c = private unnamed_addr constant [2 x i8] c"c\00", align 1
+@.str.d = private unnamed_addr constant [2 x i8] c"d\00", align 1
+@.str.fmt = private unnamed_addr constant [22 x i8] c"%s %s %s %s %s %s %s\0A\00", align 1
+
+@self = internal constant %struct.node { ptr @.str.self, ptr @self }, align 8
+@a = internal constant %struct.node { ptr @.str.a, ptr @b }, align 8
+@b = internal constant %struct.node { ptr @.str.b, ptr @a }, align 8
+@big = internal constant %struct.bignode { ptr @.str.big, ptr @big, [16 x i32] [i32 1, i32 2, i32 3, i32 4, i32 5, i32 6, i32 7, i32 8, i32 9, i32 10, i32 11, i32 12, i32 13, i32 14, i32 15, i32 16] }, align 8
+@c = internal constant %struct.bignode { ptr @.str.c, ptr @d, [16 x i32] [i32 1, i32 2, i32 3, i32 4, i32 5, i32 6, i32 7, i32 8, i32 9, i32 10, i32 11, i32 12, i32 13, i32 14, i32 15, i32 16] }, align 8
+@d = internal constant %struct.bignode { ptr @.str.d, ptr @c, [16 x i32] [i32 1, i32 2, i32 3, i32 4, i32 5, i32 6, i32 7, i32 8, i32 9, i32 10, i32 11, i32 12, i32 13, i32 14, i32 15, i32 16] }, align 8
+
+declare i32 @printf(ptr, ...)
+
+define i32 @main() {
+entry:
+  %self.next = load ptr, ptr getelementptr inbounds (%struct.node, ptr @self, i32 0, i32 1), align 8
+  %self.name = load ptr, ptr %self.next, align 8
+  ; b first, so the cycle is entered from the user that comes second
+  %b.next = load ptr, ptr getelementptr inbounds (%struct.node, ptr @b, i32 0, i32 1), align 8
+  %a.name = load ptr, ptr %b.next, align 8
+  %a.next.ptr = getelementptr inbounds %struct.node, ptr %b.next, i32 0, i32 1
+  %a.next = load ptr, ptr %a.next.ptr, align 8
+  %b.name = load ptr, ptr %a.next, align 8
+  %a.name2 = load ptr, ptr @a, align 8
+  %big.next = load ptr, ptr getelementptr inbounds (%struct.bignode, ptr @big, i32 0, i32 1), align 8
+  %big.name = load ptr, ptr %big.next, align 8
+  %d.next = load ptr, ptr getelementptr inbounds (%struct.bignode, ptr @d, i32 0, i32 1), align 8
+  %c.name = load ptr, ptr %d.next, align 8
+  %c.next.ptr = getelementptr inbounds %struct.bignode, ptr %d.next, i32 0, i32 1
+  %c.next = load ptr, ptr %c.next.ptr, align 8
+  %d.name = load ptr, ptr %c.next, align 8
+  %r = call i32 (ptr, ...) @printf(ptr @.str.fmt, ptr %self.name, ptr %a.name, ptr %b.name, ptr %a.name2, ptr %big.name, ptr %c.name, ptr %d.name)
+  ret i32 0
+}
@@ -0,0 +1,37 @@
+; Strings decrypted by a module constructor, referenced from a mutable table
+; and from a constant one:
+;
+;   const char *names[] = {"alpha", "beta"};
+;   static const char *const fixed[] = {"gamma"};
+;
+; Both tables point into the decrypted pool, so no plaintext string is left.
+; CHECK: beta alpha gamma delta
+; CHECK-NOT: c"alpha\00"
+; CHECK-NOT: c"beta\00"
+; CHECK-NOT: c"gamma\00"
+; CHECK-NOT: c"delta\00"
+
+@.str.alpha = private unnamed_addr constant [6 x i8] c"alpha\00", align 1
+@.str.beta = private unnamed_addr constant [5 x i8] c"beta\00", align 1
+@.str.gamma = private unnamed_addr constant [6 x i8] c"gamma\00", align 1
+@.str.delta = private unnamed_addr constant [6 x i8] c"delta\00", align 1
+@.str.fmt = private unnamed_addr constant [13 x i8] c"%s %s %s %s\0A\00", align 1
+
+@names = global [2 x ptr] [ptr @.str.alpha, ptr @.str.beta], align 8
+@fixed = internal constant [1 x ptr] [ptr @.str.gamma], align 8
+
+declare i32 @printf(ptr, ...)
+
+define i32 @main() {
+entry:
+  ; the table is written like any other global
+  %first = load ptr, ptr @names, align 8
+  %second = load ptr, ptr getelementptr inbounds ([2 x ptr], ptr @names, i64 0, i64 1), align 8
+  store ptr %second, ptr @names, align 8
+  store ptr %first, ptr getelementptr inbounds ([2 x ptr], ptr @names, i64 0, i64 1), align 8
+  %n0 = load ptr, ptr @names, align 8
+  %n1 = load ptr, ptr getelementptr inbounds ([2 x ptr], ptr @names, i64 0, i64 1), align 8
+  %g = load ptr, ptr @fixed, align 8
+  %r = call i32 (ptr, ...) @printf(ptr @.str.fmt, ptr %n0, ptr %n1, ptr %g, ptr @.str.delta)
+  ret i32 0
+}
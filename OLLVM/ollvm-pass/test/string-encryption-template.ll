@@ -0,0 +1,55 @@
+; A constant string user big enough to be copied from a template:
+;
+;   static int local = 40;
+;   int shared = 2;
+;   static const struct table {
+;     const char *names[5]; int *local; int *shared; int values[16];
+;   } table = {{"zero", "one", "two", "three", "four"}, &local, &shared,
+;              {0, 1, ..., 15}};
+;
+; The strings and &local are patched by the fixup loop, &shared is not local
+; and stays in the template.
+; CHECK: zero one two three four 57
+; CHECK-NOT: c"zero\00"
+; CHECK-NOT: c"four\00"
+; CHECK-IR: @tpl_table =
+; CHECK-IR: ptr null, ptr @shared, [16 x i32]
+; CHECK-IR: @fixups_table =
+
+%struct.table = type { [5 x ptr], ptr, ptr, [16 x i32] }
+
+@.str.zero = private unnamed_addr constant [5 x i8] c"zero\00", align 1
+@.str.one = private unnamed_addr constant [4 x i8] c"one\00", align 1
+@.str.two = private unnamed_addr constant [4 x i8] c"two\00", align 1
+@.str.three = private unnamed_addr constant [6 x i8] c"three\00", align 1
+@.str.four = private unnamed_addr constant [5 x i8] c"four\00", align 1
+@.str.fmt = private unnamed_addr constant [19 x i8] c"%s %s %s %s %s %d\0A\00", align 1
+
+@local = internal global i32 40, align 4
+@shared = global i32 2, align 4
+@table = internal constant %struct.table {
+  [5 x ptr] [ptr @.str.zero, ptr @.str.one, ptr @.str.two, ptr @.str.three, ptr @.str.four],
+  ptr @local, ptr @shared,
+  [16 x i32] [i32 0, i32 1, i32 2, i32 3, i32 4, i32 5, i32 6, i32 7,
+              i32 8, i32 9, i32 10, i32 11, i32 12, i32 13, i32 14, i32 15]
+}, align 8
+
+declare i32 @printf(ptr, ...)
+
+define i32 @main() {
+entry:
+  %n0 = load ptr, ptr @table, align 8
+  %n1 = load ptr, ptr getelementptr inbounds (%struct.table, ptr @table, i64 0, i32 0, i64 1), align 8
+  %n2 = load ptr, ptr getelementptr inbounds (%struct.table, ptr @table, i64 0, i32 0, i64 2), align 8
+  %n3 = load ptr, ptr getelementptr inbounds (%struct.table, ptr @table, i64 0, i32 0, i64 3), align 8
+  %n4 = load ptr, ptr getelementptr inbounds (%struct.table, ptr @table, i64 0, i32 0, i64 4), align 8
+  %pl = load ptr, ptr getelementptr inbounds (%struct.table, ptr @table, i64 0, i32 1), align 8
+  %ps = load ptr, ptr getelementptr inbounds (%struct.table, ptr @table, i64 0, i32 2), align 8
+  %l = load i32, ptr %pl, align 4
+  %s = load i32, ptr %ps, align 4
+  %v = load i32, ptr getelementptr inbounds (%struct.table, ptr @table, i64 0, i32 3, i64 15), align 4
+  %ls = add i32 %l, %s
+  %sum = add i32 %ls, %v
+  %r = call i32 (ptr, ...) @printf(ptr @.str.fmt, ptr %n0, ptr %n1, ptr %n2, ptr %n3, ptr %n4, i32 %sum)
+  ret i32 0
+}